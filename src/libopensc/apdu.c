@@ -26,6 +26,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
@@ -188,16 +191,67 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	if (nbuf == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	/* encode the APDU in the buffer */
-	if (sc_apdu2bytes(ctx, apdu, proto, nbuf, nlen) != SC_SUCCESS) {
+	if (sc_apdu_encode(ctx, apdu, proto, nbuf, nlen, len) != SC_SUCCESS) {
 		free(nbuf);
 		return SC_ERROR_INTERNAL;
 	}
 	*buf = nbuf;
+
+	return SC_SUCCESS;
+}
+
+int sc_apdu_encode(sc_context_t *ctx, const sc_apdu_t *apdu, unsigned int proto,
+	u8 *buf, size_t buflen, size_t *len)
+{
+	size_t	nlen;
+
+	if (apdu == NULL || buf == NULL || len == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	nlen = sc_apdu_get_length(apdu, proto);
+	if (nlen == 0)
+		return SC_ERROR_INTERNAL;
+	if (nlen > buflen)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	if (sc_apdu2bytes(ctx, apdu, proto, buf, nlen) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
 	*len = nlen;
 
 	return SC_SUCCESS;
 }
 
+int sc_apdu_buffer_reserve(sc_apdu_buffer_t *buffer, size_t len)
+{
+	u8	*nbuf;
+
+	if (buffer == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (len <= buffer->size)
+		return SC_SUCCESS;
+
+	/* the old content has been cleared after use, no need to copy it */
+	nbuf = malloc(len);
+	if (nbuf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	free(buffer->value);
+	buffer->value = nbuf;
+	buffer->size = len;
+
+	return SC_SUCCESS;
+}
+
+void sc_apdu_buffer_free(sc_apdu_buffer_t *buffer)
+{
+	if (buffer == NULL)
+		return;
+	if (buffer->value != NULL) {
+		sc_mem_clear(buffer->value, buffer->size);
+		free(buffer->value);
+	}
+	buffer->value = NULL;
+	buffer->size = 0;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -222,6 +276,115 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 }
 
 
+/*********************************************************************/
+/*   APDU trace recording                                            */
+/*********************************************************************/
+
+static unsigned long
+sc_trace_now(void)
+{
+#ifdef _WIN32
+	return GetTickCount() * 1000UL;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000UL + tv.tv_usec;
+#endif
+}
+
+static u8 *
+sc_trace_put_u32(u8 *p, unsigned long value)
+{
+	*p++ = (value >> 24) & 0xFF;
+	*p++ = (value >> 16) & 0xFF;
+	*p++ = (value >> 8) & 0xFF;
+	*p++ = value & 0xFF;
+	return p;
+}
+
+/* Number of the reader in the trace records */
+static u8
+sc_trace_reader(struct sc_reader *reader)
+{
+	int idx = list_locate(&reader->ctx->readers, reader);
+
+	return (idx < 0 || idx > 0xFE) ? 0xFF : (u8)idx;
+}
+
+/* Each record is written with a single call under the trace mutex, so
+ * that the records of concurrent threads do not interleave */
+static void
+sc_trace_write(struct sc_context *ctx, const u8 *rec, size_t len)
+{
+	sc_mutex_lock(ctx, ctx->apdu_trace_mutex);
+	if (fwrite(rec, 1, len, ctx->apdu_trace) == len)
+		fflush(ctx->apdu_trace);
+	sc_mutex_unlock(ctx, ctx->apdu_trace_mutex);
+}
+
+void
+sc_apdu_trace_atr(struct sc_reader *reader)
+{
+	u8 rec[3 + SC_MAX_ATR_SIZE];
+
+	if (reader->ctx->apdu_trace == NULL || reader->atr.len > SC_MAX_ATR_SIZE)
+		return;
+	rec[0] = SC_APDU_TRACE_ATR;
+	rec[1] = sc_trace_reader(reader);
+	rec[2] = (u8)reader->atr.len;
+	memcpy(rec + 3, reader->atr.value, reader->atr.len);
+	sc_trace_write(reader->ctx, rec, 3 + reader->atr.len);
+}
+
+int
+sc_trace_transmit(struct sc_card *card, struct sc_apdu *apdu)
+{
+	struct sc_context *ctx = card->ctx;
+	unsigned long start, elapsed;
+	u8 *sbuf = NULL, *rec, *p;
+	size_t slen, rlen, reclen;
+	int rv;
+
+	if (ctx->apdu_trace == NULL)
+		return card->reader->ops->transmit(card->reader, apdu);
+
+	/* encode the command before the reader driver touches the APDU */
+	rv = sc_apdu_get_octets(ctx, apdu, &sbuf, &slen, SC_PROTO_RAW);
+	if (rv != SC_SUCCESS)
+		return rv;
+
+	start = sc_trace_now();
+	rv = card->reader->ops->transmit(card->reader, apdu);
+	elapsed = sc_trace_now() - start;
+
+	rlen = apdu->resplen;
+	reclen = 2 + 4 + 4 + slen + 4 + rlen + 2;
+	if (rv == SC_SUCCESS && (rec = malloc(reclen)) != NULL) {
+		p = rec;
+		*p++ = SC_APDU_TRACE_EXCHANGE;
+		*p++ = sc_trace_reader(card->reader);
+		p = sc_trace_put_u32(p, elapsed);
+		p = sc_trace_put_u32(p, (unsigned long)slen);
+		memcpy(p, sbuf, slen);
+		p += slen;
+		p = sc_trace_put_u32(p, (unsigned long)(rlen + 2));
+		if (rlen)
+			memcpy(p, apdu->resp, rlen);
+		p += rlen;
+		*p++ = apdu->sw1 & 0xFF;
+		*p++ = apdu->sw2 & 0xFF;
+		sc_trace_write(ctx, rec, reclen);
+		sc_mem_clear(rec, reclen);
+		free(rec);
+	}
+
+	sc_mem_clear(sbuf, slen);
+	free(sbuf);
+	return rv;
+}
+
+
 /*********************************************************************/
 /*   higher level APDU transfer handling functions                   */
 /*********************************************************************/
@@ -384,7 +547,7 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 #endif
 
 	/* send APDU to the reader driver */
-	rv = card->reader->ops->transmit(card->reader, apdu);
+	rv = sc_trace_transmit(card, apdu);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -427,7 +590,7 @@ static int
 sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 {
 	struct sc_context *ctx  = card->ctx;
-	size_t le, minlen, buflen;
+	size_t le, buflen;
 	unsigned char *buf;
 	int rv;
 
@@ -454,48 +617,41 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 
 	/* 0x6100 means at least 256 more bytes to read */
 	le = apdu->sw2 != 0 ? (size_t)apdu->sw2 : 256;
-	/* we try to read at least as much as bytes as promised in the response bytes */
-	minlen = le;
 
-	do {
-		unsigned char resp[256];
+	while (buflen != 0) {
 		size_t resp_len = le;
 
-		/* call GET RESPONSE to get more date from the card;
-		 * note: GET RESPONSE returns the left amount of data (== SW2) */
-		memset(resp, 0, sizeof(resp));
-		rv = card->ops->get_response(card, &resp_len, resp);
+		/* with an extended length capable card and reader, 0x6100 is
+		 * answered with a single GET RESPONSE for everything that fits */
+		if (le == 256 && (card->caps & SC_CARD_CAP_APDU_EXT)
+				&& card->reader->active_protocol != SC_PROTO_T0)
+			resp_len = sc_get_max_recv_size(card);
+		/* never ask for more than the caller can take */
+		if (resp_len > buflen)
+			resp_len = buflen;
+
+		/* call GET RESPONSE to get more date from the card, straight into
+		 * the caller's buffer; note: GET RESPONSE returns the left amount
+		 * of data (== SW2) */
+		rv = card->ops->get_response(card, &resp_len, buf);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
 			if (resp_len)   {
-				sc_log_hex(ctx, "SM response data", resp, resp_len);
-				sc_sm_update_apdu_response(card, resp, resp_len, rv, apdu);
+				sc_log_hex(ctx, "SM response data", buf, resp_len);
+				sc_sm_update_apdu_response(card, buf, resp_len, rv, apdu);
 			}
 #endif
 			LOG_TEST_RET(ctx, rv, "GET RESPONSE error");
 		}
 
-		le = resp_len;
-		/* copy as much as will fit in requested buffer */
-		if (buflen < le)
-			le = buflen;
-
-		memcpy(buf, resp, le);
-		buf    += le;
-		buflen -= le;
+		buf    += resp_len;
+		buflen -= resp_len;
 
-		/* we have all the data the caller requested even if the card has more data */
-		if (buflen == 0)
+		/* 0x9000: the card has no more data */
+		if (rv == 0)
 			break;
-
-		minlen -= le;
-		if (rv != 0)
-			le = minlen = (size_t)rv;
-		else
-			/* if the card has returned 0x9000 but we still expect data ask for more
-			 * until we have read enough bytes */
-			le = minlen;
-	} while (rv != 0 && minlen != 0);
+		le = (size_t)rv;
+	}
 
 	/* we've read all data, let's return 0x9000 */
 	apdu->resplen = buf - apdu->resp;
@@ -1559,6 +1559,46 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 	return 0;
 }
 
+/* Header of the next element in the stream, decoded once per position
+ * and matched against the template entries with a single comparison */
+struct asn1_next_tag {
+	const u8 *pos;
+	const u8 *obj;
+	size_t objlen;
+	unsigned int tag;
+};
+
+/*
+ * Templates are copied onto the caller's stack before every decode and
+ * SEQUENCE members must match in template order, so entries are still
+ * walked linearly; only the tag of the next object is parsed once and
+ * compared against each candidate entry instead of re-reading it.
+ */
+static void asn1_peek_tag(const u8 *p, size_t left, struct asn1_next_tag *next)
+{
+	const u8 *obj = p;
+	unsigned int cla, tag;
+	size_t taglen;
+
+	next->pos = p;
+	next->obj = NULL;
+	next->objlen = 0;
+	next->tag = 0;
+	if (sc_asn1_read_tag(&obj, left, &cla, &tag, &taglen) != SC_SUCCESS || obj == NULL)
+		return;
+	if (tag & ~SC_ASN1_TAG_MASK)
+		return;
+	if (taglen > left - (size_t)(obj - p))
+		return;
+
+	/* Same layout as the 'tag' field of struct sc_asn1_entry */
+	next->tag = ((cla & SC_ASN1_TAG_CLASS) << 22) | tag;
+	if (cla & SC_ASN1_TAG_CONSTRUCTED)
+		next->tag |= SC_ASN1_CONS;
+	next->obj = obj;
+	next->objlen = taglen;
+}
+
 static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 		       const u8 *in, size_t len, const u8 **newp, size_t *len_left,
 		       int choice, int depth)
@@ -1566,6 +1606,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 	int r, idx = 0;
 	const u8 *p = in, *obj;
 	struct sc_asn1_entry *entry = asn1;
+	struct asn1_next_tag next = { NULL, NULL, 0, 0 };
 	size_t left = len, objlen;
 
 	sc_debug(ctx, SC_LOG_DEBUG_ASN1,
@@ -1606,7 +1647,17 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 			goto decode_ok;
 		}
 
-		obj = sc_asn1_skip_tag(ctx, &p, &left, entry->tag, &objlen);
+		/* Optional entries that are not present are skipped
+		 * without parsing the element header again */
+		if (next.pos != p)
+			asn1_peek_tag(p, left, &next);
+		obj = NULL;
+		if (next.obj != NULL && next.tag == (entry->tag & (SC_ASN1_CLASS_MASK | SC_ASN1_CONS | SC_ASN1_TAG_MASK))) {
+			obj = next.obj;
+			objlen = next.objlen;
+			left -= (obj - p) + objlen;
+			p = obj + objlen;
+		}
 		if (obj == NULL) {
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "'%s' not present\n", entry->name);
 			if (choice)
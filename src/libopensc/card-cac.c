@@ -153,15 +153,31 @@ typedef struct cac_object {
 #define CAC_OBJECT_TYPE_CERT		1
 #define CAC_OBJECT_TYPE_TLV_FILE	4
 
+/*
+ * Objects already read and converted by read_binary, so that selecting
+ * them again does not need to fetch the TL and V buffers again.
+ * The least recently used one is dropped when all the entries are in use.
+ */
+#define CAC_CACHE_SIZE			16
+
+typedef struct cac_cache_entry {
+	sc_path_t path;			/* path the object was selected with */
+	int object_type;
+	u8 *data;			/* NULL for a free entry */
+	size_t data_len;
+	unsigned long last_use;
+} cac_cache_entry_t;
+
 /*
  * CAC private data per card state
  */
 typedef struct cac_private_data {
 	int object_type;		/* select set this so we know how to read the file */
 	int cert_next;			/* index number for the next certificate found in the list */
-	u8 *cache_buf;			/* cached version of the currently selected file */
-	size_t cache_buf_len;		/* length of the cached selected file */
-	int cached;			/* is the cached selected file valid */
+	sc_path_t selected_path;	/* path of the currently selected file */
+	cac_cache_entry_t cache[CAC_CACHE_SIZE];	/* objects already read */
+	cac_cache_entry_t *cached;	/* entry of the currently selected file, if read */
+	unsigned long cache_clock;	/* counter used to find the least recently used entry */
 	cac_cuid_t cuid;                /* card unique ID from the CCC */
 	u8 *cac_id;                     /* card serial number */
 	size_t cac_id_len;              /* card serial number len */
@@ -206,8 +222,11 @@ static cac_private_data_t *cac_new_private_data(void)
 
 static void cac_free_private_data(cac_private_data_t *priv)
 {
+	int i;
+
 	free(priv->cac_id);
-	free(priv->cache_buf);
+	for (i = 0; i < CAC_CACHE_SIZE; i++)
+		free(priv->cache[i].data);
 	free(priv->aca_path);
 	list_destroy(&priv->pki_list);
 	list_destroy(&priv->general_list);
@@ -215,6 +234,58 @@ static void cac_free_private_data(cac_private_data_t *priv)
 	return;
 }
 
+/*
+ * Object cache operations
+ */
+static int cac_cache_path_equal(const sc_path_t *a, const sc_path_t *b)
+{
+	return a->type == b->type && a->len == b->len
+		&& memcmp(a->value, b->value, a->len) == 0
+		&& a->aid.len == b->aid.len
+		&& memcmp(a->aid.value, b->aid.value, a->aid.len) == 0;
+}
+
+static cac_cache_entry_t *
+cac_cache_lookup(cac_private_data_t *priv, const sc_path_t *path, int object_type)
+{
+	int i;
+
+	for (i = 0; i < CAC_CACHE_SIZE; i++) {
+		cac_cache_entry_t *entry = &priv->cache[i];
+
+		if (entry->data != NULL && entry->object_type == object_type
+				&& cac_cache_path_equal(&entry->path, path)) {
+			entry->last_use = ++priv->cache_clock;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* the cache takes over data */
+static cac_cache_entry_t *
+cac_cache_add(cac_private_data_t *priv, const sc_path_t *path, int object_type, u8 *data, size_t data_len)
+{
+	cac_cache_entry_t *entry = &priv->cache[0];
+	int i;
+
+	for (i = 0; i < CAC_CACHE_SIZE; i++) {
+		if (priv->cache[i].data == NULL) {
+			entry = &priv->cache[i];
+			break;
+		}
+		if (priv->cache[i].last_use < entry->last_use)
+			entry = &priv->cache[i];
+	}
+	free(entry->data);
+	entry->path = *path;
+	entry->object_type = object_type;
+	entry->data = data;
+	entry->data_len = data_len;
+	entry->last_use = ++priv->cache_clock;
+	return entry;
+}
+
 static int cac_add_object_to_list(list_t *list, const cac_object_t *object)
 {
 	if (list_append(list, object) < 0)
@@ -581,6 +652,8 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	int r = 0;
 	u8 *tl = NULL, *val = NULL;
 	u8 *tl_ptr, *val_ptr, *tlv_ptr, *tl_start;
+	u8 *cache_buf = NULL;
+	size_t cache_buf_len = 0;
 	u8 *cert_ptr;
 	size_t tl_len, val_len, tlv_len;
 	size_t len, tl_head_len, cert_len;
@@ -588,28 +661,19 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
-	/* if we didn't return it all last time, return the remainder */
+	/* if the object was already read, return it from the cache */
 	if (priv->cached) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
 			 "returning cached value idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
 			 idx, count);
-		if (idx > priv->cache_buf_len) {
+		if (idx > priv->cached->data_len) {
 			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_FILE_END_REACHED);
 		}
-		len = MIN(count, priv->cache_buf_len-idx);
-		memcpy(buf, &priv->cache_buf[idx], len);
+		len = MIN(count, priv->cached->data_len-idx);
+		memcpy(buf, &priv->cached->data[idx], len);
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, len);
 	}
 
-	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
-		 "clearing cache idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
-		 idx, count);
-	if (priv->cache_buf) {
-		free(priv->cache_buf);
-		priv->cache_buf = NULL;
-		priv->cache_buf_len = 0;
-	}
-
 
 	if (priv->object_type <= 0)
 		 SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
@@ -643,14 +707,14 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	switch (priv->object_type) {
 	case CAC_OBJECT_TYPE_TLV_FILE:
 		tlv_len = tl_len + val_len;
-		priv->cache_buf = malloc(tlv_len);
-		if (priv->cache_buf == NULL) {
+		cache_buf = malloc(tlv_len);
+		if (cache_buf == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto done;
 		}
-		priv->cache_buf_len = tlv_len;
+		cache_buf_len = tlv_len;
 
-		for (tl_ptr = tl, val_ptr=val, tlv_ptr = priv->cache_buf;
+		for (tl_ptr = tl, val_ptr=val, tlv_ptr = cache_buf;
 				tl_len > 2 && val_len > 0 && tlv_len > 0;
 				val_len -= len, tlv_len -= len, val_ptr += len, tlv_ptr += len) {
 			/* get the tag and the length */
@@ -704,7 +768,7 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 		/* if the info byte is 1, then the cert is compressed, decompress it */
 		if ((cert_type & 0x3) == 1) {
 #ifdef ENABLE_ZLIB
-			r = sc_decompress_alloc(&priv->cache_buf, &priv->cache_buf_len,
+			r = sc_decompress_alloc(&cache_buf, &cache_buf_len,
 				cert_ptr, cert_len, COMPRESSION_AUTO);
 #else
 			sc_log(card->ctx, "CAC compression not supported, no zlib");
@@ -713,13 +777,13 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 			if (r)
 				goto done;
 		} else if (cert_len > 0) {
-			priv->cache_buf = malloc(cert_len);
-			if (priv->cache_buf == NULL) {
+			cache_buf = malloc(cert_len);
+			if (cache_buf == NULL) {
 				r = SC_ERROR_OUT_OF_MEMORY;
 				goto done;
 			}
-			priv->cache_buf_len = cert_len;
-			memcpy(priv->cache_buf, cert_ptr, cert_len);
+			cache_buf_len = cert_len;
+			memcpy(cache_buf, cert_ptr, cert_len);
 		} else {
 			sc_log(card->ctx, "Can't read zero-length certificate");
 			goto done;
@@ -732,11 +796,18 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	/* OK we've read the data, now copy the required portion out to the callers buffer */
-	priv->cached = 1;
-	len = MIN(count, priv->cache_buf_len-idx);
-	memcpy(buf, &priv->cache_buf[idx], len);
+	priv->cached = cac_cache_add(priv, &priv->selected_path, priv->object_type,
+		cache_buf, cache_buf_len);
+	cache_buf = NULL;
+	if (idx > priv->cached->data_len) {
+		r = SC_ERROR_FILE_END_REACHED;
+		goto done;
+	}
+	len = MIN(count, priv->cached->data_len-idx);
+	memcpy(buf, &priv->cached->data[idx], len);
 	r = len;
 done:
+	free(cache_buf);
 	if (tl)
 		free(tl);
 	if (val)
@@ -1066,13 +1137,9 @@ static int cac_select_file_by_type(sc_card_t *card, const sc_path_t *in_path, sc
 		if (cac_is_cert(priv, in_path)) {
 			priv->object_type = CAC_OBJECT_TYPE_CERT;
 		}
-		/* forget any old cacheed values */
-		if (priv->cache_buf) {
-			free(priv->cache_buf);
-			priv->cache_buf = NULL;
-		}
-		priv->cache_buf_len = 0;
-		priv->cached = 0;
+		/* use the object read when it was last selected, if any */
+		priv->selected_path = *in_path;
+		priv->cached = cac_cache_lookup(priv, in_path, priv->object_type);
 	}
 
 	if (in_path->aid.len) {
@@ -1154,6 +1221,8 @@ static int cac_select_file_by_type(sc_card_t *card, const sc_path_t *in_path, sc
 			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	file->path = *in_path;
 	file->size = CAC_MAX_SIZE; /* we don't know how big, just give a large size until we can read the file */
+	if (priv && priv->cached)
+		file->size = priv->cached->data_len;
 
 	*file_out = file;
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
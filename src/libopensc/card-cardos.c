@@ -26,6 +26,7 @@
 #endif
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "internal.h"
@@ -64,8 +65,13 @@ static struct sc_atr_table cardos_atrs[] = {
 	{ NULL, NULL, NULL, 0, 0, NULL }
 };
 
-static unsigned int algorithm_ids_in_tokeninfo[SC_MAX_SUPPORTED_ALGORITHMS];
-static unsigned int algorithm_ids_in_tokeninfo_count=0;
+struct cardos_driver_data {
+	/* signature algorithm IDs from the TokenInfo, see cardos_compute_signature() */
+	unsigned int algorithm_ids_in_tokeninfo[SC_MAX_SUPPORTED_ALGORITHMS];
+	unsigned int algorithm_ids_in_tokeninfo_count;
+};
+
+#define DRVDATA(card)	((struct cardos_driver_data *) ((card)->drv_data))
 
 static int cardos_match_card(sc_card_t *card)
 {
@@ -238,9 +244,23 @@ static int cardos_init(sc_card_t *card)
 		card->caps |= SC_CARD_CAP_ISO7816_PIN_INFO;
 	}
 
+	card->drv_data = calloc(1, sizeof(struct cardos_driver_data));
+	if (card->drv_data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	/* The card keeps the environment set by MSE until the next MSE or SELECT */
+	card->caps |= SC_CARD_CAP_REUSE_SEC_ENV;
+
 	return 0;
 }
 
+static int cardos_finish(sc_card_t *card)
+{
+	free(card->drv_data);
+	card->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
 static const struct sc_card_error cardos_errors[] = {
 /* some error inside the card */
 /* i.e. nothing you can do */
@@ -813,6 +833,7 @@ cardos_set_security_env(sc_card_t *card,
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Card returned error");
 
 	do   {
+		struct cardos_driver_data *priv = DRVDATA(card);
 		const struct sc_supported_algo_info* algorithm_info = env->supported_algos;
 		int i=0;
 		int algorithm_id_count = 0;
@@ -825,12 +846,12 @@ cardos_set_security_env(sc_card_t *card,
 
 				sc_log(card->ctx, "is signature");
 				sc_log(card->ctx, "Adding ID %d at index %d", algorithm_id, algorithm_id_count);
-				algorithm_ids_in_tokeninfo[algorithm_id_count++] = algorithm_id;
+				priv->algorithm_ids_in_tokeninfo[algorithm_id_count++] = algorithm_id;
 			}
 			sc_log(card->ctx, "reference=%d, mechanism=%d, operations=%d, algo_ref=%d",
 					alg.reference, alg.mechanism, alg.operations, alg.algo_ref);
 		}
-		algorithm_ids_in_tokeninfo_count = algorithm_id_count;
+		priv->algorithm_ids_in_tokeninfo_count = algorithm_id_count;
 	} while (0);
 
 	LOG_FUNC_RETURN(card->ctx, r);
@@ -896,7 +917,7 @@ cardos_compute_signature(sc_card_t *card, const u8 *data, size_t datalen,
 	 * 1. We check for several caps flags (as set in card->caps), to pervent generating
 	 *    invalid signatures with duplicated hash prefixes with some cards
 	 * 2. Use the information from AlgorithmInfo of the TokenInfo file.
-	 *    This information is parsed in set_security_env and stored in a static variable.
+	 *    This information is parsed in set_security_env and stored in the driver data.
 	 *    The problem is, that that information is only available for the whole token and not
 	      for a specific key, so if both operations are present, we can only do trial and error
 	 *
@@ -915,9 +936,10 @@ cardos_compute_signature(sc_card_t *card, const u8 *data, size_t datalen,
 	}
 	else  {
 		/* check the the algorithmIDs from the AlgorithmInfo */
+		struct cardos_driver_data *priv = DRVDATA(card);
 		size_t i;
-		for(i=0; i<algorithm_ids_in_tokeninfo_count;++i){
-			unsigned int id = algorithm_ids_in_tokeninfo[i];
+		for(i=0; i<priv->algorithm_ids_in_tokeninfo_count;++i){
+			unsigned int id = priv->algorithm_ids_in_tokeninfo[i];
 			if(id == 0x86 || id == 0x88)
 				do_rsa_sig = 1;
 			else if(id == 0x8C || id == 0x8A)
@@ -1201,6 +1223,18 @@ static int cardos_get_serialnr(sc_card_t *card, sc_serial_number_t *serial)
 static int
 cardos_card_ctl(sc_card_t *card, unsigned long cmd, void *ptr)
 {
+	/* Installing keys or environment definitions, or changing the life
+	 * cycle, may leave the card with an environment other than the one
+	 * cached by sc_set_security_env() */
+	switch (cmd) {
+	case SC_CARDCTL_CARDOS_PUT_DATA_OCI:
+	case SC_CARDCTL_CARDOS_PUT_DATA_SECI:
+	case SC_CARDCTL_CARDOS_GENERATE_KEY:
+	case SC_CARDCTL_LIFECYCLE_SET:
+		card->cache.sec_env_valid = 0;
+		break;
+	}
+
 	switch (cmd) {
 	case SC_CARDCTL_CARDOS_PUT_DATA_FCI:
 		break;
@@ -1301,6 +1335,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	cardos_ops = *iso_ops;
 	cardos_ops.match_card = cardos_match_card;
 	cardos_ops.init = cardos_init;
+	cardos_ops.finish = cardos_finish;
 	cardos_ops.select_file = cardos_select_file;
 	cardos_ops.create_file = cardos_create_file;
 	cardos_ops.set_security_env = cardos_set_security_env;
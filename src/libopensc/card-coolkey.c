@@ -29,6 +29,7 @@
 #endif
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -744,6 +745,23 @@ coolkey_v1_get_object_length(u8 *obj, size_t buf_len)
 	return len;
 }
 
+/*
+ * Entry of the hash of the objects by id. The CKA_CLASS and CKA_ID attributes used
+ * by the template searches are kept once they have been parsed out of the object.
+ */
+#define COOLKEY_INDEX_CLASS 0x01
+#define COOLKEY_INDEX_ID    0x02
+typedef struct coolkey_object_index {
+	sc_cardctl_coolkey_object_t *obj;	/* object in objects_list, NULL for a free slot */
+	int cacheable;				/* readable without login */
+	int attr_valid;				/* COOLKEY_INDEX_* */
+	sc_cardctl_coolkey_attribute_t class_attr;
+	sc_cardctl_coolkey_attribute_t id_attr;
+} coolkey_object_index_t;
+
+/* part of the status compared to find out if the objects on the token changed */
+#define COOLKEY_CACHE_STATUS_LEN offsetof(coolkey_status_t, logged_in_identities)
+
 /*
  * COOLKEY private data per card state
  */
@@ -762,6 +780,14 @@ typedef struct coolkey_private_data {
 	coolkey_cuid_t cuid;			/* card unique ID from the CCC */
 	sc_cardctl_coolkey_object_t *obj;	/* pointer to the current selected object */
 	list_t objects_list;			/* list of objects on the token */
+	coolkey_object_index_t *index;		/* objects hashed by id */
+	size_t index_size;			/* number of slots, a power of 2 */
+	size_t index_count;			/* number of used slots */
+	int use_file_cache;
+	int cache_dirty;			/* the cache file needs to be written */
+	int cache_status_valid;
+	coolkey_cuid_t cache_cuid;		/* cuid from the cplc data naming the cache file */
+	u8 cache_status[COOLKEY_CACHE_STATUS_LEN];	/* status when the objects were listed */
 	unsigned short key_id;			/* key id set by select */
 	int	algorithm;			/* saved from set_security_env */
 	int operation;				/* saved from set_security_env */
@@ -799,7 +825,8 @@ static coolkey_private_data_t *coolkey_new_private_data(void)
 	return priv;
 }
 
-static void coolkey_free_private_data(coolkey_private_data_t *priv)
+/* drop the objects and the token name, leaving an empty list */
+static void coolkey_clear_objects(coolkey_private_data_t *priv)
 {
 	list_t *l = &priv->objects_list;
 	sc_cardctl_coolkey_object_t *o;
@@ -813,14 +840,94 @@ static void coolkey_free_private_data(coolkey_private_data_t *priv)
 	}
 	list_iterator_stop(l);
 
-	list_destroy(&priv->objects_list);
+	list_clear(l);
+	free(priv->index);
+	priv->index = NULL;
+	priv->index_size = 0;
+	priv->index_count = 0;
 	if (priv->token_name) {
 		free(priv->token_name);
+		priv->token_name = NULL;
 	}
+	priv->token_name_length = 0;
+}
+
+static void coolkey_free_private_data(coolkey_private_data_t *priv)
+{
+	coolkey_clear_objects(priv);
+	list_destroy(&priv->objects_list);
 	free(priv);
 	return;
 }
 
+/*
+ * Object hash operations
+ */
+static size_t coolkey_index_slot(unsigned long object_id, size_t size)
+{
+	unsigned long h = object_id;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return (size_t)h & (size - 1);
+}
+
+static coolkey_object_index_t *
+coolkey_lookup_index(coolkey_private_data_t *priv, unsigned long object_id)
+{
+	size_t i;
+
+	if (priv->index == NULL)
+		return NULL;
+	for (i = coolkey_index_slot(object_id, priv->index_size);
+			priv->index[i].obj != NULL; i = (i + 1) & (priv->index_size - 1)) {
+		if (priv->index[i].obj->id == object_id)
+			return &priv->index[i];
+	}
+	return NULL;
+}
+
+static int
+coolkey_add_index(coolkey_private_data_t *priv, sc_cardctl_coolkey_object_t *obj, int cacheable)
+{
+	size_t i;
+
+	/* keep the table at most 3/4 full */
+	if ((priv->index_count + 1) * 4 > priv->index_size * 3) {
+		size_t new_size = priv->index_size ? priv->index_size * 2 : 16;
+		coolkey_object_index_t *new_index = calloc(new_size, sizeof(*new_index));
+
+		if (new_index == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		for (i = 0; i < priv->index_size; i++) {
+			size_t j;
+
+			if (priv->index[i].obj == NULL)
+				continue;
+			for (j = coolkey_index_slot(priv->index[i].obj->id, new_size);
+					new_index[j].obj != NULL; j = (j + 1) & (new_size - 1))
+				;
+			new_index[j] = priv->index[i];
+		}
+		free(priv->index);
+		priv->index = new_index;
+		priv->index_size = new_size;
+	}
+
+	for (i = coolkey_index_slot(obj->id, priv->index_size);
+			priv->index[i].obj != NULL; i = (i + 1) & (priv->index_size - 1)) {
+		/* the first object with a given id wins, as with a list search */
+		if (priv->index[i].obj->id == obj->id)
+			return SC_SUCCESS;
+	}
+	memset(&priv->index[i], 0, sizeof(priv->index[i]));
+	priv->index[i].obj = obj;
+	priv->index[i].cacheable = cacheable;
+	priv->index_count++;
+	return SC_SUCCESS;
+}
+
 /*
  * Object list operations
  */
@@ -833,19 +940,11 @@ static int coolkey_add_object_to_list(list_t *list, const sc_cardctl_coolkey_obj
 
 #define COOLKEY_AID "\xA0\x00\x00\x01\x16"
 static sc_cardctl_coolkey_object_t *
-coolkey_find_object_by_id(list_t *list, unsigned long object_id)
+coolkey_find_object_by_id(coolkey_private_data_t *priv, unsigned long object_id)
 {
-	int pos;
-	static sc_cardctl_coolkey_object_t cmp = {{
-		"", 0, 0, 0, SC_PATH_TYPE_DF_NAME,
-		{ COOLKEY_AID, sizeof(COOLKEY_AID)-1 }
-	}, 0, 0, NULL};
-
-	cmp.id = object_id;
-	if ((pos = list_locate(list, &cmp)) < 0)
-		return NULL;
+	coolkey_object_index_t *entry = coolkey_lookup_index(priv, object_id);
 
-	return list_get_at(list, pos);
+	return entry ? entry->obj : NULL;
 }
 
 
@@ -1039,6 +1138,16 @@ err:
 /*
  * Helpers to handle coolkey commands
  */
+static int
+coolkey_get_status(sc_card_t *card, coolkey_status_t *status)
+{
+	size_t len = sizeof(*status);
+	u8 *receive_buf = (u8 *)status;
+
+	return coolkey_apdu_io(card, COOLKEY_CLASS, COOLKEY_INS_GET_STATUS, 0, 0,
+			NULL, 0, &receive_buf, &len, NULL, 0);
+}
+
 static int
 coolkey_get_life_cycle(sc_card_t *card, coolkey_life_cycle_t *life_cycle)
 {
@@ -1062,10 +1171,7 @@ coolkey_get_life_cycle(sc_card_t *card, coolkey_life_cycle_t *life_cycle)
 	if (r < 0) {
 		return r;
 	}
-	len = sizeof(status);
-	receive_buf = (u8 *)&status;
-	r = coolkey_apdu_io(card, COOLKEY_CLASS, COOLKEY_INS_GET_STATUS, 0, 0,
-			NULL, 0, &receive_buf, &len, NULL, 0);
+	r = coolkey_get_status(card, &status);
 	if (r < 0) {
 		return r;
 	}
@@ -1194,6 +1300,7 @@ static int coolkey_read_binary(sc_card_t *card, unsigned int idx,
 		u8 *buf, size_t count, unsigned long flags)
 {
 	coolkey_private_data_t * priv = COOLKEY_DATA(card);
+	coolkey_object_index_t *entry;
 	int r = 0, len;
 	u8 *data = NULL;;
 
@@ -1240,6 +1347,9 @@ static int coolkey_read_binary(sc_card_t *card, unsigned int idx,
 	/* cache the data in the object */
 	priv->obj->data=data;
 	data = NULL;
+	entry = coolkey_lookup_index(priv, priv->obj->id);
+	if (entry && entry->cacheable)
+		priv->cache_dirty = 1;
 
 done:
 	if (data)
@@ -1381,6 +1491,7 @@ coolkey_fill_object(sc_card_t *card, sc_cardctl_coolkey_object_t *obj)
 	size_t buf_len = obj->length;
 	u8 *new_obj_data = NULL;
 	sc_cardctl_coolkey_object_t *obj_entry;
+	coolkey_object_index_t *entry;
 	coolkey_private_data_t * priv = COOLKEY_DATA(card);
 
 	if (obj->data != NULL) {
@@ -1396,17 +1507,20 @@ coolkey_fill_object(sc_card_t *card, sc_cardctl_coolkey_object_t *obj)
 		free(new_obj_data);
 		return SC_ERROR_CORRUPTED_DATA;
 	}
-	obj_entry = coolkey_find_object_by_id(&priv->objects_list, obj->id);
-	if (obj_entry == NULL) {
+	entry = coolkey_lookup_index(priv, obj->id);
+	if (entry == NULL) {
 		free(new_obj_data);
 		return SC_ERROR_INTERNAL; /* shouldn't happen */
 	}
+	obj_entry = entry->obj;
 	if (obj_entry->data != NULL) {
 		free(new_obj_data);
 		return SC_ERROR_INTERNAL; /* shouldn't happen */
 	}
 	obj_entry->data = new_obj_data;
 	obj->data = new_obj_data;
+	if (entry->cacheable)
+		priv->cache_dirty = 1;
 	return SC_SUCCESS;
 }
 
@@ -1487,6 +1601,45 @@ coolkey_find_attribute(sc_card_t *card, sc_cardctl_coolkey_attribute_t *attribut
 	return SC_ERROR_DATA_OBJECT_NOT_FOUND;
 }
 
+/*
+ * same as coolkey_find_attribute, but the attributes used to search objects by template
+ * are parsed only once per object.
+ */
+static int
+coolkey_find_indexed_attribute(sc_card_t *card, coolkey_object_index_t *entry,
+		sc_cardctl_coolkey_attribute_t *attribute)
+{
+	sc_cardctl_coolkey_attribute_t *cached;
+	int flag, r;
+
+	switch (attribute->attribute_type) {
+	case CKA_CLASS:
+		cached = &entry->class_attr;
+		flag = COOLKEY_INDEX_CLASS;
+		break;
+	case CKA_ID:
+		cached = &entry->id_attr;
+		flag = COOLKEY_INDEX_ID;
+		break;
+	default:
+		return coolkey_find_attribute(card, attribute);
+	}
+
+	if (!(entry->attr_valid & flag)) {
+		cached->object = entry->obj;
+		cached->attribute_type = attribute->attribute_type;
+		r = coolkey_find_attribute(card, cached);
+		if (r < 0) {
+			return r;
+		}
+		entry->attr_valid |= flag;
+	}
+	attribute->attribute_data_type = cached->attribute_data_type;
+	attribute->attribute_length = cached->attribute_length;
+	attribute->attribute_value = cached->attribute_value;
+	return SC_SUCCESS;
+}
+
 /*
  * pkcs 15 needs to find the cert matching the keys to fill in some of the fields that wasn't stored
  * with the key. To do this we need to look for the cert matching the key's CKA_ID. For flexibility,
@@ -1510,12 +1663,17 @@ coolkey_find_object_by_template(sc_card_t *card, sc_cardctl_coolkey_attribute_t
 	list_iterator_start(list);
 	while (list_iterator_hasnext(list)) {
 		sc_cardctl_coolkey_attribute_t attribute;
+		coolkey_object_index_t *entry;
 		current = list_iterator_next(list);
 		attribute.object = current;
+		entry = coolkey_lookup_index(priv, current->id);
 
 		for (i=0; i < count; i++) {
 			attribute.attribute_type = template[i].attribute_type;
-			r = coolkey_find_attribute(card, &attribute);
+			if (entry && entry->obj == current)
+				r = coolkey_find_indexed_attribute(card, entry, &attribute);
+			else
+				r = coolkey_find_attribute(card, &attribute);
 			if (r < 0) {
 				break;
 			}
@@ -1556,7 +1714,7 @@ coolkey_find_object(sc_card_t *card, sc_cardctl_coolkey_find_object_t *fobj)
 
 	switch (fobj->type) {
 	case SC_CARDCTL_COOLKEY_FIND_BY_ID:
-		obj = coolkey_find_object_by_id(&priv->objects_list, fobj->find_id);
+		obj = coolkey_find_object_by_id(priv, fobj->find_id);
 		break;
 	case SC_CARDCTL_COOLKEY_FIND_BY_TEMPLATE:
 		obj = coolkey_find_object_by_template(card, fobj->coolkey_template, fobj->template_count);
@@ -1929,7 +2087,7 @@ static int coolkey_select_file(sc_card_t *card, const sc_path_t *in_path, sc_fil
 		return r;
 	}
 	object_id = bebytes2ulong(in_path->value);
-	priv->obj = coolkey_find_object_by_id(&priv->objects_list, object_id);
+	priv->obj = coolkey_find_object_by_id(priv, object_id);
 	if (priv->obj == NULL) {
 		return SC_ERROR_OBJECT_NOT_FOUND;
 	}
@@ -1954,19 +2112,218 @@ static int coolkey_select_file(sc_card_t *card, const sc_path_t *in_path, sc_fil
     return SC_SUCCESS;
 }
 
+/*
+ * Cache file of the objects, named after the cuid from the cplc data.
+ * It is used as long as the life cycle and the status of the token (versions,
+ * memory usage, pin and key counts) did not change.
+ */
+#define COOLKEY_CACHE_MAGIC "CKYC"
+#define COOLKEY_CACHE_VERSION 1
+#define COOLKEY_CACHE_MAX_OBJECT_SIZE (1024*1024)
+#define COOLKEY_CACHE_HAS_DATA  0x01
+#define COOLKEY_CACHE_CACHEABLE 0x02
+
+static int coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const u8 *object_data,
+		size_t object_length, int add_v1_record, int cacheable);
+
+static int
+coolkey_cache_filename(sc_card_t *card, coolkey_private_data_t *priv, char *filename, size_t filename_len)
+{
+	char hex[sizeof(coolkey_cuid_t) * 2 + 2];
+	size_t len;
+	int r;
+
+	r = sc_bin_to_hex((u8 *)&priv->cache_cuid, sizeof(priv->cache_cuid), hex, sizeof(hex), 0);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_get_cache_dir(card->ctx, filename, filename_len);
+	if (r != SC_SUCCESS)
+		return r;
+	len = strlen(filename);
+#ifdef _WIN32
+	r = snprintf(filename + len, filename_len - len, "\\coolkey_%s.cache", hex);
+#else
+	r = snprintf(filename + len, filename_len - len, "/coolkey_%s.cache", hex);
+#endif
+	if (r < 0 || (size_t)r >= filename_len - len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* read what identifies the cache file and tells whether it is still valid */
+static int
+coolkey_prepare_cache(sc_card_t *card, coolkey_private_data_t *priv)
+{
+	global_platform_cplc_data_t cplc_data;
+	coolkey_status_t status;
+	int r;
+
+	r = coolkey_get_cplc_data(card, &cplc_data);
+	if (r < 0) {
+		return r;
+	}
+	coolkey_make_cuid_from_cplc(&priv->cache_cuid, &cplc_data);
+	r = coolkey_get_status(card, &status);
+	if (r < 0) {
+		return r;
+	}
+	memcpy(priv->cache_status, &status, sizeof(priv->cache_status));
+	priv->cache_status_valid = 1;
+	return SC_SUCCESS;
+}
+
+static int
+coolkey_load_cache(sc_card_t *card, coolkey_private_data_t *priv)
+{
+	char filename[PATH_MAX];
+	u8 header[5 + 1 + COOLKEY_CACHE_STATUS_LEN];
+	u8 buf[9];
+	u8 *data = NULL;
+	size_t i, count, len;
+	FILE *f;
+	int r;
+
+	r = coolkey_cache_filename(card, priv, filename, sizeof(filename));
+	if (r != SC_SUCCESS)
+		return r;
+	f = fopen(filename, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	r = SC_ERROR_INVALID_DATA;
+	if (fread(header, 1, sizeof(header), f) != sizeof(header)
+			|| memcmp(header, COOLKEY_CACHE_MAGIC, 4)
+			|| header[4] != COOLKEY_CACHE_VERSION
+			|| header[5] != priv->life_cycle
+			|| memcmp(header + 6, priv->cache_status, COOLKEY_CACHE_STATUS_LEN)) {
+		sc_log(card->ctx, "Coolkey cache is outdated");
+		goto err;
+	}
+
+	/* cuid and token name */
+	if (fread(&priv->cuid, 1, sizeof(priv->cuid), f) != sizeof(priv->cuid)
+			|| fread(buf, 1, 2, f) != 2)
+		goto err;
+	len = bebytes2ushort(buf);
+	priv->token_name = malloc(len + 1);
+	if (priv->token_name == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	if (fread(priv->token_name, 1, len, f) != len)
+		goto err;
+	priv->token_name[len] = 0;
+	priv->token_name_length = len;
+
+	/* objects: id, length, flags, then the content when known */
+	if (fread(buf, 1, 2, f) != 2)
+		goto err;
+	count = bebytes2ushort(buf);
+	for (i = 0; i < count; i++) {
+		if (fread(buf, 1, 9, f) != 9)
+			goto err;
+		len = bebytes2ulong(buf + 4);
+		if (len > COOLKEY_CACHE_MAX_OBJECT_SIZE)
+			goto err;
+		if (buf[8] & COOLKEY_CACHE_HAS_DATA) {
+			data = malloc(len ? len : 1);
+			if (data == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				goto err;
+			}
+			if (fread(data, 1, len, f) != len)
+				goto err;
+		}
+		r = coolkey_add_object(priv, bebytes2ulong(buf), data, len, 0,
+				(buf[8] & COOLKEY_CACHE_CACHEABLE) != 0);
+		if (r != SC_SUCCESS)
+			goto err;
+		r = SC_ERROR_INVALID_DATA;
+		free(data);
+		data = NULL;
+	}
+	r = SC_SUCCESS;
+
+err:
+	free(data);
+	fclose(f);
+	if (r != SC_SUCCESS) {
+		/* start over with the objects from the token */
+		coolkey_clear_objects(priv);
+	}
+	return r;
+}
+
+static void
+coolkey_save_cache(sc_card_t *card, coolkey_private_data_t *priv)
+{
+	char filename[PATH_MAX];
+	u8 header[5 + 1 + COOLKEY_CACHE_STATUS_LEN];
+	u8 buf[9];
+	unsigned int i, count;
+	FILE *f;
+
+	count = list_size(&priv->objects_list);
+	if (count > 0xFFFF || priv->token_name_length > 0xFFFF)
+		return;
+	if (coolkey_cache_filename(card, priv, filename, sizeof(filename)) != SC_SUCCESS)
+		return;
+	f = fopen(filename, "wb");
+	if (f == NULL && errno == ENOENT && sc_make_cache_dir(card->ctx) == SC_SUCCESS)
+		f = fopen(filename, "wb");
+	if (f == NULL)
+		return;
+
+	memcpy(header, COOLKEY_CACHE_MAGIC, 4);
+	header[4] = COOLKEY_CACHE_VERSION;
+	header[5] = priv->life_cycle;
+	memcpy(header + 6, priv->cache_status, COOLKEY_CACHE_STATUS_LEN);
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header)
+			|| fwrite(&priv->cuid, 1, sizeof(priv->cuid), f) != sizeof(priv->cuid)
+			|| fwrite(ushort2bebytes(buf, priv->token_name_length), 1, 2, f) != 2
+			|| fwrite(priv->token_name, 1, priv->token_name_length, f) != priv->token_name_length
+			|| fwrite(ushort2bebytes(buf, count), 1, 2, f) != 2)
+		goto err;
+
+	for (i = 0; i < count; i++) {
+		sc_cardctl_coolkey_object_t *obj = list_get_at(&priv->objects_list, i);
+		coolkey_object_index_t *entry = coolkey_lookup_index(priv, obj->id);
+		int cacheable = entry && entry->obj == obj && entry->cacheable;
+		int has_data = cacheable && obj->data != NULL;
+
+		/* the content of objects needing a login is never written */
+		ulong2bebytes(buf, obj->id);
+		ulong2bebytes(buf + 4, obj->length);
+		buf[8] = (has_data ? COOLKEY_CACHE_HAS_DATA : 0)
+			| (cacheable ? COOLKEY_CACHE_CACHEABLE : 0);
+		if (fwrite(buf, 1, 9, f) != 9
+				|| (has_data && fwrite(obj->data, 1, obj->length, f) != obj->length))
+			goto err;
+	}
+	fclose(f);
+	return;
+
+err:
+	fclose(f);
+	unlink(filename);
+}
+
 static int coolkey_finish(sc_card_t *card)
 {
 	coolkey_private_data_t * priv = COOLKEY_DATA(card);
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	if (priv) {
+		if (priv->use_file_cache && priv->cache_status_valid && priv->cache_dirty)
+			coolkey_save_cache(card, priv);
 		coolkey_free_private_data(priv);
 	}
 	return SC_SUCCESS;
 }
 
 static int
-coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const u8 *object_data, size_t object_length, int add_v1_record)
+coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const u8 *object_data, size_t object_length,
+		int add_v1_record, int cacheable)
 {
 	sc_cardctl_coolkey_object_t new_object;
 	int r;
@@ -1996,13 +2353,16 @@ coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const
 		 * the data space didn't get adopted. free it before we return */
 		free(new_object.data);
 		new_object.data = NULL;
+		return r;
 	}
-	return r;
+	return coolkey_add_index(priv,
+		list_get_at(&priv->objects_list, list_size(&priv->objects_list) - 1), cacheable);
 }
 
 
 static int
-coolkey_process_combined_object(sc_card_t *card, coolkey_private_data_t *priv, u8 *object, size_t object_length)
+coolkey_process_combined_object(sc_card_t *card, coolkey_private_data_t *priv, u8 *object, size_t object_length,
+		int cacheable)
 {
 	coolkey_combined_header_t *header = (coolkey_combined_header_t *)object;
 	unsigned short compressed_offset;
@@ -2103,7 +2463,7 @@ coolkey_process_combined_object(sc_card_t *card, coolkey_private_data_t *priv, u
 		object_offset += current_object_len;
 
 		/* record this object */
-		r = coolkey_add_object(priv, object_id, current_object, current_object_len, 1);
+		r = coolkey_add_object(priv, object_id, current_object, current_object_len, 1, cacheable);
 		if (r) {
 			goto done;
 		}
@@ -2139,6 +2499,7 @@ static int coolkey_initialize(sc_card_t *card)
 	coolkey_life_cycle_t life_cycle;
 	coolkey_object_info_t object_info;
 	int combined_processed = 0;
+	scconf_block *conf_block;
 
 	/* already found? */
 	if (card->drv_data) {
@@ -2166,12 +2527,26 @@ static int coolkey_initialize(sc_card_t *card)
 	priv->pin_count = life_cycle.pin_count;
 	priv->life_cycle = life_cycle.life_cycle;
 
+	/* defaults to the setting for the PKCS#15 file cache */
+	conf_block = sc_get_conf_block(card->ctx, "framework", "pkcs15", 1);
+	priv->use_file_cache = scconf_get_bool(conf_block, "use_file_caching", 0);
+	conf_block = sc_get_conf_block(card->ctx, "card_driver", "coolkey", 1);
+	priv->use_file_cache = scconf_get_bool(conf_block, "use_file_cache", priv->use_file_cache);
+	if (priv->use_file_cache && coolkey_prepare_cache(card, priv) == SC_SUCCESS
+			&& coolkey_load_cache(card, priv) == SC_SUCCESS) {
+		sc_log(card->ctx, "Coolkey objects read from the cache");
+		card->drv_data = priv;
+		return SC_SUCCESS;
+	}
+	priv->cache_dirty = 1;
+
 	/* walk down the list of objects and read them off the token */
 	for(r=coolkey_list_object(card, COOLKEY_LIST_RESET, &object_info); r >= 0;
 		r= coolkey_list_object(card, COOLKEY_LIST_NEXT, &object_info)) {
 		unsigned long object_id = bebytes2ulong(object_info.object_id);
 		unsigned short object_len = bebytes2ulong(object_info.object_length);
-	    /* also look at the ACL... */
+		/* only objects everybody can read are kept in the cache file */
+		int cacheable = bebytes2ushort(object_info.read_acl) == 0;
 
 
 		/* the combined object is a single object that can store the other objects.
@@ -2192,7 +2567,7 @@ static int coolkey_initialize(sc_card_t *card)
 				free(object);
 				break;
 			}
-			r = coolkey_process_combined_object(card, priv, object, r);
+			r = coolkey_process_combined_object(card, priv, object, r, cacheable);
 			free(object);
 			if (r != SC_SUCCESS) {
 				break;
@@ -2200,7 +2575,7 @@ static int coolkey_initialize(sc_card_t *card)
 			combined_processed = 1;
 			continue;
 		}
-		r = coolkey_add_object(priv, object_id, NULL, object_len, 0);
+		r = coolkey_add_object(priv, object_id, NULL, object_len, 0, cacheable);
 		if (r != SC_SUCCESS)
 			sc_log(card->ctx, "coolkey_add_object() returned %d", r);
 
@@ -2210,12 +2585,17 @@ static int coolkey_initialize(sc_card_t *card)
 	}
 	/* if we didn't pull the cuid from the combined object, then grab it now */
 	if (!combined_processed) {
-		global_platform_cplc_data_t cplc_data;
-		r = coolkey_get_cplc_data(card, &cplc_data);
-		if (r < 0) {
-			goto cleanup;
+		if (priv->cache_status_valid) {
+			/* already read to name the cache file */
+			priv->cuid = priv->cache_cuid;
+		} else {
+			global_platform_cplc_data_t cplc_data;
+			r = coolkey_get_cplc_data(card, &cplc_data);
+			if (r < 0) {
+				goto cleanup;
+			}
+			coolkey_make_cuid_from_cplc(&priv->cuid, &cplc_data);
 		}
-		coolkey_make_cuid_from_cplc(&priv->cuid, &cplc_data);
 		priv->token_name = (u8 *)strdup("COOLKEY");
 		if (priv->token_name == NULL) {
 			r= SC_ERROR_OUT_OF_MEMORY;
@@ -31,8 +31,16 @@ Some features are undocumented like the format used to store certificates. They
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #ifdef ENABLE_OPENSSL
 /* openssl only needed for card administration */
@@ -106,6 +114,10 @@ Some features are undocumented like the format used to store certificates. They
 #define GIDS_KEY_TYPE_AT_KEYEXCHANGE 0x9A
 #define GIDS_KEY_TYPE_AT_SIGNATURE 0x9C
 
+// persistent copy of the masterfile and cmapfile
+#define GIDS_CACHE_MAGIC "GIDC"
+#define GIDS_CACHE_VERSION 1
+
 static struct sc_card_operations *iso_ops;
 static struct sc_card_operations gids_ops;
 static struct sc_card_driver gids_drv = {
@@ -148,6 +160,10 @@ struct gids_private_data {
 	size_t masterfilesize;
 	u8 cmapfile[MAX_GIDS_FILE_SIZE];
 	size_t cmapfilesize;
+	int use_file_cache;
+	// content of cardcf when the masterfile and cmapfile were loaded
+	u8 cardcf[6];
+	int cardcfvalid;
 	unsigned short currentEFID;
 	unsigned short currentDO;
 	int state;
@@ -358,6 +374,8 @@ static int gids_update_cardcf(sc_card_t* card, int file, int container) {
 	u8 cardcf[6];
 	int r;
 	size_t cardcfsize = sizeof(cardcf);
+	// the freshness counters are going to change: reload the cached files next time
+	data->cardcfvalid = 0;
 	r = gids_read_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, &cardcfsize);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to get the cardcf");
 
@@ -435,6 +453,172 @@ static int gids_read_cmapfile(sc_card_t* card) {
 	return r;
 }
 
+// build the name of the file caching the masterfile and cmapfile, based on the card id
+static int gids_get_cache_filename(sc_card_t* card, char *filename, size_t filenamelen) {
+	char hex[SC_MAX_SERIALNR * 2 + 2];
+	u8 cardid[SC_MAX_SERIALNR];
+	size_t cardidsize = sizeof(cardid);
+	size_t len;
+	int r;
+
+	if (card->serialnr.len == 0) {
+		// the cardid file is always at the same place, no need for the masterfile
+		r = gids_get_DO(card, CARDID_FI, CARDID_DO, cardid, &cardidsize);
+		if (r < 0 || cardidsize == 0)
+			return SC_ERROR_OBJECT_NOT_FOUND;
+		card->serialnr.len = cardidsize;
+		memcpy(card->serialnr.value, cardid, cardidsize);
+	}
+	r = sc_bin_to_hex(card->serialnr.value, card->serialnr.len, hex, sizeof(hex), 0);
+	if (r != SC_SUCCESS)
+		return r;
+
+	r = sc_get_cache_dir(card->ctx, filename, filenamelen);
+	if (r != SC_SUCCESS)
+		return r;
+	len = strlen(filename);
+#ifdef _WIN32
+	r = snprintf(filename + len, filenamelen - len, "\\gids_%s.cache", hex);
+#else
+	r = snprintf(filename + len, filenamelen - len, "/gids_%s.cache", hex);
+#endif
+	if (r < 0 || (size_t)r >= filenamelen - len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int gids_read_cache_part(FILE *f, u8 *buffer, size_t *buffersize) {
+	u8 len[2];
+	size_t size;
+
+	if (fread(len, 1, sizeof(len), f) != sizeof(len))
+		return SC_ERROR_INVALID_DATA;
+	size = (len[0] << 8) | len[1];
+	if (size == 0 || size > MAX_GIDS_FILE_SIZE)
+		return SC_ERROR_INVALID_DATA;
+	if (fread(buffer, 1, size, f) != size)
+		return SC_ERROR_INVALID_DATA;
+	*buffersize = size;
+	return SC_SUCCESS;
+}
+
+// Cache file: magic, version, cardcf, then the masterfile and the cmapfile,
+// each one preceded by its length (2 bytes).
+// The cache is used only if the container and file freshness counters of cardcf are unchanged.
+static int gids_load_cache(sc_card_t* card, const u8 *cardcf) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	char filename[PATH_MAX];
+	u8 header[11];
+	FILE *f;
+	int r;
+
+	r = gids_get_cache_filename(card, filename, sizeof(filename));
+	if (r != SC_SUCCESS)
+		return r;
+	f = fopen(filename, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	r = SC_ERROR_INVALID_DATA;
+	if (fread(header, 1, sizeof(header), f) != sizeof(header)
+			|| memcmp(header, GIDS_CACHE_MAGIC, 4)
+			|| header[4] != GIDS_CACHE_VERSION
+			|| header[5] != cardcf[0]
+			|| memcmp(header + 7, cardcf + 2, 4)) {
+		sc_log(card->ctx, "gids cache is outdated");
+		goto err;
+	}
+	if (gids_read_cache_part(f, data->masterfile, &data->masterfilesize) != SC_SUCCESS
+			|| data->masterfile[0] != 1
+			|| gids_read_cache_part(f, data->cmapfile, &data->cmapfilesize) != SC_SUCCESS) {
+		// invalidate what may have been partially read
+		data->masterfilesize = sizeof(data->masterfile);
+		data->cmapfilesize = sizeof(data->cmapfile);
+		goto err;
+	}
+	r = SC_SUCCESS;
+err:
+	fclose(f);
+	return r;
+}
+
+static void gids_save_cache(sc_card_t* card) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	char filename[PATH_MAX];
+	u8 header[11];
+	u8 len[4];
+	FILE *f;
+
+	if (gids_get_cache_filename(card, filename, sizeof(filename)) != SC_SUCCESS)
+		return;
+	f = fopen(filename, "wb");
+	if (f == NULL && errno == ENOENT && sc_make_cache_dir(card->ctx) == SC_SUCCESS)
+		f = fopen(filename, "wb");
+	if (f == NULL)
+		return;
+
+	memcpy(header, GIDS_CACHE_MAGIC, 4);
+	header[4] = GIDS_CACHE_VERSION;
+	memcpy(header + 5, data->cardcf, sizeof(data->cardcf));
+	len[0] = (data->masterfilesize >> 8) & 0xFF;
+	len[1] = data->masterfilesize & 0xFF;
+	len[2] = (data->cmapfilesize >> 8) & 0xFF;
+	len[3] = data->cmapfilesize & 0xFF;
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header)
+			|| fwrite(len, 1, 2, f) != 2
+			|| fwrite(data->masterfile, 1, data->masterfilesize, f) != data->masterfilesize
+			|| fwrite(len + 2, 1, 2, f) != 2
+			|| fwrite(data->cmapfile, 1, data->cmapfilesize, f) != data->cmapfilesize) {
+		fclose(f);
+		unlink(filename);
+		return;
+	}
+	fclose(f);
+}
+
+// make sure the masterfile and cmapfile are up to date
+// when they are cached, only cardcf is read from the card to check for changes
+static int gids_refresh_cache(sc_card_t* card) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	u8 cardcf[6];
+	size_t cardcfsize = sizeof(cardcf);
+	int cardcfread = 0;
+	int r;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (data->use_file_cache) {
+		r = gids_get_DO(card, CARDCF_FI, CARDCF_DO, cardcf, &cardcfsize);
+		if (r < 0 || cardcfsize < sizeof(cardcf)) {
+			sc_log(card->ctx, "unable to read cardcf, not using the cache");
+		} else {
+			cardcfread = 1;
+			if (data->cardcfvalid && data->cardcf[0] == cardcf[0]
+					&& memcmp(data->cardcf + 2, cardcf + 2, 4) == 0
+					&& data->masterfilesize != sizeof(data->masterfile)
+					&& data->cmapfilesize != sizeof(data->cmapfile)) {
+				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+			}
+			data->cardcfvalid = 0;
+			memcpy(data->cardcf, cardcf, sizeof(cardcf));
+			if (gids_load_cache(card, cardcf) == SC_SUCCESS) {
+				data->cardcfvalid = 1;
+				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+			}
+		}
+	}
+
+	r = gids_read_masterfile(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to read the masterfile");
+	r = gids_read_cmapfile(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to read the cmapfile");
+
+	if (cardcfread) {
+		data->cardcfvalid = 1;
+		gids_save_cache(card);
+	}
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
+}
+
 // create a file record in the masterfile
 static int gids_create_file(sc_card_t *card, char* directory, char* filename) {
 	int r;
@@ -601,6 +785,12 @@ static int gids_get_serialnr(sc_card_t * card, sc_serial_number_t * serial)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
+	if (card->serialnr.len) {
+		if (serial)
+			memcpy(serial, &card->serialnr, sizeof(*serial));
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
+	}
+
 	buffersize = sizeof(buffer);
 	r = gids_read_gidsfile(card, "", "cardid", buffer, &buffersize);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to read cardid");
@@ -626,6 +816,7 @@ static int gids_init(sc_card_t * card)
 {
 	unsigned long flags;
 	struct gids_private_data *data;
+	scconf_block *conf_block;
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
 	// cache some data in memory
@@ -639,6 +830,12 @@ static int gids_init(sc_card_t * card)
 	data->cmapfilesize = sizeof(data->cmapfile);
 	data->masterfilesize = sizeof(data->masterfile);
 
+	/* defaults to the setting for the PKCS#15 file cache */
+	conf_block = sc_get_conf_block(card->ctx, "framework", "pkcs15", 1);
+	data->use_file_cache = scconf_get_bool(conf_block, "use_file_caching", 0);
+	conf_block = sc_get_conf_block(card->ctx, "card_driver", "gids", 1);
+	data->use_file_cache = scconf_get_bool(conf_block, "use_file_cache", data->use_file_cache);
+
 	/* supported RSA keys and how padding is done */
 	flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE | SC_ALGORITHM_ONBOARD_KEY_GEN | SC_ALGORITHM_RSA_RAW;
 	/* fix me: add other algorithms when the gids specification will tell how to extract the algo id from the FCP */
@@ -998,8 +1195,21 @@ static int gids_read_binary(sc_card_t *card, unsigned int offset,
 		}
 		if (buffer[0] == 1 && buffer[1] == 0) {
 			size_t expectedsize = buffer[2] + buffer[3] * 0x100;
-			data->buffersize = sizeof(data->buffer);
-			r = sc_decompress(data->buffer, &(data->buffersize), buffer+4, buffersize-4, COMPRESSION_ZLIB);
+			struct sc_decompress_stream *stream = NULL;
+			if (expectedsize == 0 || expectedsize > sizeof(data->buffer)) {
+				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
+					 "invalid uncompressed size: %"SC_FORMAT_LEN_SIZE_T"u", expectedsize);
+				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INVALID_DATA);
+			}
+			/* inflate straight into the buffer, sized by the header */
+			r = sc_decompress_stream_init(&stream, data->buffer, expectedsize, COMPRESSION_ZLIB);
+			if (r == SC_SUCCESS)
+				r = sc_decompress_stream_update(stream, buffer+4, buffersize-4);
+			if (stream) {
+				int r2 = sc_decompress_stream_final(stream, NULL, &(data->buffersize));
+				if (r == SC_SUCCESS)
+					r = r2;
+			}
 			if (r != SC_SUCCESS) {
 				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Zlib error: %d", r);
 				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
@@ -1029,10 +1239,8 @@ static int
 gids_get_all_containers(sc_card_t* card, size_t *recordsnum) {
 	int r;
 	struct gids_private_data *privatedata = (struct gids_private_data *) card->drv_data;
-	r = gids_read_masterfile(card);
-	LOG_TEST_RET(card->ctx, r, "unable to read the masterfile");
-	r = gids_read_cmapfile(card);
-	LOG_TEST_RET(card->ctx, r, "unable to read the cmapfile");
+	r = gids_refresh_cache(card);
+	LOG_TEST_RET(card->ctx, r, "unable to refresh the masterfile and cmapfile");
 	*recordsnum = (privatedata ->cmapfilesize / sizeof(CONTAINER_MAP_RECORD));
 	return SC_SUCCESS;
 }
@@ -223,6 +223,8 @@ isoApplet_init(sc_card_t *card)
 		card->caps |=  SC_CARD_CAP_APDU_EXT;
 	if(rbuf[2] & ISOAPPLET_API_FEATURE_SECURE_RANDOM)
 		card->caps |=  SC_CARD_CAP_RNG;
+	/* The applet keeps its security environment until the next MSE */
+	card->caps |=  SC_CARD_CAP_REUSE_SEC_ENV;
 	if(drvdata->isoapplet_version <= 0x0005 || rbuf[2] & ISOAPPLET_API_FEATURE_ECC)
 	{
 		/* There are Java Cards that do not support ECDSA at all. The IsoApplet
@@ -558,7 +560,9 @@ isoApplet_ctl_generate_key(sc_card_t *card, sc_cardctl_isoApplet_genkey_t *args)
 
 	LOG_FUNC_CALLED(card->ctx);
 
-	/* MANAGE SECURITY ENVIRONMENT (SET). Set the algorithm and key references. */
+	/* MANAGE SECURITY ENVIRONMENT (SET). Set the algorithm and key references.
+	 * This replaces the environment cached by sc_set_security_env(). */
+	card->cache.sec_env_valid = 0;
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x22, 0x41, 0x00);
 
 	p = sbuf;
@@ -991,7 +995,9 @@ isoApplet_ctl_import_key(sc_card_t *card, sc_cardctl_isoApplet_import_key_t *arg
 	 * GENERATE ASYMMETRIC KEYPAIR).
 	 */
 
-	/* MANAGE SECURITY ENVIRONMENT (SET). Set the algorithm and key references. */
+	/* MANAGE SECURITY ENVIRONMENT (SET). Set the algorithm and key references.
+	 * This replaces the environment cached by sc_set_security_env(). */
+	card->cache.sec_env_valid = 0;
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x22, 0x41, 0x00);
 
 	p = sbuf;
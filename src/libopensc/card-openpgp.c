@@ -151,6 +151,7 @@ struct do_info {
 static int		pgp_get_card_features(sc_card_t *card);
 static int		pgp_finish(sc_card_t *card);
 static void		pgp_iterate_blobs(pgp_blob_t *, int, void (*func)());
+static void		pgp_prefetch_blobs(sc_card_t *card);
 
 static int		pgp_get_blob(sc_card_t *card, pgp_blob_t *blob,
 				 unsigned int id, pgp_blob_t **ret);
@@ -183,6 +184,9 @@ static int		pgp_get_pubkey_pem(sc_card_t *, unsigned int,
 #define DO_NAME                  0x5b
 #define DO_LANG_PREF             0x5f2d
 #define DO_SEX                   0x5f35
+/* Other constructed DOs readable with a single GET DATA */
+#define DO_APP_DATA              0x6e
+#define DO_SEC_SUPPORT           0x7a
 
 
 /* Maximum length for response buffer when reading pubkey.
@@ -383,6 +387,7 @@ pgp_init(sc_card_t *card)
 	struct do_info	*info;
 	int		r;
 	pgp_blob_t 	*child = NULL;
+	scconf_block	*conf_block;
 
 	LOG_FUNC_CALLED(card->ctx);
 
@@ -480,6 +485,12 @@ pgp_init(sc_card_t *card)
 	/* get card_features from ATR & DOs */
 	pgp_get_card_features(card);
 
+	/* read the constructed DOs ahead: done after pgp_get_card_features()
+	 * so that extended length APDUs are used when the card supports them */
+	conf_block = sc_get_conf_block(card->ctx, "card_driver", "openpgp", 1);
+	if (scconf_get_bool(conf_block, "prefetch", 1))
+		pgp_prefetch_blobs(card);
+
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
 
@@ -954,6 +965,76 @@ pgp_enumerate_blob(sc_card_t *card, pgp_blob_t *blob)
 }
 
 
+/**
+ * Internal: enumerate a constructed DO and all constructed DOs nested in it.
+ * Only the top-level DO is read from the card, the nested ones are parsed
+ * from its contents.
+ */
+static void
+pgp_enumerate_tree(sc_card_t *card, pgp_blob_t *blob)
+{
+	pgp_blob_t	*child;
+
+	if (pgp_enumerate_blob(card, blob) < 0)
+		return;
+
+	for (child = blob->files; child; child = child->next) {
+		if (child->info && child->info->type == CONSTRUCTED && child->id != DO_CERT)
+			pgp_enumerate_tree(card, child);
+	}
+}
+
+
+/**
+ * Internal: populate the blobs of the big constructed DOs
+ * (application related data, cardholder related data, security support
+ * template) with one GET DATA each, instead of one per lookup.
+ */
+static void
+pgp_prefetch_blobs(sc_card_t *card)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+	static const unsigned int ids[] = { DO_APP_DATA, DO_CARDHOLDER, DO_SEC_SUPPORT };
+	pgp_blob_t	*blob;
+	size_t		i;
+
+	for (i = 0; i < sizeof(ids)/sizeof(ids[0]); i++) {
+		if (pgp_get_blob(card, priv->mf, ids[i], &blob) < 0) {
+			sc_log(card->ctx, "DO %04X not available for prefetch", ids[i]);
+			continue;
+		}
+		pgp_enumerate_tree(card, blob);
+	}
+}
+
+
+/**
+ * Internal: find a blob by ID in the part of the tree that is already
+ * populated, without accessing the card. Like pgp_seek_blob, the direct
+ * children of root are preferred over the DOs nested deeper, so that a
+ * top-level DO wins over a copy of it inside a constructed DO.
+ */
+static pgp_blob_t *
+pgp_lookup_blob(pgp_blob_t *root, unsigned int id)
+{
+	pgp_blob_t	*child, *found;
+
+	for (child = root->files; child; child = child->next) {
+		if (child->id == id)
+			return child;
+	}
+
+	for (child = root->files; child; child = child->next) {
+		if ((child->info && child->info->type == SIMPLE) || child->id == DO_CERT)
+			continue;
+		if ((found = pgp_lookup_blob(child, id)) != NULL)
+			return found;
+	}
+
+	return NULL;
+}
+
+
 /**
  * Internal: find a blob by ID below a given parent, filling its contents when necessary.
  */
@@ -1041,6 +1122,10 @@ pgp_find_blob(sc_card_t *card, unsigned int tag)
 	if (priv->current->id == tag) {
 		return priv->current;
 	}
+	/* try the blobs already read before walking the tree on the card */
+	blob = pgp_lookup_blob(priv->mf, tag);
+	if (blob != NULL && pgp_read_blob(card, blob) >= 0)
+		return blob;
 	/* look for the blob representing the DO */
 	r = pgp_seek_blob(card, priv->mf, tag, &blob);
 	if (r < 0) {
@@ -2923,13 +2923,11 @@ err:
 }
 
 
-static int
-piv_finish(sc_card_t *card)
+static void
+piv_free_private_data(sc_card_t *card, piv_private_data_t *priv)
 {
-	piv_private_data_t * priv = PIV_DATA(card);
 	int i;
 
-	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	if (priv) {
 		sc_file_free(priv->aid_file);
 		if (priv->w_buf)
@@ -2950,8 +2948,22 @@ piv_finish(sc_card_t *card)
 				free(priv->obj_cache[i].internal_obj_data);
 		}
 		free(priv);
-		card->drv_data = NULL; /* priv */
 	}
+}
+
+/* probe data left by piv_match_card but not taken by piv_init */
+static void
+piv_free_probe_data(sc_card_t *card, void *data)
+{
+	piv_free_private_data(card, (piv_private_data_t *) data);
+}
+
+static int
+piv_finish(sc_card_t *card)
+{
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	piv_free_private_data(card, PIV_DATA(card));
+	card->drv_data = NULL; /* priv */
 	return 0;
 }
 
@@ -2974,17 +2986,17 @@ static int piv_match_card(sc_card_t *card)
 			return 0; /* can not handle the card */
 	}
 	/* its one we know, or we can test for it in piv_init */
-	/* 
-	 * We will call piv_match_card_continued here then 
-	 * again in piv_init to avoid any issues with passing
-	 * anything from piv_match_card
-	 * to piv_init as had been done in the past
+	/*
+	 * The priv with the selected AID, card type and discovery
+	 * results is handed to piv_init as probe data, so the card
+	 * is not probed a second time. sc_connect_card frees it
+	 * if piv_init is not called.
 	 */
 	r = piv_match_card_continued(card);
 	if (r == 1) {
-		/* clean up what we left in card */
 		sc_unlock(card);
-		piv_finish(card);
+		_sc_card_set_probe_data(card, card->drv_data, piv_free_probe_data);
+		card->drv_data = NULL;
 	}
 
 	return r;
@@ -3143,15 +3155,29 @@ static int piv_init(sc_card_t *card)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
-	/* continue the matching get a lock and the priv */
-	r = piv_match_card_continued(card);
-	if (r != 1)  {
-		sc_log(card->ctx,"piv_match_card_continued failed");
-		piv_finish(card);
-		/* tell sc_connect_card to try other drivers */
-		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_CARD);
+	/* continue with what piv_match_card found, or do the matching
+	 * now if the driver was forced. Either way get a lock and the priv */
+	priv = _sc_card_take_probe_data(card);
+	if (priv) {
+		card->drv_data = priv;
+		r = sc_lock(card);
+		if (r != SC_SUCCESS) {
+			sc_log(card->ctx, "sc_lock failed");
+			/* frees the probe data now owned by the card */
+			piv_finish(card);
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+	}
+	else {
+		r = piv_match_card_continued(card);
+		if (r != 1)  {
+			sc_log(card->ctx,"piv_match_card_continued failed");
+			piv_finish(card);
+			/* tell sc_connect_card to try other drivers */
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_CARD);
+		}
 	}
-		
+
 	priv = PIV_DATA(card);
 
 	/* can not force the PIV driver to use non-PIV cards as tested in piv_card_match_continued */
@@ -1068,10 +1068,10 @@ static int sc_hsm_compute_signature(sc_card_t *card,
 	int r;
 	sc_apdu_t apdu;
 	u8 rbuf[SC_MAX_APDU_BUFFER_SIZE];
-	u8 sbuf[SC_MAX_APDU_BUFFER_SIZE];
 	sc_hsm_private_data_t *priv;
+	int ecdsa;
 
-	if (card == NULL || data == NULL || out == NULL) {
+	if (card == NULL || data == NULL || out == NULL || outlen == 0) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	priv = (sc_hsm_private_data_t *) card->drv_data;
@@ -1080,35 +1080,43 @@ static int sc_hsm_compute_signature(sc_card_t *card,
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OBJECT_NOT_FOUND);
 	}
 
-	// check if datalen exceeds the buffer size
-	if (datalen > SC_MAX_APDU_BUFFER_SIZE) {
-		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
-	}
-
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0x68, priv->env->key_ref[0], priv->algorithm);
 	apdu.cla = 0x80;
-	apdu.resp = rbuf;
-	apdu.resplen = sizeof(rbuf);
-	apdu.le = 256;
 
-	memcpy(sbuf, data, datalen);
-	apdu.data = sbuf;
+	// The input is sent as is, extended length is used for 4K RSA keys
+	apdu.data = data;
 	apdu.lc = datalen;
 	apdu.datalen = datalen;
+
+	ecdsa = (priv->algorithm & 0xF0) == ALGO_EC_RAW;
+	if (ecdsa) {
+		// The DER encoded ECDSA signature is converted into out below
+		apdu.resp = rbuf;
+		apdu.resplen = sizeof(rbuf);
+		apdu.le = 256;
+	} else {
+		// RSA signatures are received straight into the caller's buffer
+		apdu.resp = out;
+		apdu.resplen = outlen;
+		apdu.le = MIN(outlen, sc_get_max_recv_size(card));
+		if (priv->noExtLength && apdu.le > 256) {
+			// Remaining data is collected with GET RESPONSE
+			apdu.le = 256;
+		}
+	}
 	r = sc_transmit_apdu(card, &apdu);
 
 	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
 	if (apdu.sw1 == 0x90 && apdu.sw2 == 0x00) {
 		int len;
 
-		if ((priv->algorithm & 0xF0) == ALGO_EC_RAW) {
+		if (ecdsa) {
 			len = sc_hsm_decode_ecdsa_signature(card, apdu.resp, apdu.resplen, out, outlen);
 			if (len < 0) {
 				LOG_FUNC_RETURN(card->ctx, len);
 			}
 		} else {
-			len = apdu.resplen > outlen ? outlen : apdu.resplen;
-			memcpy(out, apdu.resp, len);
+			len = apdu.resplen;
 		}
 		LOG_FUNC_RETURN(card->ctx, len);
 	}
@@ -96,8 +96,34 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 	return card;
 }
 
+static void sc_card_free_probe_data(sc_card_t *card)
+{
+	if (card->probe_data != NULL && card->probe_free != NULL)
+		card->probe_free(card, card->probe_data);
+	card->probe_data = NULL;
+	card->probe_free = NULL;
+}
+
+void _sc_card_set_probe_data(sc_card_t *card, void *data,
+		void (*free_data)(sc_card_t *card, void *data))
+{
+	sc_card_free_probe_data(card);
+	card->probe_data = data;
+	card->probe_free = free_data;
+}
+
+void *_sc_card_take_probe_data(sc_card_t *card)
+{
+	void *data = card->probe_data;
+
+	card->probe_data = NULL;
+	card->probe_free = NULL;
+	return data;
+}
+
 static void sc_card_free(sc_card_t *card)
 {
+	sc_card_free_probe_data(card);
 	sc_free_apps(card);
 	sc_free_ef_atr(card);
 
@@ -217,6 +243,7 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
 	memcpy(&card->uid, &reader->uid, sizeof(card->uid));
+	sc_apdu_trace_atr(reader);
 
 	_sc_parse_atr(reader);
 
@@ -253,11 +280,14 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 		memcpy(card->ops, card->driver->ops, sizeof(struct sc_card_operations));
 		if (card->ops->match_card != NULL)
-			if (card->ops->match_card(card) != 1)
+			if (card->ops->match_card(card) != 1) {
 				sc_log(ctx, "driver '%s' match_card() failed: %s (will continue anyway)", card->driver->name, sc_strerror(r));
+				sc_card_free_probe_data(card);
+			}
 
 		if (card->ops->init != NULL) {
 			r = card->ops->init(card);
+			sc_card_free_probe_data(card);
 			if (r) {
 				sc_log(ctx, "driver '%s' init() failed: %s", card->driver->name, sc_strerror(r));
 				goto err;
@@ -282,12 +312,15 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
 			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
+			if (ops->match_card(card) != 1) {
+				sc_card_free_probe_data(card);
 				continue;
+			}
 			sc_log(ctx, "matched: %s", drv->name);
 			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
 			card->driver = drv;
 			r = ops->init(card);
+			sc_card_free_probe_data(card);
 			if (r) {
 				sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
 				if (r == SC_ERROR_INVALID_CARD) {
@@ -423,6 +456,11 @@ int sc_lock(sc_card_t *card)
 			if (r == 0)
 				reader_lock_obtained = 1;
 		}
+		/* Others may have used the card while it was unlocked, unless
+		 * the reader kept the transaction open in between */
+		if (!reader_lock_obtained
+				|| !(card->reader->flags & SC_READER_TRANSACTION_RESUMED))
+			card->cache.sec_env_valid = 0;
 		if (r == 0)
 			card->cache.valid = 1;
 	}
@@ -767,6 +805,14 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->select_file(card, in_path, file);
+
+	/* The security environment survives only re-selecting the same file */
+	if (r < 0 || in_path->type != card->cache.sec_env_path.type
+			|| !sc_compare_path(in_path, &card->cache.sec_env_path)
+			|| in_path->aid.len != card->cache.sec_env_path.aid.len
+			|| memcmp(in_path->aid.value, card->cache.sec_env_path.aid.value, in_path->aid.len))
+		card->cache.sec_env_valid = 0;
+	card->cache.sec_env_path = *in_path;
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
 
 	if (file) {
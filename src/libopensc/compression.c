@@ -153,64 +153,138 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
-static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
-	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
+struct sc_decompress_stream {
 	z_stream gz;
-	int err;
+	u8 *out;
+	size_t outSize;
+	int allocated;
+	int done;
+};
+
+int sc_decompress_stream_init(struct sc_decompress_stream **stream, u8 *out, size_t outSize, int method) {
+	struct sc_decompress_stream *s;
 	int window_size = 15;
-	const int startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const int blockSize = inLen < 1024 ? 512 : inLen / 2;
-	int bufferSize = startSize;
-	if(gzip)
-		window_size += 0x20;
-	memset(&gz, 0, sizeof(gz));
-	
-	gz.next_in = (u8*)in;
-	gz.avail_in = inLen;
+	int err;
 
-	err = inflateInit2(&gz, window_size);
-	if(err != Z_OK) return zerr_to_opensc(err);
+	switch(method) {
+	case COMPRESSION_AUTO:
+		window_size += 0x20; /* let zlib detect zlib or gzip headers */
+		break;
+	case COMPRESSION_ZLIB:
+		break;
+	case COMPRESSION_GZIP:
+		window_size += 0x10;
+		break;
+	default:
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+	if(!stream || (out && outSize == 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
 
-	*outLen = 0;
-
-	while(1) {
-		/* Setup buffer... */
-		int num;
-		u8* buf = realloc(*out, bufferSize);
-		if(!buf) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			return Z_MEM_ERROR;
-		}
-		*out = buf;
-		gz.next_out = buf + *outLen;
-		gz.avail_out = bufferSize - *outLen;
-
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if(err != Z_STREAM_END && err != Z_OK) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			break;
+	s = calloc(1, sizeof(struct sc_decompress_stream));
+	if(!s)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if(out) {
+		s->out = out;
+		s->outSize = outSize;
+	} else {
+		/* the expected size is allocated once, otherwise grow as needed */
+		s->outSize = outSize ? outSize : 4096;
+		s->out = malloc(s->outSize);
+		s->allocated = 1;
+		if(!s->out) {
+			free(s);
+			return SC_ERROR_OUT_OF_MEMORY;
 		}
-		num = bufferSize - *outLen - gz.avail_out;
-		if(num > 0) {
-			*outLen += num;
-			bufferSize += num + blockSize;
+	}
+	s->gz.next_out = s->out;
+	s->gz.avail_out = s->outSize;
+
+	err = inflateInit2(&s->gz, window_size);
+	if(err != Z_OK) {
+		if(s->allocated)
+			free(s->out);
+		free(s);
+		return zerr_to_opensc(err);
+	}
+	*stream = s;
+	return SC_SUCCESS;
+}
+
+int sc_decompress_stream_update(struct sc_decompress_stream *s, const u8 *in, size_t inLen) {
+	int err;
+
+	if(!s)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	s->gz.next_in = (u8*)in;
+	s->gz.avail_in = inLen;
+
+	while(!s->done) {
+		if(s->gz.avail_out == 0 && s->allocated) {
+			size_t used = s->gz.total_out;
+			u8 *buf = realloc(s->out, s->outSize * 2);
+
+			if(!buf)
+				return SC_ERROR_OUT_OF_MEMORY;
+			s->out = buf;
+			s->outSize *= 2;
+			s->gz.next_out = buf + used;
+			s->gz.avail_out = s->outSize - used;
 		}
+		err = inflate(&s->gz, Z_NO_FLUSH);
 		if(err == Z_STREAM_END) {
-			buf = realloc(buf, *outLen); /* Shrink it down, if it fails, just use old data */
-			if(buf) {
-				*out = buf;
-			}
+			s->done = 1;
+		} else if(err == Z_BUF_ERROR) {
+			/* no progress: more input is needed or the output is full */
+			if(s->gz.avail_in == 0)
+				break;
+			if(!s->allocated)
+				return SC_ERROR_BUFFER_TOO_SMALL;
+			if(s->gz.avail_out > 0)
+				return SC_ERROR_INVALID_DATA;
+		} else if(err != Z_OK) {
+			return zerr_to_opensc(err);
+		} else if(s->gz.avail_in == 0 && s->gz.avail_out > 0) {
 			break;
 		}
 	}
-	inflateEnd(&gz);
-	return zerr_to_opensc(err);
+	return SC_SUCCESS;
+}
+
+int sc_decompress_stream_final(struct sc_decompress_stream *s, u8 **out, size_t *outLen) {
+	int r = SC_SUCCESS;
+
+	if(!s)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if(!s->done)
+		r = SC_ERROR_INVALID_DATA; /* truncated input */
+	if(r == SC_SUCCESS && outLen)
+		*outLen = s->gz.total_out;
+	if(s->allocated) {
+		if(r == SC_SUCCESS && out) {
+			*out = s->out;
+			s->out = NULL;
+		}
+		free(s->out);
+	}
+	inflateEnd(&s->gz);
+	free(s);
+	return r;
 }
+
+/* The gzip trailer carries the uncompressed size modulo 2^32 */
+static size_t gzip_size_hint(const u8* in, size_t inLen) {
+	if(inLen < 18)
+		return 0;
+	in += inLen - 4;
+	return in[0] | (in[1] << 8) | (in[2] << 16) | ((size_t)in[3] << 24);
+}
+
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
+	struct sc_decompress_stream *stream;
+	size_t hint = 0;
+	int r;
+
 	if(method == COMPRESSION_AUTO) {
 		method = detect_method(in, inLen);
 		if(method == COMPRESSION_UNKNOWN) {
@@ -219,11 +293,28 @@ int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, in
 	}
 	switch(method) {
 	case COMPRESSION_ZLIB:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 0);
+		hint = inLen * 2;
+		break;
 	case COMPRESSION_GZIP:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 1);
+		hint = gzip_size_hint(in, inLen);
+		/* do not trust a corrupted trailer */
+		if(hint > inLen * 1032)
+			hint = inLen * 2;
+		break;
 	default:
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
+
+	r = sc_decompress_stream_init(&stream, NULL, hint, method);
+	if(r != SC_SUCCESS)
+		return r;
+	r = sc_decompress_stream_update(stream, in, inLen);
+	if(r != SC_SUCCESS) {
+		sc_decompress_stream_final(stream, NULL, NULL);
+		return r;
+	}
+	free(*out);
+	*out = NULL;
+	return sc_decompress_stream_final(stream, out, outLen);
 }
 #endif /* ENABLE_ZLIB */
@@ -33,5 +33,19 @@ int sc_compress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method)
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
 
+/*
+ * Incremental decompression, for data that arrives in chunks.
+ * With out == NULL the output buffer is allocated with outSize bytes, which
+ * should be the uncompressed size if it is known, and grown if needed;
+ * otherwise the output is written to the outSize bytes at out.
+ * sc_decompress_stream_final() releases the stream and returns the length
+ * and, if allocated, the output buffer, which the caller has to free.
+ */
+struct sc_decompress_stream;
+
+int sc_decompress_stream_init(struct sc_decompress_stream **stream, u8 *out, size_t outSize, int method);
+int sc_decompress_stream_update(struct sc_decompress_stream *stream, const u8 *in, size_t inLen);
+int sc_decompress_stream_final(struct sc_decompress_stream *stream, u8 **out, size_t *outLen);
+
 #endif
 
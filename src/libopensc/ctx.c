@@ -29,11 +29,16 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
 #include <winreg.h>
 #include <direct.h>
+#include <io.h>
 #endif
 
 #include "common/libscdl.h"
@@ -328,6 +333,59 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 }
 
 
+/* The trace holds the PINs and keys sent to the card. It is created for
+ * the current user only, and an existing file is never overwritten.
+ * "%p" in the name is replaced by the process id. */
+static void
+open_apdu_trace(sc_context_t *ctx, const char *name)
+{
+	char path[PATH_MAX];
+	size_t len = 0;
+	FILE *f = NULL;
+	int fd;
+
+	for (; *name && len < sizeof(path) - 1; name++) {
+		if (name[0] == '%' && name[1] == 'p') {
+#ifdef _WIN32
+			unsigned long pid = (unsigned long)GetCurrentProcessId();
+#else
+			unsigned long pid = (unsigned long)getpid();
+#endif
+			len += snprintf(path + len, sizeof(path) - len, "%lu", pid);
+			name++;
+		}
+		else {
+			path[len++] = *name;
+		}
+	}
+	if (*name || len >= sizeof(path)) {
+		sc_log(ctx, "APDU trace file name too long");
+		return;
+	}
+	path[len] = '\0';
+
+#ifdef _WIN32
+	fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+	if (fd >= 0 && (f = _fdopen(fd, "wb")) == NULL)
+		_close(fd);
+#else
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd >= 0 && (f = fdopen(fd, "wb")) == NULL)
+		close(fd);
+#endif
+	if (f == NULL) {
+		sc_log(ctx, "Cannot create APDU trace file '%s': %s", path, strerror(errno));
+		return;
+	}
+	if (fwrite(SC_APDU_TRACE_MAGIC, 1, 4, f) != 4
+			|| fputc(SC_APDU_TRACE_VERSION, f) == EOF
+			|| sc_mutex_create(ctx, &ctx->apdu_trace_mutex) != SC_SUCCESS) {
+		fclose(f);
+		return;
+	}
+	ctx->apdu_trace = f;
+}
+
 static int
 load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *opts)
 {
@@ -364,6 +422,10 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		sc_ctx_log_to_file(ctx, NULL);
 	}
 
+	val = scconf_get_str(block, "apdu_trace_file", NULL);
+	if (val && ctx->apdu_trace == NULL)
+		open_apdu_trace(ctx, val);
+
 	if (scconf_get_bool (block, "paranoid-memory",
 				ctx->flags & SC_CTX_FLAG_PARANOID_MEMORY))
 		ctx->flags |= SC_CTX_FLAG_PARANOID_MEMORY;
@@ -832,6 +894,9 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	/* software cards configured for testing replace the hardware readers */
+	if (sc_virtual_reader_enabled(ctx))
+		ctx->reader_driver = sc_get_virtual_driver();
 
 	r = ctx->reader_driver->ops->init(ctx);
 	if (r != SC_SUCCESS)   {
@@ -930,6 +995,10 @@ int sc_release_context(sc_context_t *ctx)
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
 		free(ctx->debug_filename);
+	if (ctx->apdu_trace != NULL)
+		fclose(ctx->apdu_trace);
+	if (ctx->apdu_trace_mutex != NULL)
+		sc_mutex_destroy(ctx, ctx->apdu_trace_mutex);
 	if (ctx->app_name != NULL)
 		free(ctx->app_name);
 	list_destroy(&ctx->readers);
@@ -136,6 +136,16 @@ int _sc_card_add_ec_alg(struct sc_card *card, unsigned int key_length,
 		unsigned long flags, unsigned long ext_flags,
 		struct sc_object_id *curve_oid);
 
+/* Keeps what match_card() learned about the card for init() of the same
+ * driver, so that init() does not need to probe the card again. Data not
+ * taken by init() is released with free_data once init() returned or
+ * before the next driver is tried. */
+void _sc_card_set_probe_data(struct sc_card *card, void *data,
+		void (*free_data)(struct sc_card *card, void *data));
+/* Returns the probe data left by match_card(), NULL if there is none.
+ * The caller becomes the owner of the data. */
+void *_sc_card_take_probe_data(struct sc_card *card);
+
 /********************************************************************/
 /*                 pkcs1 padding/encoding functions                 */
 /********************************************************************/
@@ -234,6 +244,39 @@ unsigned long sc_thread_id(const sc_context_t *ctx);
  */
 int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 		size_t *len, unsigned int proto);
+/**
+ * Encodes the APDU in a buffer owned by the caller.
+ * @param  ctx     sc_context_t object
+ * @param  apdu    sc_apdu_t object with the APDU to encode
+ * @param  proto   protocol to be used
+ * @param  buf     output buffer
+ * @param  buflen  size of the output buffer
+ * @param  len     length of the encoded APDU
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_apdu_encode(sc_context_t *ctx, const sc_apdu_t *apdu, unsigned int proto,
+		u8 *buf, size_t buflen, size_t *len);
+
+/* I/O buffer kept by a reader driver between two APDUs */
+typedef struct sc_apdu_buffer {
+	u8 *value;
+	size_t size;
+} sc_apdu_buffer_t;
+
+/**
+ * Makes sure the buffer can hold len bytes. The buffer only grows,
+ * so once it has reached the size of the largest APDU exchanged with
+ * the card, transmitting an APDU does not allocate memory any more.
+ * @param  buffer  the buffer
+ * @param  len     needed size
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_apdu_buffer_reserve(sc_apdu_buffer_t *buffer, size_t len);
+/**
+ * Clears and frees the buffer
+ * @param  buffer  the buffer
+ */
+void sc_apdu_buffer_free(sc_apdu_buffer_t *buffer);
 /**
  * Sets the status bytes and return data in the APDU
  * @param  ctx     sc_context_t object
@@ -255,8 +298,35 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 #define sc_apdu_log(ctx, level, data, len, is_outgoing) \
 	sc_debug_hex(ctx, level, is_outgoing != 0 ? "Outgoing APDU" : "Incoming APDU", data, len)
 
+/* APDU trace file: the magic "APDT" and a version byte, followed by
+ * records of a type byte, the number of the reader in the context and
+ * big-endian length-prefixed fields:
+ *   SC_APDU_TRACE_ATR:      u8 length, ATR
+ *   SC_APDU_TRACE_EXCHANGE: u32 microseconds, u32 length, command,
+ *                           u32 length, response with SW1 SW2 */
+#define SC_APDU_TRACE_MAGIC	"APDT"
+#define SC_APDU_TRACE_VERSION	2
+#define SC_APDU_TRACE_ATR	0x01
+#define SC_APDU_TRACE_EXCHANGE	0x02
+
+/**
+ * Sends the APDU to the reader driver and records the exchange and its
+ * duration if an APDU trace file is configured
+ * @param  card  sc_card_t object for the card
+ * @param  apdu  the APDU to transmit
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_trace_transmit(struct sc_card *card, struct sc_apdu *apdu);
+/**
+ * Records the ATR of a newly connected card in the APDU trace file
+ * @param  reader  the reader with the card
+ */
+void sc_apdu_trace_atr(struct sc_reader *reader);
+
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
+int sc_virtual_reader_enabled(struct sc_context *ctx);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cryptotokenkit_driver(void);
 
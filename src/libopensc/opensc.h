@@ -274,6 +274,12 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* Security environment last set by sc_set_security_env() and the
+	 * path last selected, see SC_CARD_CAP_REUSE_SEC_ENV */
+	struct sc_security_env sec_env;
+	struct sc_path sec_env_path;
+	int sec_env_valid;
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -297,6 +303,9 @@ struct sc_reader_driver {
 #define SC_READER_HAS_WAITING_AREA	0x00000010
 #define SC_READER_REMOVED			0x00000020
 #define SC_READER_ENABLE_ESCAPE		0x00000040
+/* the last lock resumed a transaction the reader had kept open, so no
+ * other application used the card since the previous unlock */
+#define SC_READER_TRANSACTION_RESUMED	0x00000080
 
 /* reader capabilities */
 #define SC_READER_CAP_DISPLAY	0x00000001
@@ -484,6 +493,10 @@ struct sc_reader_operations {
 /* Card (or card driver) supports generating a session PIN */
 #define SC_CARD_CAP_SESSION_PIN	0x00000200
 
+/* Card keeps the current security environment until the next MSE,
+ * SELECT or reset, so an unchanged environment is not set again */
+#define SC_CARD_CAP_REUSE_SEC_ENV	0x00000400
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -514,6 +527,10 @@ typedef struct sc_card {
 	void *drv_data;
 	int max_pin_len;
 
+	/* state handed from match_card() to init() of the matching driver */
+	void *probe_data;
+	void (*probe_free)(struct sc_card *card, void *probe_data);
+
 	struct sc_card_cache cache;
 
 	struct sc_serial_number serialnr;
@@ -703,6 +720,8 @@ typedef struct sc_context {
 
 	FILE *debug_file;
 	char *debug_filename;
+	FILE *apdu_trace;
+	void *apdu_trace_mutex;
 	char *preferred_language;
 
 	list_t readers;
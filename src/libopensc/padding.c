@@ -81,29 +81,7 @@ static const struct digest_info_prefix {
       {	0,				NULL,		0,			0	}
 };
 
-/* add/remove pkcs1 BT01 padding */
-
-static int sc_pkcs1_add_01_padding(const u8 *in, size_t in_len,
-	u8 *out, size_t *out_len, size_t mod_length)
-{
-	size_t i;
-
-	if (*out_len < mod_length)
-		return SC_ERROR_BUFFER_TOO_SMALL;
-	if (in_len + 11 > mod_length)
-		return SC_ERROR_INVALID_ARGUMENTS;
-	i = mod_length - in_len;
-	memmove(out + i, in, in_len);
-	*out++ = 0x00;
-	*out++ = 0x01;
-	
-	memset(out, 0xFF, i - 3);
-	out += i - 3;
-	*out = 0x00;
-
-	*out_len = mod_length;
-	return SC_SUCCESS;
-}
+/* remove pkcs1 BT01 padding (adding it is done by sc_pkcs1_encode()) */
 
 int
 sc_pkcs1_strip_01_padding(struct sc_context *ctx, const u8 *in_dat, size_t in_len,
@@ -178,32 +156,19 @@ sc_pkcs1_strip_02_padding(sc_context_t *ctx, const u8 *data, size_t len, u8 *out
 	LOG_FUNC_RETURN(ctx, len - n);
 }
 
-/* add/remove DigestInfo prefix */
-static int sc_pkcs1_add_digest_info_prefix(unsigned int algorithm,
-	const u8 *in, size_t in_len, u8 *out, size_t *out_len)
+/* look up the DigestInfo prefix of a hash algorithm */
+static const struct digest_info_prefix *
+sc_pkcs1_find_digest_info_prefix(unsigned int algorithm)
 {
 	int i;
 
-	for (i = 0; digest_info_prefix[i].algorithm != 0; i++) {
-		if (algorithm == digest_info_prefix[i].algorithm) {
-			const u8 *hdr      = digest_info_prefix[i].hdr;
-			size_t    hdr_len  = digest_info_prefix[i].hdr_len,
-			          hash_len = digest_info_prefix[i].hash_len;
-
-			if (in_len != hash_len || *out_len < (hdr_len + hash_len))
-				return SC_ERROR_INTERNAL;
-
-			memmove(out + hdr_len, in, hash_len);
-			memmove(out, hdr, hdr_len);
-			*out_len = hdr_len + hash_len;
-
-			return SC_SUCCESS;
-		}
-	}
-
-	return SC_ERROR_INTERNAL;
+	for (i = 0; digest_info_prefix[i].algorithm != 0; i++)
+		if (algorithm == digest_info_prefix[i].algorithm)
+			return &digest_info_prefix[i];
+	return NULL;
 }
 
+/* remove DigestInfo prefix */
 int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 	const u8 *in_dat, size_t in_len, u8 *out_dat, size_t *out_len)
 {
@@ -231,13 +196,17 @@ int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 	return SC_ERROR_INTERNAL;
 }
 
-/* general PKCS#1 encoding function */
+/* general PKCS#1 encoding function
+ *
+ * The encoded block is built in place in out, back to front: the input
+ * is moved to its final position first, then the DigestInfo prefix and
+ * the padding are written in front of it. So in may point into out and
+ * no intermediate copies of the block are made. */
 int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	const u8 *in, size_t in_len, u8 *out, size_t *out_len, size_t mod_len)
 {
-	int    rv, i;
-	size_t tmp_len = *out_len;
-	const u8    *tmp = in;
+	const struct digest_info_prefix *prefix = NULL;
+	size_t hdr_len = 0, data_len, block_len;
 	unsigned int hash_algo, pad_algo;
 
 	LOG_FUNC_CALLED(ctx);
@@ -247,32 +216,47 @@ int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	sc_log(ctx, "hash algorithm 0x%X, pad algorithm 0x%X", hash_algo, pad_algo);
 
 	if (hash_algo != SC_ALGORITHM_RSA_HASH_NONE) {
-		i = sc_pkcs1_add_digest_info_prefix(hash_algo, in, in_len, out, &tmp_len);
-		if (i != SC_SUCCESS) {
+		prefix = sc_pkcs1_find_digest_info_prefix(hash_algo);
+		if (prefix == NULL || in_len != prefix->hash_len) {
 			sc_log(ctx, "Unable to add digest info 0x%x", hash_algo);
-			LOG_FUNC_RETURN(ctx, i);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
 		}
-		tmp = out;
-	} else   {
-		tmp_len = in_len;
+		hdr_len = prefix->hdr_len;
 	}
+	data_len = hdr_len + in_len;
 
 	switch(pad_algo) {
 	case SC_ALGORITHM_RSA_PAD_NONE:
 		/* padding done by card => nothing to do */
-		if (out != tmp)
-			memcpy(out, tmp, tmp_len);
-		*out_len = tmp_len;
-		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		block_len = data_len;
+		break;
 	case SC_ALGORITHM_RSA_PAD_PKCS1:
 		/* add pkcs1 bt01 padding */
-		rv = sc_pkcs1_add_01_padding(tmp, tmp_len, out, out_len, mod_len);
-		LOG_FUNC_RETURN(ctx, rv);
+		if (data_len + 11 > mod_len)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+		block_len = mod_len;
+		break;
 	default:
 		/* currently only pkcs1 padding is supported */
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Unsupported padding algorithm 0x%x", pad_algo);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 	}
+
+	if (*out_len < block_len)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+
+	memmove(out + block_len - in_len, in, in_len);
+	if (hdr_len)
+		memcpy(out + block_len - data_len, prefix->hdr, hdr_len);
+	if (pad_algo == SC_ALGORITHM_RSA_PAD_PKCS1) {
+		out[0] = 0x00;
+		out[1] = 0x01;
+		memset(out + 2, 0xFF, block_len - data_len - 3);
+		out[block_len - data_len - 1] = 0x00;
+	}
+	*out_len = block_len;
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 int sc_get_encoding_flags(sc_context_t *ctx,
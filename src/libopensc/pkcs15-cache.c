@@ -22,6 +22,10 @@
 #include "config.h"
 #endif
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* struct ucred */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +33,11 @@
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -37,13 +46,17 @@
 #include "pkcs15.h"
 
 #define RANDOM_UID_INDICATOR 0x08
-static int generate_cache_filename(struct sc_pkcs15_card *p15card,
+/*
+ * The key of a cached file: serial number (or UID) of the card, lastUpdate
+ * of the token and the path of the file. It names the file in the cache
+ * directory and the entry held by the cache daemon.
+ */
+static int generate_cache_key(struct sc_pkcs15_card *p15card,
 				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
 {
-	char dir[PATH_MAX];
+	char key[PATH_MAX];
 	char *last_update = NULL;
-	int  r;
 	unsigned u;
 
 	if (p15card->tokeninfo->serial_number == NULL
@@ -52,31 +65,26 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	assert(path->len <= SC_MAX_PATH_SIZE);
-	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
-	if (r)
-		return r;
-	snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/");
+	key[0] = '\0';
 
 	last_update = sc_pkcs15_get_lastupdate(p15card);
 	if (!last_update)
 		last_update = "NODATE";
 
 	if (p15card->tokeninfo->serial_number) {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-				"%s_%s", p15card->tokeninfo->serial_number,
-				last_update);
+		snprintf(key, sizeof(key), "%s_%s",
+				p15card->tokeninfo->serial_number, last_update);
 	} else {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-				"uid-%s_%s", sc_dump_hex(
+		snprintf(key, sizeof(key), "uid-%s_%s", sc_dump_hex(
 					p15card->card->uid.value,
 					p15card->card->uid.len), last_update);
 	}
 
 	if (path->aid.len &&
 		(path->type == SC_PATH_TYPE_FILE_ID || path->type == SC_PATH_TYPE_PATH))   {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
+		snprintf(key + strlen(key), sizeof(key) - strlen(key), "_");
 		for (u = 0; u < path->aid.len; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(key + strlen(key), sizeof(key) - strlen(key),
 					"%02X",  path->aid.value[u]);
 	}
 	else if (path->type != SC_PATH_TYPE_PATH)  {
@@ -88,28 +96,374 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 
 		if (path->len > 2 && memcmp(path->value, "\x3F\x00", 2) == 0)
 			offs = 2;
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
+		snprintf(key + strlen(key), sizeof(key) - strlen(key), "_");
 		for (u = 0; u < path->len - offs; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
+			snprintf(key + strlen(key), sizeof(key) - strlen(key),
 					"%02X",  path->value[u + offs]);
 	}
 
-	if (!buf || bufsize < strlen(dir))
+	if (!buf || bufsize <= strlen(key))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcpy(buf, key);
+
+	return SC_SUCCESS;
+}
+
+static int generate_cache_filename(struct sc_pkcs15_card *p15card,
+				   const sc_path_t *path,
+				   char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX], key[PATH_MAX];
+	size_t dirlen, keylen;
+	int  r;
+
+	r = generate_cache_key(p15card, path, key, sizeof(key));
+	if (r)
+		return r;
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+
+	dirlen = strlen(dir);
+	keylen = strlen(key);
+	if (!buf || bufsize <= dirlen + 1 + keylen)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	memcpy(buf, dir, dirlen);
+	buf[dirlen] = '/';
+	memcpy(buf + dirlen + 1, key, keylen + 1);
+
+	return SC_SUCCESS;
+}
+
+static int cache_read_file(const char *fname, u8 **buf, size_t *len)
+{
+	struct stat stbuf;
+	FILE *f;
+	u8 *data;
+
+	f = fopen(fname, "rb");
+	if (!f)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fileno(f), &stbuf) || stbuf.st_size == 0) {
+		fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	data = malloc((size_t)stbuf.st_size);
+	if (data == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if ((size_t)stbuf.st_size != fread(data, 1, (size_t)stbuf.st_size, f)) {
+		fclose(f);
+		free(data);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	fclose(f);
+
+	*buf = data;
+	*len = (size_t)stbuf.st_size;
+	return SC_SUCCESS;
+}
+
+static int cache_write_file(struct sc_context *ctx, const char *fname,
+			    const u8 *buf, size_t bufsize)
+{
+	FILE *f;
+	size_t c;
+	int r;
+
+	f = fopen(fname, "wb");
+	/* If the open failed because the cache directory does
+	 * not exist, create it and a re-try the fopen() call.
+	 */
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			return r;
+		f = fopen(fname, "wb");
+	}
+	if (f == NULL)
+		return 0;
+
+	c = fwrite(buf, 1, bufsize, f);
+	fclose(f);
+	if (c != bufsize) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL,
+			 "fwrite() wrote only %"SC_FORMAT_LEN_SIZE_T"u bytes",
+			 c);
+		unlink(fname);
+		return SC_ERROR_INTERNAL;
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+/*
+ * Client of the cache daemon (opensc-cached), which keeps the cached files
+ * and object snapshots of the inserted cards in memory. Every request uses
+ * its own connection, so that no state is kept in the context. A daemon that
+ * cannot be reached, or that runs as another user, is treated like an empty
+ * cache.
+ */
+#ifdef MSG_NOSIGNAL
+#define CACHED_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define CACHED_SEND_FLAGS 0
+#endif
+
+static int cached_send(int fd, const void *ptr, size_t len)
+{
+	const u8 *p = ptr;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, CACHED_SEND_FLAGS);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return SC_ERROR_TRANSMIT_FAILED;
+		p += n;
+		len -= (size_t)n;
+	}
+	return SC_SUCCESS;
+}
+
+static int cached_recv(int fd, void *ptr, size_t len)
+{
+	u8 *p = ptr;
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return SC_ERROR_TRANSMIT_FAILED;
+		p += n;
+		len -= (size_t)n;
+	}
+	return SC_SUCCESS;
+}
+
+/* Path of the cache daemon socket: cache_socket of framework pkcs15, relative
+ * to $XDG_RUNTIME_DIR unless it is absolute */
+int sc_pkcs15_get_cache_socket(struct sc_context *ctx, char *buf, size_t bufsize)
+{
+	scconf_block *conf_block;
+	const char *sock_path = NULL, *dir = "";
+	const char *sep = "";
+
+	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+	if (conf_block)
+		sock_path = scconf_get_str(conf_block, "cache_socket", NULL);
+	if (sock_path == NULL || *sock_path == '\0')
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	/* a relative path names a socket in the runtime directory of the user */
+	if (sock_path[0] != '/') {
+		dir = getenv("XDG_RUNTIME_DIR");
+		if (dir == NULL || dir[0] != '/') {
+			sc_log(ctx, "XDG_RUNTIME_DIR is not set, no cache daemon socket");
+			return SC_ERROR_FILE_NOT_FOUND;
+		}
+		sep = "/";
+	}
+	if (strlen(dir) + strlen(sep) + strlen(sock_path) >= bufsize)
 		return SC_ERROR_BUFFER_TOO_SMALL;
 	strcpy(buf, dir);
+	strcat(buf, sep);
+	strcat(buf, sock_path);
+	return SC_SUCCESS;
+}
+
+/* The user of the process at the other end of a Unix socket */
+static int cached_peer_uid(int fd, uid_t *uid)
+{
+#if defined(HAVE_GETPEEREID)
+	gid_t gid;
+
+	if (getpeereid(fd, uid, &gid) < 0)
+		return SC_ERROR_NOT_ALLOWED;
+	return SC_SUCCESS;
+#elif defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || len != sizeof(cred))
+		return SC_ERROR_NOT_ALLOWED;
+	*uid = cred.uid;
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+static int cached_connect(struct sc_context *ctx)
+{
+	char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct sockaddr_un addr;
+	struct timeval tv;
+	uid_t uid;
+	int fd;
+
+	if (sc_pkcs15_get_cache_socket(ctx, sock_path, sizeof(sock_path)) != SC_SUCCESS)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+#ifdef SO_NOSIGPIPE
+	{
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	}
+#endif
+	/* never let a stuck daemon block the application */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		sc_log(ctx, "cannot connect to cache daemon %s: %s", sock_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* the cached data is only trusted from a daemon of the same user */
+	if (cached_peer_uid(fd, &uid) != SC_SUCCESS || uid != geteuid()) {
+		sc_log(ctx, "cache daemon %s does not run as the current user", sock_path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* A file from the cache daemon must consist of complete TLVs, followed by
+ * nothing but the padding found at the end of card files. */
+static int cached_check_der(const u8 *data, size_t len)
+{
+	const u8 *p = data, *body;
+	unsigned int cla, tag;
+	size_t taglen;
+
+	while (len > 0 && *p != 0x00 && *p != 0xFF) {
+		body = p;
+		if (sc_asn1_read_tag(&body, len, &cla, &tag, &taglen) != SC_SUCCESS
+				|| body == NULL)
+			return SC_ERROR_CORRUPTED_DATA;
+		taglen += (size_t)(body - p);
+		p += taglen;
+		len -= taglen;
+	}
+	return SC_SUCCESS;
+}
+
+static int cached_get(struct sc_pkcs15_card *p15card, const char *key,
+		      u8 **buf, size_t *len)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cached_msg msg;
+	u8 *data = NULL;
+	int fd, r;
+
+	fd = cached_connect(ctx);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = SC_PKCS15_CACHED_GET;
+	msg.key_len = (unsigned int)strlen(key);
+	r = cached_send(fd, &msg, sizeof(msg));
+	if (r == SC_SUCCESS)
+		r = cached_send(fd, key, msg.key_len);
+	if (r == SC_SUCCESS)
+		r = cached_recv(fd, &msg, sizeof(msg));
+	if (r == SC_SUCCESS && (msg.op != SC_PKCS15_CACHED_FOUND || msg.data_len == 0
+				|| msg.data_len > SC_PKCS15_CACHED_MAX_DATA))
+		r = SC_ERROR_FILE_NOT_FOUND;
+	if (r == SC_SUCCESS) {
+		data = malloc(msg.data_len);
+		if (data == NULL)
+			r = SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (r == SC_SUCCESS)
+		r = cached_recv(fd, data, msg.data_len);
+	close(fd);
+
+	if (r != SC_SUCCESS) {
+		free(data);
+		return r == SC_ERROR_OUT_OF_MEMORY ? r : SC_ERROR_FILE_NOT_FOUND;
+	}
+	sc_log(ctx, "cache daemon returned %u bytes for %s", msg.data_len, key);
+	*buf = data;
+	*len = msg.data_len;
+	return SC_SUCCESS;
+}
+
+static void cached_put(struct sc_pkcs15_card *p15card, const char *key,
+		       const u8 *buf, size_t len)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cached_msg msg;
+	const char *reader = p15card->card->reader->name;
+	int fd, r;
+
+	if (len == 0 || len > SC_PKCS15_CACHED_MAX_DATA)
+		return;
+	fd = cached_connect(ctx);
+	if (fd < 0)
+		return;
 
+	/* The reader name lets the daemon drop the entry when the card is removed */
+	memset(&msg, 0, sizeof(msg));
+	msg.op = SC_PKCS15_CACHED_PUT;
+	msg.key_len = (unsigned int)strlen(key);
+	msg.reader_len = reader ? (unsigned int)strlen(reader) : 0;
+	msg.data_len = (unsigned int)len;
+	r = cached_send(fd, &msg, sizeof(msg));
+	if (r == SC_SUCCESS)
+		r = cached_send(fd, key, msg.key_len);
+	if (r == SC_SUCCESS && msg.reader_len)
+		r = cached_send(fd, reader, msg.reader_len);
+	if (r == SC_SUCCESS)
+		r = cached_send(fd, buf, len);
+	close(fd);
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "cannot pass %s to cache daemon", key);
+}
+#else
+static int cached_get(struct sc_pkcs15_card *p15card, const char *key,
+		      u8 **buf, size_t *len)
+{
+	return SC_ERROR_FILE_NOT_FOUND;
+}
+
+static void cached_put(struct sc_pkcs15_card *p15card, const char *key,
+		       const u8 *buf, size_t len)
+{
+}
+
+static int cached_check_der(const u8 *data, size_t len)
+{
 	return SC_SUCCESS;
 }
 
+int sc_pkcs15_get_cache_socket(struct sc_context *ctx, char *buf, size_t bufsize)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+#endif
+
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 				const sc_path_t *path,
 				u8 **buf, size_t *bufsize)
 {
-	char fname[PATH_MAX];
+	char key[PATH_MAX], fname[PATH_MAX];
 	int rv;
-	FILE *f;
-	size_t count;
-	struct stat stbuf;
+	size_t len = 0, count, offs = 0;
 	u8 *data = NULL;
 
 	if (path->len < 2)
@@ -120,103 +474,686 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
-	rv = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	rv = generate_cache_key(p15card, path, key, sizeof(key));
 	if (rv != SC_SUCCESS)
 		return rv;
-	sc_log(p15card->card->ctx, "read cached file %s", fname);
 
-	f = fopen(fname, "rb");
-	if (!f)
-		return SC_ERROR_FILE_NOT_FOUND;
-	if (fstat(fileno(f), &stbuf))   {
-		fclose(f);
-		return  SC_ERROR_FILE_NOT_FOUND;
+	rv = SC_ERROR_FILE_NOT_FOUND;
+	if (p15card->opts.use_cache_daemon) {
+		rv = cached_get(p15card, key, &data, &len);
+		if (rv == SC_SUCCESS && cached_check_der(data, len) != SC_SUCCESS) {
+			sc_log(p15card->card->ctx, "ignore malformed %s from cache daemon", key);
+			free(data);
+			data = NULL;
+			rv = SC_ERROR_FILE_NOT_FOUND;
+		}
+	}
+	if (rv == SC_ERROR_FILE_NOT_FOUND && p15card->opts.use_file_cache) {
+		rv = generate_cache_filename(p15card, path, fname, sizeof(fname));
+		if (rv != SC_SUCCESS)
+			return rv;
+		sc_log(p15card->card->ctx, "read cached file %s", fname);
+		rv = cache_read_file(fname, &data, &len);
+		if (rv == SC_SUCCESS && p15card->opts.use_cache_daemon)
+			cached_put(p15card, key, data, len);
 	}
+	if (rv != SC_SUCCESS)
+		return rv;
 
 	if (path->count < 0) {
-		count = stbuf.st_size;
+		count = len;
 	}
 	else {
 		count = path->count;
-		if (path->index + count > (size_t)stbuf.st_size)   {
-			rv = SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
-			goto err;
-		}
-
-		if (0 != fseek(f, (long)path->index, SEEK_SET)) {
-			rv = SC_ERROR_FILE_NOT_FOUND;
-			goto err;
+		offs = path->index;
+		if (offs + count > len)   {
+			free(data);
+			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
 		}
 	}
 
 	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
-		if (data == NULL)   {
-			rv = SC_ERROR_OUT_OF_MEMORY;
-			goto err;
-		}
+		if (offs)
+			memmove(data, data + offs, count);
+		*buf = data;
 	}
 	else {
 		if (count > *bufsize) {
-			rv =  SC_ERROR_BUFFER_TOO_SMALL;
-			goto err;
-		}
-		data = *buf;
-	}
-
-	if (count != fread(data, 1, count, f)) {
-		rv = SC_ERROR_BUFFER_TOO_SMALL;
-		goto err;
-	}
-	*buf = data;
-	*bufsize = count;
-
-	rv = SC_SUCCESS;
-
-err:
-	if (rv != SC_SUCCESS) {
-		if (data != *buf) {
 			free(data);
+			return SC_ERROR_BUFFER_TOO_SMALL;
 		}
+		memcpy(*buf, data + offs, count);
+		free(data);
 	}
+	*bufsize = count;
 
-	fclose(f);
-	return rv;
+	return SC_SUCCESS;
 }
 
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const sc_path_t *path,
 			 const u8 *buf, size_t bufsize)
 {
-	char fname[PATH_MAX];
+	char key[PATH_MAX], fname[PATH_MAX];
 	int r;
-	FILE *f;
-	size_t c;
+
+	if (p15card->opts.use_cache_daemon
+			&& generate_cache_key(p15card, path, key, sizeof(key)) == SC_SUCCESS)
+		cached_put(p15card, key, buf, bufsize);
+	if (!p15card->opts.use_file_cache)
+		return 0;
 
 	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
 	if (r != 0)
 		return r;
 
-	f = fopen(fname, "wb");
-	/* If the open failed because the cache directory does
-	 * not exist, create it and a re-try the fopen() call.
-	 */
-	if (f == NULL && errno == ENOENT) {
-		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
+	return cache_write_file(p15card->card->ctx, fname, buf, bufsize);
+}
+
+/*
+ * Snapshot of the decoded PKCS#15 directory files.
+ *
+ * The objects of all enumerated DFs are written in their in-memory layout,
+ * followed by the variable length DER blobs they reference. The snapshot
+ * is stored next to the cached files, keyed by the same serial number and
+ * lastUpdate, so that a later bind can restore the object list without
+ * decoding the DFs again. The header records the layout version and the
+ * sizes of the serialized structures: a snapshot written by a different
+ * build is ignored.
+ */
+#define SNAPSHOT_MAGIC		"P15S"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_SUFFIX		".objects"
+
+struct snapshot_header {
+	char magic[4];
+	unsigned int version;
+	unsigned int sizes[8];
+	unsigned int df_count;
+};
+
+struct snapshot_buf {
+	u8 *data;
+	size_t len, size;
+};
+
+struct snapshot_reader {
+	const u8 *p;
+	size_t left;
+};
+
+static void
+snapshot_init_header(struct snapshot_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->sizes[0] = sizeof(struct sc_pkcs15_object);
+	hdr->sizes[1] = sizeof(struct sc_pkcs15_prkey_info);
+	hdr->sizes[2] = sizeof(struct sc_pkcs15_pubkey_info);
+	hdr->sizes[3] = sizeof(struct sc_pkcs15_skey_info);
+	hdr->sizes[4] = sizeof(struct sc_pkcs15_cert_info);
+	hdr->sizes[5] = sizeof(struct sc_pkcs15_data_info);
+	hdr->sizes[6] = sizeof(struct sc_pkcs15_auth_info);
+	hdr->sizes[7] = sizeof(struct sc_path);
+}
+
+static size_t
+snapshot_info_size(unsigned int type)
+{
+	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		return sizeof(struct sc_pkcs15_prkey_info);
+	case SC_PKCS15_TYPE_PUBKEY:
+		return sizeof(struct sc_pkcs15_pubkey_info);
+	case SC_PKCS15_TYPE_SKEY:
+		return sizeof(struct sc_pkcs15_skey_info);
+	case SC_PKCS15_TYPE_CERT:
+		return sizeof(struct sc_pkcs15_cert_info);
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return sizeof(struct sc_pkcs15_data_info);
+	case SC_PKCS15_TYPE_AUTH:
+		return sizeof(struct sc_pkcs15_auth_info);
+	}
+	return 0;
+}
+
+static int
+snapshot_name(struct sc_pkcs15_card *p15card, int filename, char *buf, size_t bufsize)
+{
+	struct sc_path path;
+	int r;
+
+	if (p15card->file_app == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	path = p15card->file_app->path;
+	if (path.type == SC_PATH_TYPE_DF_NAME) {
+		/* application selected by its AID only */
+		if (path.len > SC_MAX_AID_SIZE)
+			return SC_ERROR_INVALID_ARGUMENTS;
+		memcpy(path.aid.value, path.value, path.len);
+		path.aid.len = path.len;
+		path.len = 0;
+		path.type = SC_PATH_TYPE_PATH;
+	}
+	if (filename)
+		r = generate_cache_filename(p15card, &path, buf, bufsize);
+	else
+		r = generate_cache_key(p15card, &path, buf, bufsize);
+	if (r != SC_SUCCESS)
+		return r;
+	if (strlen(buf) + strlen(SNAPSHOT_SUFFIX) >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(buf, SNAPSHOT_SUFFIX);
+	return SC_SUCCESS;
+}
+
+static int
+snapshot_put(struct snapshot_buf *sb, const void *ptr, size_t len)
+{
+	if (sb->len + len > sb->size) {
+		size_t size = sb->size ? sb->size : 4096;
+		u8 *p;
+
+		while (sb->len + len > size)
+			size *= 2;
+		p = realloc(sb->data, size);
+		if (p == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		sb->data = p;
+		sb->size = size;
+	}
+	memcpy(sb->data + sb->len, ptr, len);
+	sb->len += len;
+	return SC_SUCCESS;
+}
+
+static int
+snapshot_put_der(struct snapshot_buf *sb, const void *value, size_t len)
+{
+	unsigned int l = value ? (unsigned int)len : 0;
+	int r;
+
+	r = snapshot_put(sb, &l, sizeof(l));
+	if (r == SC_SUCCESS && l)
+		r = snapshot_put(sb, value, l);
+	return r;
+}
+
+static int
+snapshot_get(struct snapshot_reader *sr, void *ptr, size_t len)
+{
+	if (len > sr->left)
+		return SC_ERROR_CORRUPTED_DATA;
+	memcpy(ptr, sr->p, len);
+	sr->p += len;
+	sr->left -= len;
+	return SC_SUCCESS;
+}
+
+static int
+snapshot_get_der(struct snapshot_reader *sr, void **value, size_t *len)
+{
+	unsigned int l;
+	int r;
+
+	*value = NULL;
+	*len = 0;
+	r = snapshot_get(sr, &l, sizeof(l));
+	if (r != SC_SUCCESS || l == 0)
+		return r;
+	if (l > sr->left)
+		return SC_ERROR_CORRUPTED_DATA;
+	*value = malloc(l);
+	if (*value == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(*value, sr->p, l);
+	*len = l;
+	sr->p += l;
+	sr->left -= l;
+	return SC_SUCCESS;
+}
+
+/* The retry counters and the login state of an authentication object are
+ * runtime state: set them as sc_pkcs15_decode_aodf_entry() does */
+static void
+snapshot_reset_auth_state(struct sc_pkcs15_auth_info *info)
+{
+	info->tries_left = -1;
+	info->max_tries = 0;
+	info->logged_in = SC_PIN_STATE_UNKNOWN;
+	info->max_unlocks = 0;
+}
+
+static int
+snapshot_put_object(struct snapshot_buf *sb, const struct sc_pkcs15_object *obj)
+{
+	size_t info_size = snapshot_info_size(obj->type);
+	struct sc_pkcs15_auth_info auth_info;
+	const void *data = obj->data;
+	int r;
+
+	if (!info_size || obj->data == NULL || obj->emulated != NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_AUTH) {
+		memcpy(&auth_info, obj->data, sizeof(auth_info));
+		snapshot_reset_auth_state(&auth_info);
+		data = &auth_info;
+	}
+
+	r = snapshot_put(sb, obj, sizeof(*obj));
+	if (r == SC_SUCCESS)
+		r = snapshot_put_der(sb, obj->content.value, obj->content.len);
+	if (r == SC_SUCCESS)
+		r = snapshot_put(sb, data, info_size);
+	if (r != SC_SUCCESS)
+		return r;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		const struct sc_pkcs15_prkey_info *info = obj->data;
+
+		/* only the flat parameters produced by the PrKDF decoder are supported */
+		if (info->params.free_params != NULL || info->aux_data != NULL)
+			return SC_ERROR_NOT_SUPPORTED;
+		r = snapshot_put_der(sb, info->subject.value, info->subject.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_put_der(sb, info->params.data, info->params.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		const struct sc_pkcs15_pubkey_info *info = obj->data;
+
+		if (info->params.free_params != NULL)
+			return SC_ERROR_NOT_SUPPORTED;
+		r = snapshot_put_der(sb, info->subject.value, info->subject.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_put_der(sb, info->params.data, info->params.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_put_der(sb, info->direct.raw.value, info->direct.raw.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_put_der(sb, info->direct.spki.value, info->direct.spki.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		const struct sc_pkcs15_skey_info *info = obj->data;
+
+		r = snapshot_put_der(sb, info->data.value, info->data.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		const struct sc_pkcs15_cert_info *info = obj->data;
+
+		r = snapshot_put_der(sb, info->value.value, info->value.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		const struct sc_pkcs15_data_info *info = obj->data;
+
+		r = snapshot_put_der(sb, info->data.value, info->data.len);
+		break;
+	}
+	}
+
+	return r;
+}
+
+/* The structures of a snapshot are copied as they were stored: check every
+ * field that is used as a length or as a string before the object is used. */
+static int
+snapshot_check_id(const struct sc_pkcs15_id *id)
+{
+	return id->len <= SC_PKCS15_MAX_ID_SIZE;
+}
+
+static int
+snapshot_check_path(const struct sc_path *path)
+{
+	return path->len <= SC_MAX_PATH_SIZE && path->aid.len <= SC_MAX_AID_SIZE
+		&& path->index >= 0 && path->count >= -1
+		&& path->type >= SC_PATH_TYPE_FILE_ID && path->type <= SC_PATH_TYPE_PARENT;
+}
+
+static int
+snapshot_check_object(const struct sc_pkcs15_object *obj)
+{
+	int i, ok;
+
+	ok = memchr(obj->label, '\0', sizeof(obj->label)) != NULL
+		&& snapshot_check_id(&obj->auth_id);
+	for (i = 0; ok && i < SC_PKCS15_MAX_ACCESS_RULES; i++)
+		ok = snapshot_check_id(&obj->access_rules[i].auth_id);
+	if (!ok)
+		return SC_ERROR_CORRUPTED_DATA;
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		const struct sc_pkcs15_prkey_info *info = obj->data;
+
+		ok = snapshot_check_id(&info->id) && snapshot_check_path(&info->path);
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		const struct sc_pkcs15_pubkey_info *info = obj->data;
+
+		ok = snapshot_check_id(&info->id) && snapshot_check_path(&info->path);
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		const struct sc_pkcs15_skey_info *info = obj->data;
+
+		ok = snapshot_check_id(&info->id) && snapshot_check_path(&info->path);
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		const struct sc_pkcs15_cert_info *info = obj->data;
+
+		ok = snapshot_check_id(&info->id) && snapshot_check_path(&info->path);
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		const struct sc_pkcs15_data_info *info = obj->data;
+
+		ok = snapshot_check_id(&info->id) && snapshot_check_path(&info->path)
+			&& memchr(info->app_label, '\0', sizeof(info->app_label)) != NULL;
+		break;
+	}
+	case SC_PKCS15_TYPE_AUTH: {
+		const struct sc_pkcs15_auth_info *info = obj->data;
+
+		ok = snapshot_check_id(&info->auth_id) && snapshot_check_path(&info->path);
+		if (!ok)
+			break;
+		switch (info->auth_type) {
+		case SC_PKCS15_PIN_AUTH_TYPE_PIN:
+			ok = info->attrs.pin.min_length <= SC_MAX_PIN_SIZE
+				&& info->attrs.pin.stored_length <= SC_MAX_PIN_SIZE
+				&& info->attrs.pin.max_length <= SC_MAX_PIN_SIZE;
+			break;
+		case SC_PKCS15_PIN_AUTH_TYPE_AUTH_KEY:
+			ok = snapshot_check_id(&info->attrs.authkey.skey_id);
+			break;
+		case SC_PKCS15_PIN_AUTH_TYPE_BIOMETRIC:
+		case SC_PKCS15_PIN_AUTH_TYPE_SM_KEY:
+			break;
+		default:
+			ok = 0;
+		}
+		break;
+	}
+	default:
+		ok = 0;
+	}
+
+	return ok ? SC_SUCCESS : SC_ERROR_CORRUPTED_DATA;
+}
+
+static int
+snapshot_get_object(struct snapshot_reader *sr, struct sc_pkcs15_object **out)
+{
+	struct sc_pkcs15_object *obj;
+	size_t info_size;
+	int r;
+
+	obj = calloc(1, sizeof(*obj));
+	if (obj == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	r = snapshot_get(sr, obj, sizeof(*obj));
+	obj->data = obj->emulated = NULL;
+	obj->df = NULL;
+	obj->next = obj->prev = NULL;
+	obj->content.value = NULL;
+	obj->content.len = 0;
+	if (r != SC_SUCCESS) {
+		free(obj);
+		return r;
+	}
+
+	info_size = snapshot_info_size(obj->type);
+	if (!info_size) {
+		free(obj);
+		return SC_ERROR_CORRUPTED_DATA;
+	}
+
+	r = snapshot_get_der(sr, (void **)&obj->content.value, &obj->content.len);
+	if (r == SC_SUCCESS) {
+		obj->data = calloc(1, info_size);
+		if (obj->data == NULL)
+			r = SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (r == SC_SUCCESS)
+		r = snapshot_get(sr, obj->data, info_size);
+	if (r != SC_SUCCESS) {
+		/* 'data' holds no valid pointers yet */
+		free(obj->data);
+		obj->data = NULL;
+		sc_pkcs15_free_object_content(obj);
+		free(obj);
+		return r;
+	}
+
+	/* Reset all pointers before anything can fail, so that the object
+	 * may be released with sc_pkcs15_free_object() */
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		struct sc_pkcs15_prkey_info *info = obj->data;
+
+		info->subject.value = NULL;
+		info->params.data = NULL;
+		info->params.free_params = NULL;
+		info->aux_data = NULL;
+		r = snapshot_get_der(sr, (void **)&info->subject.value, &info->subject.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_get_der(sr, &info->params.data, &info->params.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		struct sc_pkcs15_pubkey_info *info = obj->data;
+
+		info->subject.value = NULL;
+		info->params.data = NULL;
+		info->params.free_params = NULL;
+		info->direct.raw.value = NULL;
+		info->direct.spki.value = NULL;
+		r = snapshot_get_der(sr, (void **)&info->subject.value, &info->subject.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_get_der(sr, &info->params.data, &info->params.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_get_der(sr, (void **)&info->direct.raw.value, &info->direct.raw.len);
+		if (r == SC_SUCCESS)
+			r = snapshot_get_der(sr, (void **)&info->direct.spki.value, &info->direct.spki.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		struct sc_pkcs15_skey_info *info = obj->data;
+
+		info->data.value = NULL;
+		r = snapshot_get_der(sr, (void **)&info->data.value, &info->data.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		struct sc_pkcs15_cert_info *info = obj->data;
+
+		info->value.value = NULL;
+		r = snapshot_get_der(sr, (void **)&info->value.value, &info->value.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		struct sc_pkcs15_data_info *info = obj->data;
+
+		info->data.value = NULL;
+		r = snapshot_get_der(sr, (void **)&info->data.value, &info->data.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_AUTH:
+		/* snapshots of older versions stored the runtime state */
+		snapshot_reset_auth_state(obj->data);
+		break;
+	}
+
+	if (r == SC_SUCCESS)
+		r = snapshot_check_object(obj);
+	if (r != SC_SUCCESS) {
+		sc_pkcs15_free_object(obj);
+		return r;
+	}
+
+	*out = obj;
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct snapshot_header hdr;
+	struct snapshot_buf sb;
+	struct sc_pkcs15_df *df;
+	struct sc_pkcs15_object *obj;
+	char key[PATH_MAX], fname[PATH_MAX];
+	int r;
+
+	r = snapshot_name(p15card, 0, key, sizeof(key));
+	if (r != SC_SUCCESS)
+		return r;
+
+	memset(&sb, 0, sizeof(sb));
+	snapshot_init_header(&hdr);
+	for (df = p15card->df_list; df; df = df->next)
+		if (df->enumerated)
+			hdr.df_count++;
+
+	r = snapshot_put(&sb, &hdr, sizeof(hdr));
+	for (df = p15card->df_list; r == SC_SUCCESS && df; df = df->next) {
+		unsigned int count = 0;
+
+		if (!df->enumerated)
+			continue;
+		for (obj = p15card->obj_list; obj; obj = obj->next)
+			if (obj->df == df)
+				count++;
+
+		r = snapshot_put(&sb, &df->path, sizeof(df->path));
+		if (r == SC_SUCCESS)
+			r = snapshot_put(&sb, &df->type, sizeof(df->type));
+		if (r == SC_SUCCESS)
+			r = snapshot_put(&sb, &count, sizeof(count));
+		for (obj = p15card->obj_list; r == SC_SUCCESS && obj; obj = obj->next)
+			if (obj->df == df)
+				r = snapshot_put_object(&sb, obj);
+	}
+	if (r != SC_SUCCESS) {
+		sc_log(ctx, "cannot serialize PKCS#15 objects: %s", sc_strerror(r));
+		free(sb.data);
+		return r;
+	}
+
+	if (p15card->opts.use_cache_daemon)
+		cached_put(p15card, key, sb.data, sb.len);
+	r = 0;
+	if (p15card->opts.use_object_cache) {
+		r = snapshot_name(p15card, 1, fname, sizeof(fname));
+		if (r == SC_SUCCESS)
+			r = cache_write_file(ctx, fname, sb.data, sb.len);
+		if (r == SC_SUCCESS)
+			sc_log(ctx, "stored PKCS#15 object snapshot %s", fname);
+	}
+	free(sb.data);
+	return r;
+}
+
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct snapshot_header hdr, expected;
+	struct snapshot_reader sr;
+	char key[PATH_MAX], fname[PATH_MAX];
+	u8 *data = NULL;
+	size_t len = 0;
+	unsigned int i, j;
+	int r;
+
+	r = snapshot_name(p15card, 0, key, sizeof(key));
+	if (r != SC_SUCCESS)
+		return r;
+
+	r = SC_ERROR_FILE_NOT_FOUND;
+	if (p15card->opts.use_cache_daemon)
+		r = cached_get(p15card, key, &data, &len);
+	if (r == SC_ERROR_FILE_NOT_FOUND && p15card->opts.use_object_cache) {
+		r = snapshot_name(p15card, 1, fname, sizeof(fname));
+		if (r != SC_SUCCESS)
 			return r;
-		f = fopen(fname, "wb");
+		r = cache_read_file(fname, &data, &len);
+		if (r == SC_SUCCESS && p15card->opts.use_cache_daemon)
+			cached_put(p15card, key, data, len);
 	}
-	if (f == NULL)
-		return 0;
+	if (r != SC_SUCCESS)
+		return r;
 
-	c = fwrite(buf, 1, bufsize, f);
-	fclose(f);
-	if (c != bufsize) {
-		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL,
-			 "fwrite() wrote only %"SC_FORMAT_LEN_SIZE_T"u bytes",
-			 c);
-		unlink(fname);
-		return SC_ERROR_INTERNAL;
+	sr.p = data;
+	sr.left = len;
+	snapshot_init_header(&expected);
+	r = snapshot_get(&sr, &hdr, sizeof(hdr));
+	if (r == SC_SUCCESS && (memcmp(hdr.magic, expected.magic, sizeof(hdr.magic))
+			|| hdr.version != expected.version
+			|| memcmp(hdr.sizes, expected.sizes, sizeof(hdr.sizes)))) {
+		sc_log(ctx, "ignore incompatible PKCS#15 object snapshot %s", key);
+		r = SC_ERROR_FILE_NOT_FOUND;
 	}
-	return 0;
+
+	for (i = 0; r == SC_SUCCESS && i < hdr.df_count; i++) {
+		struct sc_pkcs15_object *head = NULL, *tail = NULL, *obj;
+		struct sc_pkcs15_df *df;
+		struct sc_path path;
+		unsigned int type, count;
+
+		r = snapshot_get(&sr, &path, sizeof(path));
+		if (r == SC_SUCCESS)
+			r = snapshot_get(&sr, &type, sizeof(type));
+		if (r == SC_SUCCESS)
+			r = snapshot_get(&sr, &count, sizeof(count));
+		if (r == SC_SUCCESS && !snapshot_check_path(&path))
+			r = SC_ERROR_CORRUPTED_DATA;
+		if (r != SC_SUCCESS)
+			break;
+
+		for (j = 0; r == SC_SUCCESS && j < count; j++) {
+			r = snapshot_get_object(&sr, &obj);
+			if (r != SC_SUCCESS)
+				break;
+			if (tail)
+				tail->next = obj;
+			else
+				head = obj;
+			tail = obj;
+		}
+
+		for (df = p15card->df_list; df; df = df->next)
+			if (df->type == type && sc_compare_path(&df->path, &path)
+					&& df->path.index == path.index
+					&& df->path.count == path.count)
+				break;
+
+		/* Attach the objects of a DF only if all of them were restored */
+		while (head) {
+			obj = head;
+			head = head->next;
+			if (r == SC_SUCCESS && df && !df->enumerated) {
+				obj->df = df;
+				sc_pkcs15_add_object(p15card, obj);
+			}
+			else {
+				sc_pkcs15_free_object(obj);
+			}
+		}
+		if (r == SC_SUCCESS && df && !df->enumerated) {
+			sc_log(ctx, "restored %u objects of DF %s from snapshot", count, sc_print_path(&df->path));
+			df->enumerated = 1;
+		}
+	}
+
+	free(data);
+	return r;
 }
@@ -313,7 +313,8 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	sc_security_env_t senv;
 	sc_algorithm_info_t *alg_info;
 	const struct sc_pkcs15_prkey_info *prkey = (const struct sc_pkcs15_prkey_info *) obj->data;
-	u8 buf[1024], *tmp;
+	u8 buf[1024];
+	const u8 *data;
 	size_t modlen;
 	unsigned long pad_flags = 0, sec_flags = 0;
 
@@ -345,18 +346,20 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	if (inlen > sizeof(buf) || outlen < modlen)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
 
-	memcpy(buf, in, inlen);
+	/* The input is copied into buf only where it has to be changed,
+	 * the padding functions below write their result straight to buf */
+	data = in;
 
 	/* revert data to sign when signing with the GOST key.
 	 * TODO: can it be confirmed by the GOST standard?
 	 * TODO: tested with RuTokenECP, has to be validated for RuToken. */
 	if (obj->type == SC_PKCS15_TYPE_PRKEY_GOSTR3410)   {
+		memcpy(buf, in, inlen);
 		r = sc_mem_reverse(buf, inlen);
 		LOG_TEST_RET(ctx, r, "Reverse memory error");
+		data = buf;
 	}
 
-	tmp = buf;
-
 	/* flags: the requested algo
 	 * algo_info->flags: what is supported by the card
 	 * senv.algorithm_flags: what the card will have to do */
@@ -398,7 +401,7 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 		unsigned int algo;
 		size_t tmplen = sizeof(buf);
 
-		r = sc_pkcs1_strip_digest_info_prefix(&algo, tmp, inlen, tmp, &tmplen);
+		r = sc_pkcs1_strip_digest_info_prefix(&algo, data, inlen, buf, &tmplen);
 		if (r != SC_SUCCESS || algo == SC_ALGORITHM_RSA_HASH_NONE) {
 			sc_mem_clear(buf, sizeof(buf));
 			LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_DATA);
@@ -406,6 +409,7 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 		flags &= ~SC_ALGORITHM_RSA_HASH_NONE;
 		flags |= algo;
 		inlen = tmplen;
+		data = buf;
 	}
 
 	r = sc_get_encoding_flags(ctx, flags, alg_info->flags, &pad_flags, &sec_flags);
@@ -422,10 +426,11 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	if (pad_flags != 0) {
 		size_t tmplen = sizeof(buf);
 
-		r = sc_pkcs1_encode(ctx, pad_flags, tmp, inlen, tmp, &tmplen, modlen);
+		r = sc_pkcs1_encode(ctx, pad_flags, data, inlen, buf, &tmplen, modlen);
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, r, "Unable to add padding");
 
 		inlen = tmplen;
+		data = buf;
 	}
 	else if ( senv.algorithm == SC_ALGORITHM_RSA &&
 			(flags & SC_ALGORITHM_RSA_PADS) == SC_ALGORITHM_RSA_PAD_NONE) {
@@ -433,8 +438,9 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 		if (inlen < modlen) {
 			if (modlen > sizeof(buf))
 				return SC_ERROR_BUFFER_TOO_SMALL;
-			memmove(tmp+modlen-inlen, tmp, inlen);
-			memset(tmp, 0, modlen-inlen);
+			memmove(buf+modlen-inlen, data, inlen);
+			memset(buf, 0, modlen-inlen);
+			data = buf;
 		}
 		inlen = modlen;
 	}
@@ -449,7 +455,7 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	}
 
 
-	r = use_key(p15card, obj, &senv, sc_compute_signature, tmp, inlen,
+	r = use_key(p15card, obj, &senv, sc_compute_signature, data, inlen,
 			out, outlen);
 	LOG_TEST_RET(ctx, r, "use_key() failed");
 	sc_mem_clear(buf, sizeof(buf));
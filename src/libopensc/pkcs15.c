@@ -1087,7 +1087,7 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
 	err = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
+	if (p15card->opts.use_file_cache || p15card->opts.use_cache_daemon) {
 		err = sc_pkcs15_read_cached_file(p15card, &tmppath, &buf, &len);
 		if (err == SC_SUCCESS)
 			err = len;
@@ -1106,7 +1106,7 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		/* sc_read_binary may return less than requested */
 		len = err;
 
-		if (p15card->opts.use_file_cache) {
+		if (p15card->opts.use_file_cache || p15card->opts.use_cache_daemon) {
 			sc_pkcs15_cache_file(p15card, &tmppath, buf, len);
 		}
 	}
@@ -1155,7 +1155,7 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
 	err = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
+	if (p15card->opts.use_file_cache || p15card->opts.use_cache_daemon) {
 		err = sc_pkcs15_read_cached_file(p15card, &tmppath, &buf, &len);
 		if (err == SC_SUCCESS)
 			err = len;
@@ -1174,7 +1174,7 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		/* sc_read_binary may return less than requested */
 		len = err;
 
-		if (p15card->opts.use_file_cache) {
+		if (p15card->opts.use_file_cache || p15card->opts.use_cache_daemon) {
 			sc_pkcs15_cache_file(p15card, &tmppath, buf, len);
 		}
 	}
@@ -1207,6 +1207,11 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
 	}
 
+	if (p15card->opts.use_object_cache || p15card->opts.use_cache_daemon) {
+		/* Restore the DF objects decoded by an earlier bind, if any */
+		sc_pkcs15_read_cached_objects(p15card);
+	}
+
 	ok = 1;
 end:
 	if(buf != NULL)
@@ -1243,6 +1248,8 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 
 	p15card->card = card;
 	p15card->opts.use_file_cache = 0;
+	p15card->opts.use_object_cache = 0;
+	p15card->opts.use_cache_daemon = 0;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
@@ -1251,13 +1258,18 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 
 	if (conf_block) {
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
+		p15card->opts.use_object_cache = scconf_get_bool(conf_block, "use_object_caching", p15card->opts.use_file_cache);
+#ifndef _WIN32
+		p15card->opts.use_cache_daemon = scconf_get_str(conf_block, "cache_socket", NULL) != NULL;
+#endif
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
 				p15card->opts.pin_cache_ignore_user_consent);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
-			p15card->opts.use_file_cache, p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_object_cache=%d use_cache_daemon=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
+			p15card->opts.use_file_cache, p15card->opts.use_object_cache, p15card->opts.use_cache_daemon,
+			p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
 			p15card->opts.pin_cache_ignore_user_consent);
 
 	r = sc_lock(card);
@@ -1330,7 +1342,7 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 	struct sc_pkcs15_df	*df = NULL;
 	unsigned int	df_mask = 0;
 	size_t		match_count = 0;
-	int r;
+	int r, parsed = 0;
 
 	if (type)
 		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
@@ -1374,8 +1386,13 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 			r = sc_pkcs15_parse_df(p15card, df);
 		if (r != SC_SUCCESS)
 			continue;
+		parsed++;
 	}
 
+	/* Store the snapshot once all the DFs of this search are enumerated */
+	if (parsed && (p15card->opts.use_object_cache || p15card->opts.use_cache_daemon))
+		sc_pkcs15_cache_objects(p15card);
+
 	/* And now loop over all objects */
 	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
 		/* Check object type */
@@ -2349,7 +2366,7 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 	sc_log(ctx, "path=%s, index=%u, count=%d", sc_print_path(in_path), in_path->index, in_path->count);
 
 	r = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
+	if (p15card->opts.use_file_cache || p15card->opts.use_cache_daemon) {
 		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
 
 		if (!r && in_path->aid.len > 0 && in_path->len >= 2)   {
@@ -2435,7 +2452,7 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 
 		sc_file_free(file);
 
-		if (len && p15card->opts.use_file_cache) {
+		if (len && (p15card->opts.use_file_cache || p15card->opts.use_cache_daemon)) {
 			sc_pkcs15_cache_file(p15card, in_path, data, len);
 		}
 	}
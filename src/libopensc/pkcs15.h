@@ -588,6 +588,8 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		int use_object_cache;
+		int use_cache_daemon;
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
@@ -908,6 +910,30 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+/* Snapshot of the objects decoded from the enumerated DFs */
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card);
+
+/* Messages of the cache daemon protocol. A request is a header followed by
+ * key_len bytes of cache key, reader_len bytes of reader name and data_len
+ * bytes of data. GET is answered with a FOUND header followed by the data,
+ * or with a MISS header; PUT is not answered. */
+#define SC_PKCS15_CACHED_GET		1
+#define SC_PKCS15_CACHED_PUT		2
+#define SC_PKCS15_CACHED_FOUND		3
+#define SC_PKCS15_CACHED_MISS		4
+#define SC_PKCS15_CACHED_MAX_KEY	1024
+#define SC_PKCS15_CACHED_MAX_READER	256
+#define SC_PKCS15_CACHED_MAX_DATA	(4 * 1024 * 1024)
+
+struct sc_pkcs15_cached_msg {
+	unsigned int op;
+	unsigned int key_len;
+	unsigned int reader_len;
+	unsigned int data_len;
+};
+/* Path of the socket of the cache daemon */
+int sc_pkcs15_get_cache_socket(struct sc_context *ctx, char *buf, size_t bufsize);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -35,6 +35,11 @@
 #else
 #include <arpa/inet.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 #include "common/libscdl.h"
 #include "internal.h"
@@ -73,6 +78,9 @@
 #define SCARD_ATTR_VENDOR_IFD_VERSION SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_INFO, 0x0102) /**< Vendor-supplied interface device version (DWORD in the form 0xMMmmbbbb where MM = major version, mm = minor version, and bbbb = build number). */
 #endif
 
+/* upper limit of transaction_linger, in ms */
+#define PCSC_MAX_TRANSACTION_LINGER 1000
+
 /* Logging */
 #define PCSC_TRACE(reader, desc, rv) do { sc_log(reader->ctx, "%s:" desc ": 0x%08lx\n", reader->name, (unsigned long)((ULONG)rv)); } while (0)
 #define PCSC_LOG(ctx, desc, rv) do { sc_log(ctx, desc ": 0x%08lx\n", (unsigned long)((ULONG)rv)); } while (0)
@@ -89,6 +97,7 @@ struct pcsc_global_private_data {
 	DWORD disconnect_action;
 	DWORD transaction_end_action;
 	DWORD reconnect_action;
+	unsigned int transaction_linger;	/* ms, 0 to end transactions at once */
 	const char *provider_library;
 	void *dlhandle;
 	SCardEstablishContext_t SCardEstablishContext;
@@ -127,6 +136,21 @@ struct pcsc_private_data {
 	DWORD get_tlv_properties;
 
 	int locked;
+
+	/* encoded command and response of the last APDU */
+	sc_apdu_buffer_t sbuf, rbuf;
+
+#ifdef HAVE_PTHREAD
+	/* transaction kept after the last unlock, ended by linger_thread
+	 * when not locked again within transaction_linger ms */
+	int linger_started;
+	int lingering;
+	int linger_stop;
+	struct timespec linger_end;
+	pthread_mutex_t linger_mutex;
+	pthread_cond_t linger_cond;
+	pthread_t linger_thread;
+#endif
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
@@ -259,8 +283,8 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t ssize, rsize, rbuflen = 0;
-	u8 *sbuf = NULL, *rbuf = NULL;
+	struct pcsc_private_data *priv = reader->drv_data;
+	size_t ssize = 0, rsize, rbuflen;
 	int r;
 
 	/* we always use a at least 258 byte size big return buffer
@@ -269,40 +293,39 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
 	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
+	r = sc_apdu_buffer_reserve(&priv->rbuf, rbuflen);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_apdu_buffer_reserve(&priv->sbuf,
+			sc_apdu_get_length(apdu, reader->active_protocol));
+	if (r != SC_SUCCESS)
+		return r;
 
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	r = sc_apdu_encode(reader->ctx, apdu, reader->active_protocol,
+			priv->sbuf.value, priv->sbuf.size, &ssize);
 	if (r != SC_SUCCESS)
 		goto out;
 	if (reader->name)
 		sc_log(reader->ctx, "reader '%s'", reader->name);
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->sbuf.value, ssize, 1);
 
-	r = pcsc_internal_transmit(reader, sbuf, ssize,
-				rbuf, &rsize, apdu->control);
+	r = pcsc_internal_transmit(reader, priv->sbuf.value, ssize,
+				priv->rbuf.value, &rsize, apdu->control);
 	if (r < 0) {
 		/* unable to transmit ... most likely a reader problem */
 		sc_log(reader->ctx, "unable to transmit");
 		goto out;
 	}
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	rbuflen = rsize;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, priv->rbuf.value, rsize, 0);
 	/* set response */
-	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+	r = sc_apdu_set_resp(reader->ctx, apdu, priv->rbuf.value, rsize);
 
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
+	/* only clear what has been used by this APDU */
+	sc_mem_clear(priv->sbuf.value, ssize);
+	sc_mem_clear(priv->rbuf.value, rbuflen);
 
 	return r;
 }
@@ -451,6 +474,151 @@ static int check_forced_protocol(sc_reader_t *reader, DWORD *protocol)
 }
 
 
+#ifdef HAVE_PTHREAD
+/* Ends the lingering transaction, called with linger_mutex held */
+static void pcsc_linger_end_locked(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+
+	if (!priv->lingering)
+		return;
+	priv->lingering = 0;
+	if (!(reader->ctx->flags & SC_CTX_FLAG_TERMINATE))
+		priv->gpriv->SCardEndTransaction(priv->pcsc_card,
+				priv->gpriv->transaction_end_action);
+}
+
+static void *pcsc_linger_main(void *arg)
+{
+	sc_reader_t *reader = arg;
+	struct pcsc_private_data *priv = reader->drv_data;
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	while (!priv->linger_stop) {
+		struct timeval now;
+
+		if (!priv->lingering) {
+			pthread_cond_wait(&priv->linger_cond, &priv->linger_mutex);
+			continue;
+		}
+		if (pthread_cond_timedwait(&priv->linger_cond, &priv->linger_mutex,
+					&priv->linger_end) != ETIMEDOUT)
+			continue;
+
+		/* the deadline may have moved while waiting for the mutex */
+		gettimeofday(&now, NULL);
+		if (now.tv_sec > priv->linger_end.tv_sec
+				|| (now.tv_sec == priv->linger_end.tv_sec
+					&& now.tv_usec * 1000 >= priv->linger_end.tv_nsec))
+			pcsc_linger_end_locked(reader);
+	}
+	pthread_mutex_unlock(&priv->linger_mutex);
+	return NULL;
+}
+
+static int pcsc_linger_start(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+
+	if (priv->linger_started)
+		return SC_SUCCESS;
+
+	if (pthread_mutex_init(&priv->linger_mutex, NULL))
+		return SC_ERROR_INTERNAL;
+	if (pthread_cond_init(&priv->linger_cond, NULL)) {
+		pthread_mutex_destroy(&priv->linger_mutex);
+		return SC_ERROR_INTERNAL;
+	}
+	priv->lingering = 0;
+	priv->linger_stop = 0;
+	if (pthread_create(&priv->linger_thread, NULL, pcsc_linger_main, reader)) {
+		pthread_cond_destroy(&priv->linger_cond);
+		pthread_mutex_destroy(&priv->linger_mutex);
+		return SC_ERROR_INTERNAL;
+	}
+	priv->linger_started = 1;
+	return SC_SUCCESS;
+}
+
+/* Keeps the transaction for transaction_linger ms instead of ending it */
+static int pcsc_linger(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct timeval now;
+	long usec;
+
+	if (pcsc_linger_start(reader) != SC_SUCCESS)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	gettimeofday(&now, NULL);
+	usec = now.tv_usec + (long) priv->gpriv->transaction_linger * 1000;
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	priv->linger_end.tv_sec = now.tv_sec + usec / 1000000;
+	priv->linger_end.tv_nsec = (usec % 1000000) * 1000;
+	priv->lingering = 1;
+	priv->locked = 0;
+	pthread_cond_signal(&priv->linger_cond);
+	pthread_mutex_unlock(&priv->linger_mutex);
+	return SC_SUCCESS;
+}
+
+/* Takes over the lingering transaction, if still there */
+static int pcsc_linger_resume(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	int resumed = 0;
+
+	if (!priv->linger_started)
+		return 0;
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	if (priv->lingering) {
+		priv->lingering = 0;
+		priv->locked = 1;
+		resumed = 1;
+	}
+	pthread_mutex_unlock(&priv->linger_mutex);
+	return resumed;
+}
+
+static void pcsc_linger_end(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+
+	if (!priv->linger_started)
+		return;
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	pcsc_linger_end_locked(reader);
+	pthread_mutex_unlock(&priv->linger_mutex);
+}
+
+static void pcsc_linger_stop(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+
+	if (!priv->linger_started)
+		return;
+
+	pthread_mutex_lock(&priv->linger_mutex);
+	pcsc_linger_end_locked(reader);
+	priv->linger_stop = 1;
+	pthread_cond_signal(&priv->linger_cond);
+	pthread_mutex_unlock(&priv->linger_mutex);
+
+	pthread_join(priv->linger_thread, NULL);
+	pthread_cond_destroy(&priv->linger_cond);
+	pthread_mutex_destroy(&priv->linger_mutex);
+	priv->linger_started = 0;
+}
+#else
+#define pcsc_linger(reader)		SC_ERROR_NOT_SUPPORTED
+#define pcsc_linger_resume(reader)	0
+#define pcsc_linger_end(reader)
+#define pcsc_linger_stop(reader)
+#endif
+
 static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 {
 	DWORD active_proto = opensc_proto_to_pcsc(reader->active_protocol),
@@ -461,6 +629,8 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 
 	sc_log(reader->ctx, "Reconnecting to the card...");
 
+	pcsc_linger_end(reader);
+
 	r = refresh_attributes(reader);
 	if (r!= SC_SUCCESS)
 		return r;
@@ -592,6 +762,8 @@ static int pcsc_disconnect(sc_reader_t * reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+	pcsc_linger_end(reader);
+
 	if (!priv->gpriv->cardmod && !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE)) {
 		LONG rv = priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 		PCSC_TRACE(reader, "SCardDisconnect returned", rv);
@@ -614,6 +786,13 @@ static int pcsc_lock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+	if (pcsc_linger_resume(reader)) {
+		sc_log(reader->ctx, "Reusing the lingering transaction");
+		reader->flags |= SC_READER_TRANSACTION_RESUMED;
+		return SC_SUCCESS;
+	}
+	reader->flags &= ~SC_READER_TRANSACTION_RESUMED;
+
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 
@@ -664,6 +843,10 @@ static int pcsc_unlock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+	if (priv->gpriv->transaction_linger
+			&& pcsc_linger(reader) == SC_SUCCESS)
+		return SC_SUCCESS;
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -678,6 +861,9 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+	pcsc_linger_stop(reader);
+	sc_apdu_buffer_free(&priv->sbuf);
+	sc_apdu_buffer_free(&priv->rbuf);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -746,6 +932,7 @@ static int pcsc_init(sc_context_t *ctx)
 {
 	struct pcsc_global_private_data *gpriv;
 	scconf_block *conf_block = NULL;
+	int linger;
 	int ret = SC_ERROR_INTERNAL;
 
 
@@ -794,6 +981,14 @@ static int pcsc_init(sc_context_t *ctx)
 				"max_send_size", gpriv->force_max_send_size);
 		gpriv->force_max_recv_size = scconf_get_int(conf_block,
 				"max_recv_size", gpriv->force_max_recv_size);
+		linger = scconf_get_int(conf_block, "transaction_linger", 0);
+		if (linger < 0 || linger > PCSC_MAX_TRANSACTION_LINGER) {
+			sc_log(ctx, "transaction_linger=%d out of range 0..%d, using %d", linger,
+					PCSC_MAX_TRANSACTION_LINGER,
+					linger < 0 ? 0 : PCSC_MAX_TRANSACTION_LINGER);
+			linger = linger < 0 ? 0 : PCSC_MAX_TRANSACTION_LINGER;
+		}
+		gpriv->transaction_linger = linger;
 	}
 
 	if (gpriv->cardmod) {
@@ -804,15 +999,16 @@ static int pcsc_init(sc_context_t *ctx)
 		gpriv->disconnect_action = SCARD_LEAVE_CARD;
 		gpriv->transaction_end_action = SCARD_LEAVE_CARD;
 		gpriv->reconnect_action = SCARD_LEAVE_CARD;
+		gpriv->transaction_linger = 0;
 	}
 	sc_log(ctx,
 			"PC/SC options: connect_exclusive=%d disconnect_action=%u transaction_end_action=%u"
-			" reconnect_action=%u enable_pinpad=%d enable_pace=%d",
+			" reconnect_action=%u enable_pinpad=%d enable_pace=%d transaction_linger=%u",
 			gpriv->connect_exclusive,
 			(unsigned int)gpriv->disconnect_action,
 			(unsigned int)gpriv->transaction_end_action,
 			(unsigned int)gpriv->reconnect_action, gpriv->enable_pinpad,
-			gpriv->enable_pace);
+			gpriv->enable_pace, gpriv->transaction_linger);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
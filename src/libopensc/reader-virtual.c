@@ -0,0 +1,1306 @@
+/*
+ * reader-virtual.c: Reader driver for an in-process software card
+ *
+ * Copyright (C) 2017 OpenSC Project developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The virtual reader hosts one ISO 7816-4 software card per configured
+ * image. It answers SELECT, READ BINARY, VERIFY, MSE:SET, PSO,
+ * GET CHALLENGE and GET RESPONSE from an in-memory file system, so that the
+ * complete stack can be exercised and benchmarked without hardware.
+ *
+ * An image is a scconf file:
+ *
+ *	card {
+ *		atr = "3B:80:80:01:01";
+ *		df 3F00 {
+ *			df 5015 {
+ *				aid = "A0:00:00:00:63:50:4B:43:53:2D:31:35";
+ *				ef 5031 { content = "A8:0A:30:08:04:06:3F:00:50:15:44:02"; }
+ *				ef 4401 { file = "/path/to/cert.der"; }
+ *			}
+ *		}
+ *		pin 01 { value = "123456"; tries = 3; }
+ *		key 01 { file = "/path/to/key.pem"; pin = 01; }
+ *	}
+ *
+ * A DF may carry 'select_response' with the data returned when it is
+ * selected by its AID, so that applets can be recognized by their drivers.
+ * Keys are PEM private keys used for PSO:COMPUTE DIGITAL SIGNATURE and
+ * PSO:DECIPHER; 'padding = none' makes the card expect padded input,
+ * otherwise PKCS#1 v1.5 padding is applied on the card.
+ *
+ * When the response of a command with command data is longer than Le, the
+ * card returns the first Le bytes with SW 61xx and keeps the rest for
+ * GET RESPONSE, as cards do for response chaining.
+ *
+ * Alternatively a reader replays an APDU trace recorded with the
+ * 'apdu_trace_file' option: each command is answered with the response
+ * recorded for the same command, after the recorded (scaled) latency.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#endif
+
+#include "internal.h"
+#include "asn1.h"
+
+#define GET_PRIV_DATA(r) ((struct virtual_private_data *) (r)->drv_data)
+
+#define VIRTUAL_DEFAULT_ATR	"3B:80:80:01:01"
+#define VIRTUAL_MAX_FILE_SIZE	0x10000
+/* response data that fits in the response buffer next to SW1 SW2 */
+#define VIRTUAL_MAX_RESP_SIZE	(SC_MAX_EXT_APDU_BUFFER_SIZE - 2)
+
+struct vcard_file {
+	u8 fid[2];
+	int is_df;
+	u8 aid[SC_MAX_AID_SIZE];
+	size_t aid_len;
+	u8 *select_response;
+	size_t select_response_len;
+	u8 *content;
+	size_t size;
+
+	struct vcard_file *parent, *children, *next;
+};
+
+struct vcard_pin {
+	int reference;
+	u8 value[SC_MAX_PIN_SIZE];
+	size_t len;
+	int tries_left, max_tries;
+	int verified;
+	struct vcard_pin *next;
+};
+
+struct vcard_key {
+	int reference;
+	int pin_reference;
+	int raw;
+#ifdef ENABLE_OPENSSL
+	EVP_PKEY *pkey;
+#endif
+	struct vcard_key *next;
+};
+
+struct vtrace_record {
+	u8 *command, *response;
+	size_t command_len, response_len;
+	unsigned long duration;
+};
+
+struct virtual_private_data {
+	char *image;
+	struct sc_atr atr;
+	unsigned int latency;
+
+	struct vcard_file *mf, *current;
+	struct vcard_pin *pins;
+	struct vcard_key *keys;
+
+	/* security environment set by MSE:SET */
+	int se_key_reference;
+
+	/* response data left for GET RESPONSE */
+	u8 *pending;
+	size_t pending_len, pending_offset;
+
+	/* replayed APDU trace */
+	struct vtrace_record *records;
+	size_t nrecords, cursor;
+	unsigned int trace_latency;
+
+	unsigned long apdu_count;
+	int present;
+
+	/* encoded command and response of the last APDU */
+	sc_apdu_buffer_t sbuf, rbuf;
+};
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_drv = {
+	"Virtual software card",
+	"virtual",
+	&virtual_ops,
+	NULL
+};
+
+static void vcard_free_file(struct vcard_file *file)
+{
+	struct vcard_file *child, *next;
+
+	if (file == NULL)
+		return;
+	for (child = file->children; child; child = next) {
+		next = child->next;
+		vcard_free_file(child);
+	}
+	free(file->select_response);
+	free(file->content);
+	free(file);
+}
+
+static void vcard_drop_response(struct virtual_private_data *priv)
+{
+	if (priv->pending) {
+		sc_mem_clear(priv->pending, priv->pending_len);
+		free(priv->pending);
+	}
+	priv->pending = NULL;
+	priv->pending_len = 0;
+	priv->pending_offset = 0;
+}
+
+static void vcard_free(struct virtual_private_data *priv)
+{
+	struct vcard_pin *pin, *next_pin;
+	struct vcard_key *key, *next_key;
+	size_t i;
+
+	vcard_free_file(priv->mf);
+	priv->mf = priv->current = NULL;
+	for (pin = priv->pins; pin; pin = next_pin) {
+		next_pin = pin->next;
+		sc_mem_clear(pin, sizeof(*pin));
+		free(pin);
+	}
+	priv->pins = NULL;
+	for (key = priv->keys; key; key = next_key) {
+		next_key = key->next;
+#ifdef ENABLE_OPENSSL
+		EVP_PKEY_free(key->pkey);
+#endif
+		free(key);
+	}
+	priv->keys = NULL;
+	vcard_drop_response(priv);
+	for (i = 0; i < priv->nrecords; i++) {
+		free(priv->records[i].command);
+		free(priv->records[i].response);
+	}
+	free(priv->records);
+	priv->records = NULL;
+	priv->nrecords = 0;
+}
+
+static int vcard_read_hex(const char *str, u8 **out, size_t *outlen)
+{
+	size_t len = strlen(str) / 2 + 1;
+	u8 *buf;
+	int r;
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_hex_to_bin(str, buf, &len);
+	if (r < 0) {
+		free(buf);
+		return r;
+	}
+	*out = buf;
+	*outlen = len;
+	return SC_SUCCESS;
+}
+
+static int vcard_read_file(const char *name, u8 **out, size_t *outlen)
+{
+	FILE *f;
+	u8 *buf;
+	size_t len;
+
+	f = fopen(name, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	/* one byte more to detect files that do not fit */
+	buf = malloc(VIRTUAL_MAX_FILE_SIZE + 1);
+	if (buf == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	len = fread(buf, 1, VIRTUAL_MAX_FILE_SIZE + 1, f);
+	if (ferror(f) || len > VIRTUAL_MAX_FILE_SIZE) {
+		fclose(f);
+		free(buf);
+		return SC_ERROR_INVALID_DATA;
+	}
+	fclose(f);
+
+	*out = buf;
+	*outlen = len;
+	return SC_SUCCESS;
+}
+
+static int vcard_load_file(sc_context_t *ctx, scconf_context *conf,
+		const scconf_block *blk, int is_df, struct vcard_file *parent,
+		struct vcard_file **out)
+{
+	struct vcard_file *file;
+	scconf_block **blocks;
+	const char *val;
+	size_t len;
+	int i, r = SC_SUCCESS;
+
+	if (blk->name == NULL || blk->name->data == NULL)
+		return SC_ERROR_INVALID_DATA;
+
+	file = calloc(1, sizeof(struct vcard_file));
+	if (file == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	file->is_df = is_df;
+	file->parent = parent;
+
+	len = sizeof(file->fid);
+	if (sc_hex_to_bin(blk->name->data, file->fid, &len) < 0 || len != sizeof(file->fid)) {
+		sc_log(ctx, "Invalid file identifier '%s'", blk->name->data);
+		r = SC_ERROR_INVALID_DATA;
+		goto out;
+	}
+
+	if ((val = scconf_get_str(blk, "aid", NULL)) != NULL) {
+		file->aid_len = sizeof(file->aid);
+		r = sc_hex_to_bin(val, file->aid, &file->aid_len);
+		if (r < 0)
+			goto out;
+	}
+	if ((val = scconf_get_str(blk, "select_response", NULL)) != NULL) {
+		r = vcard_read_hex(val, &file->select_response, &file->select_response_len);
+		if (r < 0)
+			goto out;
+	}
+
+	if (!is_df) {
+		if ((val = scconf_get_str(blk, "content", NULL)) != NULL)
+			r = vcard_read_hex(val, &file->content, &file->size);
+		else if ((val = scconf_get_str(blk, "file", NULL)) != NULL)
+			r = vcard_read_file(val, &file->content, &file->size);
+		if (r < 0) {
+			sc_log(ctx, "Cannot load content of EF %s", blk->name->data);
+			goto out;
+		}
+		goto out;
+	}
+
+	blocks = scconf_find_blocks(conf, blk, "df", NULL);
+	for (i = 0; r == SC_SUCCESS && blocks && blocks[i]; i++) {
+		struct vcard_file *child = NULL;
+
+		r = vcard_load_file(ctx, conf, blocks[i], 1, file, &child);
+		if (r == SC_SUCCESS) {
+			child->next = file->children;
+			file->children = child;
+		}
+	}
+	free(blocks);
+
+	blocks = scconf_find_blocks(conf, blk, "ef", NULL);
+	for (i = 0; r == SC_SUCCESS && blocks && blocks[i]; i++) {
+		struct vcard_file *child = NULL;
+
+		r = vcard_load_file(ctx, conf, blocks[i], 0, file, &child);
+		if (r == SC_SUCCESS) {
+			child->next = file->children;
+			file->children = child;
+		}
+	}
+	free(blocks);
+
+out:
+	if (r < 0) {
+		vcard_free_file(file);
+		return r;
+	}
+	*out = file;
+	return SC_SUCCESS;
+}
+
+static int vcard_load_image(sc_context_t *ctx, struct virtual_private_data *priv)
+{
+	scconf_context *conf;
+	const scconf_block *card_blk;
+	scconf_block **blocks;
+	const char *val;
+	int i, r;
+
+	conf = scconf_new(priv->image);
+	if (conf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (scconf_parse(conf) < 1) {
+		sc_log(ctx, "Cannot parse card image '%s': %s", priv->image,
+				conf->errmsg ? conf->errmsg : "file not found");
+		scconf_free(conf);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	card_blk = scconf_find_block(conf, NULL, "card");
+	if (card_blk == NULL) {
+		sc_log(ctx, "No 'card' block in card image '%s'", priv->image);
+		scconf_free(conf);
+		return SC_ERROR_INVALID_DATA;
+	}
+
+	val = scconf_get_str(card_blk, "atr", VIRTUAL_DEFAULT_ATR);
+	priv->atr.len = sizeof(priv->atr.value);
+	r = sc_hex_to_bin(val, priv->atr.value, &priv->atr.len);
+	if (r < 0)
+		goto out;
+
+	blocks = scconf_find_blocks(conf, card_blk, "df", NULL);
+	if (blocks && blocks[0])
+		r = vcard_load_file(ctx, conf, blocks[0], 1, NULL, &priv->mf);
+	else
+		r = SC_ERROR_INVALID_DATA;
+	free(blocks);
+	if (r < 0) {
+		sc_log(ctx, "No valid MF in card image '%s'", priv->image);
+		goto out;
+	}
+
+	blocks = scconf_find_blocks(conf, card_blk, "pin", NULL);
+	for (i = 0; blocks && blocks[i]; i++) {
+		struct vcard_pin *pin;
+
+		if (blocks[i]->name == NULL)
+			continue;
+		pin = calloc(1, sizeof(struct vcard_pin));
+		if (pin == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		pin->reference = (int)strtol(blocks[i]->name->data, NULL, 16);
+		val = scconf_get_str(blocks[i], "value", "");
+		pin->len = MIN(strlen(val), sizeof(pin->value));
+		memcpy(pin->value, val, pin->len);
+		pin->max_tries = scconf_get_int(blocks[i], "tries", 3);
+		pin->tries_left = pin->max_tries;
+		pin->next = priv->pins;
+		priv->pins = pin;
+	}
+	free(blocks);
+
+	blocks = scconf_find_blocks(conf, card_blk, "key", NULL);
+	for (i = 0; r >= 0 && blocks && blocks[i]; i++) {
+		struct vcard_key *key;
+
+		if (blocks[i]->name == NULL)
+			continue;
+		key = calloc(1, sizeof(struct vcard_key));
+		if (key == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		key->reference = (int)strtol(blocks[i]->name->data, NULL, 16);
+		key->pin_reference = (int)strtol(scconf_get_str(blocks[i], "pin", "-1"), NULL, 16);
+		val = scconf_get_str(blocks[i], "padding", "pkcs1");
+		key->raw = !strcmp(val, "none");
+#ifdef ENABLE_OPENSSL
+		val = scconf_get_str(blocks[i], "file", NULL);
+		if (val != NULL) {
+			FILE *f = fopen(val, "r");
+
+			if (f != NULL) {
+				key->pkey = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+				fclose(f);
+			}
+			if (key->pkey == NULL)
+				sc_log(ctx, "Cannot load private key '%s'", val);
+		}
+#endif
+		key->next = priv->keys;
+		priv->keys = key;
+	}
+	free(blocks);
+
+out:
+	scconf_free(conf);
+	if (r < 0)
+		vcard_free(priv);
+	return r < 0 ? r : SC_SUCCESS;
+}
+
+/*
+ * Card side
+ */
+
+static struct vcard_file *vcard_find_child(struct vcard_file *df, const u8 *fid)
+{
+	struct vcard_file *child;
+
+	if (df == NULL || !df->is_df)
+		return NULL;
+	for (child = df->children; child; child = child->next)
+		if (!memcmp(child->fid, fid, 2))
+			return child;
+	return NULL;
+}
+
+static struct vcard_file *vcard_find_aid(struct vcard_file *df, const u8 *aid, size_t aid_len)
+{
+	struct vcard_file *child, *found;
+
+	if (df == NULL || !df->is_df)
+		return NULL;
+	if (df->aid_len && df->aid_len >= aid_len && !memcmp(df->aid, aid, aid_len))
+		return df;
+	for (child = df->children; child; child = child->next)
+		if ((found = vcard_find_aid(child, aid, aid_len)) != NULL)
+			return found;
+	return NULL;
+}
+
+static struct vcard_file *vcard_current_df(struct virtual_private_data *priv)
+{
+	if (priv->current == NULL)
+		return priv->mf;
+	return priv->current->is_df ? priv->current : priv->current->parent;
+}
+
+static size_t vcard_encode_fcp(struct vcard_file *file, u8 *out)
+{
+	u8 *p = out + 2;
+
+	if (file->is_df) {
+		*p++ = 0x82; *p++ = 0x01; *p++ = 0x38;
+	}
+	else {
+		*p++ = 0x80; *p++ = 0x02;
+		*p++ = (file->size >> 8) & 0xFF;
+		*p++ = file->size & 0xFF;
+		*p++ = 0x82; *p++ = 0x01; *p++ = 0x01;
+	}
+	*p++ = 0x83; *p++ = 0x02;
+	*p++ = file->fid[0];
+	*p++ = file->fid[1];
+	if (file->aid_len) {
+		*p++ = 0x84;
+		*p++ = (u8)file->aid_len;
+		memcpy(p, file->aid, file->aid_len);
+		p += file->aid_len;
+	}
+	out[0] = 0x62;
+	out[1] = (u8)(p - out - 2);
+	return p - out;
+}
+
+static unsigned int vcard_select(struct virtual_private_data *priv, unsigned int p1, unsigned int p2,
+		const u8 *data, size_t datalen, u8 *resp, size_t *resplen)
+{
+	struct vcard_file *file = NULL;
+	size_t i;
+
+	switch (p1) {
+	case 0x00:
+		if (datalen == 0 || (datalen == 2 && data[0] == 0x3F && data[1] == 0x00)) {
+			file = priv->mf;
+			break;
+		}
+		if (datalen != 2)
+			return 0x6A87;
+		file = vcard_find_child(vcard_current_df(priv), data);
+		if (file == NULL && vcard_current_df(priv))
+			file = vcard_find_child(vcard_current_df(priv)->parent, data);
+		break;
+	case 0x01:
+	case 0x02:
+		if (datalen != 2)
+			return 0x6A87;
+		file = vcard_find_child(vcard_current_df(priv), data);
+		if (file && file->is_df != (p1 == 0x01))
+			file = NULL;
+		break;
+	case 0x03:
+		file = vcard_current_df(priv) ? vcard_current_df(priv)->parent : NULL;
+		break;
+	case 0x04:
+		file = vcard_find_aid(priv->mf, data, datalen);
+		if (file && file->select_response) {
+			if (file->select_response_len > VIRTUAL_MAX_RESP_SIZE)
+				return 0x6A84;
+			priv->current = file;
+			memcpy(resp, file->select_response, file->select_response_len);
+			*resplen = file->select_response_len;
+			return 0x9000;
+		}
+		break;
+	case 0x08:
+	case 0x09:
+		if (datalen == 0 || datalen % 2)
+			return 0x6A87;
+		file = (p1 == 0x08) ? priv->mf : vcard_current_df(priv);
+		for (i = 0; file && i < datalen; i += 2)
+			file = vcard_find_child(file, data + i);
+		break;
+	default:
+		return 0x6A86;
+	}
+
+	if (file == NULL)
+		return 0x6A82;
+	priv->current = file;
+
+	if ((p2 & 0x0C) != 0x0C)
+		*resplen = vcard_encode_fcp(file, resp);
+	return 0x9000;
+}
+
+static unsigned int vcard_read_binary(struct virtual_private_data *priv, unsigned int p1, unsigned int p2,
+		size_t le, u8 *resp, size_t *resplen)
+{
+	struct vcard_file *file = priv->current;
+	size_t offset;
+
+	if (p1 & 0x80)
+		return 0x6A81;
+	if (file == NULL || file->is_df)
+		return 0x6986;
+	offset = (p1 << 8) | p2;
+	if (offset > file->size)
+		return 0x6B00;
+	*resplen = MIN(le, file->size - offset);
+	memcpy(resp, file->content + offset, *resplen);
+	if (*resplen < le)
+		return 0x6282;
+	return 0x9000;
+}
+
+static struct vcard_pin *vcard_find_pin(struct virtual_private_data *priv, int reference)
+{
+	struct vcard_pin *pin;
+
+	for (pin = priv->pins; pin; pin = pin->next)
+		if (pin->reference == reference)
+			return pin;
+	return NULL;
+}
+
+static unsigned int vcard_verify(struct virtual_private_data *priv, unsigned int p2,
+		const u8 *data, size_t datalen)
+{
+	struct vcard_pin *pin = vcard_find_pin(priv, p2 & 0x7F);
+
+	if (pin == NULL)
+		return 0x6A88;
+	if (datalen == 0) {
+		if (pin->verified)
+			return 0x9000;
+		return 0x63C0 | MIN(pin->tries_left, 0x0F);
+	}
+	if (pin->tries_left == 0)
+		return 0x6983;
+
+	/* the PIN may be padded by the host */
+	while (datalen > pin->len && (data[datalen - 1] == 0xFF || data[datalen - 1] == 0x00))
+		datalen--;
+	if (datalen != pin->len || memcmp(data, pin->value, datalen)) {
+		pin->verified = 0;
+		pin->tries_left--;
+		return 0x63C0 | MIN(pin->tries_left, 0x0F);
+	}
+	pin->tries_left = pin->max_tries;
+	pin->verified = 1;
+	return 0x9000;
+}
+
+static unsigned int vcard_mse(struct virtual_private_data *priv, unsigned int p1, unsigned int p2,
+		const u8 *data, size_t datalen)
+{
+	size_t i;
+
+	if ((p1 & 0x0F) != 0x01)
+		return 0x9000;
+	for (i = 0; i + 2 <= datalen; i += 2 + data[i + 1]) {
+		if (i + 2 + data[i + 1] > datalen)
+			return 0x6A80;
+		if ((data[i] == 0x83 || data[i] == 0x84) && data[i + 1] > 0)
+			priv->se_key_reference = data[i + 2 + data[i + 1] - 1];
+	}
+	return 0x9000;
+}
+
+static unsigned int vcard_pso(sc_context_t *ctx, struct virtual_private_data *priv,
+		unsigned int p1, unsigned int p2,
+		const u8 *data, size_t datalen, u8 *resp, size_t *resplen)
+{
+#ifdef ENABLE_OPENSSL
+	struct vcard_key *key;
+	struct vcard_pin *pin;
+	EVP_PKEY_CTX *pctx;
+	size_t outlen = VIRTUAL_MAX_RESP_SIZE;
+	int sign, r;
+
+	if (p1 == 0x9E && p2 == 0x9A)
+		sign = 1;
+	else if (p1 == 0x80 && p2 == 0x86)
+		sign = 0;
+	else
+		return 0x6A86;
+
+	for (key = priv->keys; key; key = key->next)
+		if (key->reference == priv->se_key_reference)
+			break;
+	if (key == NULL || key->pkey == NULL)
+		return 0x6A88;
+	if (key->pin_reference >= 0) {
+		pin = vcard_find_pin(priv, key->pin_reference);
+		if (pin == NULL || !pin->verified)
+			return 0x6982;
+	}
+
+	/* skip the padding indicator */
+	if (!sign) {
+		if (datalen < 1)
+			return 0x6700;
+		data++;
+		datalen--;
+	}
+
+	pctx = EVP_PKEY_CTX_new(key->pkey, NULL);
+	if (pctx == NULL)
+		return 0x6F00;
+	if (sign)
+		r = EVP_PKEY_sign_init(pctx);
+	else
+		r = EVP_PKEY_decrypt_init(pctx);
+	if (r > 0 && EVP_PKEY_base_id(key->pkey) == EVP_PKEY_RSA)
+		r = EVP_PKEY_CTX_set_rsa_padding(pctx, key->raw ? RSA_NO_PADDING : RSA_PKCS1_PADDING);
+	if (r > 0 && sign)
+		r = EVP_PKEY_sign(pctx, resp, &outlen, data, datalen);
+	else if (r > 0)
+		r = EVP_PKEY_decrypt(pctx, resp, &outlen, data, datalen);
+	EVP_PKEY_CTX_free(pctx);
+	if (r <= 0)
+		return 0x6A80;
+
+	/* ECDSA signatures are returned as r || s, like ISO 7816-8 cards do */
+	if (sign && EVP_PKEY_base_id(key->pkey) == EVP_PKEY_EC) {
+		u8 rs[2 * 72];
+		size_t rslen = 2 * ((EVP_PKEY_bits(key->pkey) + 7) / 8);
+
+		if (rslen > sizeof(rs)
+				|| sc_asn1_sig_value_sequence_to_rs(ctx, resp, outlen, rs, rslen) != SC_SUCCESS)
+			return 0x6F00;
+		memcpy(resp, rs, rslen);
+		outlen = rslen;
+	}
+
+	*resplen = outlen;
+	return 0x9000;
+#else
+	return 0x6D00;
+#endif
+}
+
+static unsigned int vcard_get_challenge(size_t le, u8 *resp, size_t *resplen)
+{
+	size_t i;
+
+	if (le == 0)
+		return 0x6700;
+#ifdef ENABLE_OPENSSL
+	if (RAND_bytes(resp, (int)le) != 1)
+#endif
+		for (i = 0; i < le; i++)
+			resp[i] = (u8)rand();
+	*resplen = le;
+	return 0x9000;
+}
+
+/* Keep the response data that did not fit in Le for GET RESPONSE */
+static unsigned int vcard_keep_response(struct virtual_private_data *priv,
+		const u8 *data, size_t len)
+{
+	priv->pending = malloc(len);
+	if (priv->pending == NULL)
+		return 0x6F00;
+	memcpy(priv->pending, data, len);
+	priv->pending_len = len;
+	priv->pending_offset = 0;
+	return 0x6100 | (len < 256 ? len : 0);
+}
+
+static unsigned int vcard_get_response(struct virtual_private_data *priv, unsigned int p1,
+		unsigned int p2, size_t le, u8 *resp, size_t *resplen)
+{
+	size_t left;
+
+	if (p1 != 0 || p2 != 0)
+		return 0x6A86;
+	if (priv->pending == NULL)
+		return 0x6985;
+	if (le == 0)
+		return 0x6700;
+
+	left = priv->pending_len - priv->pending_offset;
+	if (le > left)
+		le = left;
+	memcpy(resp, priv->pending + priv->pending_offset, le);
+	*resplen = le;
+	priv->pending_offset += le;
+
+	left -= le;
+	if (left == 0) {
+		vcard_drop_response(priv);
+		return 0x9000;
+	}
+	return 0x6100 | (left < 256 ? left : 0);
+}
+
+/* Split a command APDU in header, command data and Le */
+static int vcard_parse_apdu(const u8 *buf, size_t len, const u8 **data, size_t *datalen, size_t *le)
+{
+	size_t lc;
+
+	*data = NULL;
+	*datalen = 0;
+	*le = 0;
+	if (len < 4)
+		return SC_ERROR_INVALID_DATA;
+	if (len == 4)
+		return SC_SUCCESS;
+	if (len == 5) {
+		*le = buf[4] ? buf[4] : 256;
+		return SC_SUCCESS;
+	}
+	if (buf[4] != 0) {
+		lc = buf[4];
+		if (len == 5 + lc) {
+			*data = buf + 5;
+			*datalen = lc;
+			return SC_SUCCESS;
+		}
+		if (len == 6 + lc) {
+			*data = buf + 5;
+			*datalen = lc;
+			*le = buf[len - 1] ? buf[len - 1] : 256;
+			return SC_SUCCESS;
+		}
+		return SC_ERROR_INVALID_DATA;
+	}
+	/* extended length */
+	if (len < 7)
+		return SC_ERROR_INVALID_DATA;
+	lc = (buf[5] << 8) | buf[6];
+	if (len == 7) {
+		*le = lc ? lc : 65536;
+		return SC_SUCCESS;
+	}
+	if (len == 7 + lc || len == 9 + lc) {
+		*data = buf + 7;
+		*datalen = lc;
+		if (len == 9 + lc) {
+			*le = (buf[len - 2] << 8) | buf[len - 1];
+			if (*le == 0)
+				*le = 65536;
+		}
+		return SC_SUCCESS;
+	}
+	return SC_ERROR_INVALID_DATA;
+}
+
+static void vcard_process_apdu(sc_context_t *ctx, struct virtual_private_data *priv,
+		const u8 *cmd, size_t cmdlen, u8 *resp, size_t *resplen)
+{
+	const u8 *data;
+	size_t datalen, le, len = 0;
+	unsigned int sw;
+
+	/* data left from the previous command is only available to the
+	 * GET RESPONSE that directly follows it */
+	if (cmdlen < 2 || cmd[1] != 0xC0)
+		vcard_drop_response(priv);
+
+	if (vcard_parse_apdu(cmd, cmdlen, &data, &datalen, &le) < 0) {
+		sw = 0x6700;
+	}
+	else if (cmd[0] & 0x80) {
+		sw = 0x6E00;
+	}
+	else {
+		switch (cmd[1]) {
+		case 0xA4:
+			sw = vcard_select(priv, cmd[2], cmd[3], data, datalen, resp, &len);
+			break;
+		case 0xB0:
+			sw = vcard_read_binary(priv, cmd[2], cmd[3], le, resp, &len);
+			break;
+		case 0x20:
+			sw = vcard_verify(priv, cmd[3], data, datalen);
+			break;
+		case 0x22:
+			sw = vcard_mse(priv, cmd[2], cmd[3], data, datalen);
+			break;
+		case 0x2A:
+			sw = vcard_pso(ctx, priv, cmd[2], cmd[3], data, datalen, resp, &len);
+			break;
+		case 0x84:
+			sw = vcard_get_challenge(le, resp, &len);
+			break;
+		case 0xC0:
+			sw = vcard_get_response(priv, cmd[2], cmd[3], le, resp, &len);
+			break;
+		default:
+			sw = 0x6D00;
+		}
+	}
+
+	/* No data is returned without Le. Data of a command with command data
+	 * that does not fit in Le is chained with GET RESPONSE. Otherwise data
+	 * that does not fit in Le is not returned: the card tells the length
+	 * to ask for instead, or refuses the command. */
+	if (le == 0) {
+		len = 0;
+	}
+	else if (len > le && datalen > 0 && sw == 0x9000) {
+		sw = vcard_keep_response(priv, resp + le, len - le);
+		len = sw == 0x6F00 ? 0 : le;
+	}
+	else if (len > le) {
+		sw = len <= 256 ? 0x6C00 | (len & 0xFF) : 0x6700;
+		len = 0;
+	}
+	resp[len++] = (sw >> 8) & 0xFF;
+	resp[len++] = sw & 0xFF;
+	*resplen = len;
+}
+
+/*
+ * Trace replay
+ */
+
+static int vtrace_get(FILE *f, size_t n, size_t *value)
+{
+	int c;
+
+	*value = 0;
+	while (n--) {
+		if ((c = fgetc(f)) == EOF)
+			return SC_ERROR_INVALID_DATA;
+		*value = (*value << 8) | (size_t)c;
+	}
+	return SC_SUCCESS;
+}
+
+static int vtrace_get_data(FILE *f, u8 **out, size_t *outlen)
+{
+	size_t len;
+
+	if (vtrace_get(f, 4, &len) < 0 || len > SC_MAX_EXT_APDU_BUFFER_SIZE + 2)
+		return SC_ERROR_INVALID_DATA;
+	*out = malloc(len ? len : 1);
+	if (*out == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (fread(*out, 1, len, f) != len) {
+		free(*out);
+		*out = NULL;
+		return SC_ERROR_INVALID_DATA;
+	}
+	*outlen = len;
+	return SC_SUCCESS;
+}
+
+static int vtrace_load(sc_context_t *ctx, struct virtual_private_data *priv)
+{
+	struct vtrace_record *rec;
+	u8 magic[5];
+	size_t value, reader, allocated = 0, skipped = 0;
+	int type, r = SC_SUCCESS, replayed = -1;
+	FILE *f;
+
+	f = fopen(priv->image, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)
+			|| memcmp(magic, SC_APDU_TRACE_MAGIC, 4)
+			|| magic[4] != SC_APDU_TRACE_VERSION) {
+		sc_log(ctx, "'%s' is not an APDU trace", priv->image);
+		fclose(f);
+		return SC_ERROR_INVALID_DATA;
+	}
+
+	/* Only the reader of the first record is replayed */
+	while (r == SC_SUCCESS && (type = fgetc(f)) != EOF) {
+		r = vtrace_get(f, 1, &reader);
+		if (r < 0)
+			break;
+		if (replayed < 0)
+			replayed = (int)reader;
+
+		if (type == SC_APDU_TRACE_ATR) {
+			r = vtrace_get(f, 1, &value);
+			if (r < 0 || value > SC_MAX_ATR_SIZE) {
+				r = SC_ERROR_INVALID_DATA;
+				break;
+			}
+			/* the first session defines the card */
+			if (priv->atr.len == 0 && (int)reader == replayed) {
+				if (fread(priv->atr.value, 1, value, f) != value)
+					r = SC_ERROR_INVALID_DATA;
+				priv->atr.len = value;
+			}
+			else if (fseek(f, (long)value, SEEK_CUR) != 0) {
+				r = SC_ERROR_INVALID_DATA;
+			}
+			continue;
+		}
+		if (type != SC_APDU_TRACE_EXCHANGE) {
+			r = SC_ERROR_INVALID_DATA;
+			break;
+		}
+
+		if (priv->nrecords == allocated) {
+			struct vtrace_record *tmp;
+
+			allocated = allocated ? 2 * allocated : 64;
+			tmp = realloc(priv->records, allocated * sizeof(*tmp));
+			if (tmp == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			priv->records = tmp;
+		}
+		rec = &priv->records[priv->nrecords];
+		memset(rec, 0, sizeof(*rec));
+		r = vtrace_get(f, 4, &value);
+		if (r == SC_SUCCESS) {
+			rec->duration = (unsigned long)value;
+			r = vtrace_get_data(f, &rec->command, &rec->command_len);
+		}
+		if (r == SC_SUCCESS) {
+			r = vtrace_get_data(f, &rec->response, &rec->response_len);
+			if (r < 0)
+				free(rec->command);
+		}
+		if (r == SC_SUCCESS && rec->response_len < 2) {
+			free(rec->command);
+			free(rec->response);
+			r = SC_ERROR_INVALID_DATA;
+		}
+		if (r == SC_SUCCESS && (int)reader != replayed) {
+			free(rec->command);
+			free(rec->response);
+			skipped++;
+		}
+		else if (r == SC_SUCCESS) {
+			priv->nrecords++;
+		}
+	}
+	fclose(f);
+	if (skipped)
+		sc_log(ctx, "Skipped %"SC_FORMAT_LEN_SIZE_T"u APDUs of other readers in '%s'", skipped, priv->image);
+
+	if (r == SC_SUCCESS && priv->atr.len == 0) {
+		priv->atr.len = sizeof(priv->atr.value);
+		r = sc_hex_to_bin(VIRTUAL_DEFAULT_ATR, priv->atr.value, &priv->atr.len);
+	}
+	if (r < 0) {
+		sc_log(ctx, "Invalid APDU trace '%s'", priv->image);
+		vcard_free(priv);
+		return r;
+	}
+	sc_log(ctx, "Loaded %"SC_FORMAT_LEN_SIZE_T"u APDUs from '%s'", priv->nrecords, priv->image);
+	return SC_SUCCESS;
+}
+
+/* Find the next recorded exchange for the command. The search continues
+ * after the last answered command, so that repeated commands get their
+ * responses in recording order, and wraps around for a new session. */
+static const struct vtrace_record *vtrace_find(struct virtual_private_data *priv,
+		const u8 *cmd, size_t cmdlen)
+{
+	size_t i, idx;
+
+	for (i = 0; i < priv->nrecords; i++) {
+		idx = (priv->cursor + i) % priv->nrecords;
+		if (priv->records[idx].command_len == cmdlen
+				&& !memcmp(priv->records[idx].command, cmd, cmdlen)) {
+			priv->cursor = idx + 1;
+			return &priv->records[idx];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Reader side
+ */
+
+static void virtual_delay(unsigned long usec)
+{
+	if (usec == 0)
+		return;
+#ifdef _WIN32
+	Sleep((DWORD)(usec / 1000));
+#else
+	usleep(usec);
+#endif
+}
+
+static int virtual_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	size_t ssize = 0, rsize = 0;
+	u8 *sbuf, *rbuf;
+	int r;
+
+	if (!priv->present)
+		return SC_ERROR_CARD_REMOVED;
+
+	r = sc_apdu_buffer_reserve(&priv->rbuf, SC_MAX_EXT_APDU_BUFFER_SIZE + 2);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_apdu_buffer_reserve(&priv->sbuf, sc_apdu_get_length(apdu, SC_PROTO_RAW));
+	if (r != SC_SUCCESS)
+		return r;
+	sbuf = priv->sbuf.value;
+	rbuf = priv->rbuf.value;
+
+	/* encode and log the APDU */
+	r = sc_apdu_encode(reader->ctx, apdu, SC_PROTO_RAW, sbuf, priv->sbuf.size, &ssize);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	if (priv->records) {
+		const struct vtrace_record *rec = vtrace_find(priv, sbuf, ssize);
+
+		if (rec == NULL) {
+			sc_log(reader->ctx, "Command not found in APDU trace");
+			rbuf[0] = 0x6F;
+			rbuf[1] = 0x00;
+			rsize = 2;
+		}
+		else {
+			memcpy(rbuf, rec->response, rec->response_len);
+			rsize = rec->response_len;
+			virtual_delay(rec->duration * priv->trace_latency / 100);
+		}
+	}
+	else {
+		vcard_process_apdu(reader->ctx, priv, sbuf, ssize, rbuf, &rsize);
+	}
+	priv->apdu_count++;
+	virtual_delay(priv->latency);
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	/* set response */
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	sc_mem_clear(sbuf, ssize);
+	sc_mem_clear(rbuf, rsize);
+
+	return r;
+}
+
+static int virtual_detect_card_presence(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv->present)
+		reader->flags |= SC_READER_CARD_PRESENT;
+	else
+		reader->flags &= ~SC_READER_CARD_PRESENT;
+	return reader->flags;
+}
+
+static int virtual_connect(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	struct vcard_pin *pin;
+
+	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
+		return SC_ERROR_NOT_ALLOWED;
+	if (!priv->present)
+		return SC_ERROR_CARD_NOT_PRESENT;
+
+	/* reset of the card */
+	priv->cursor = 0;
+	priv->current = priv->mf;
+	priv->se_key_reference = -1;
+	vcard_drop_response(priv);
+	for (pin = priv->pins; pin; pin = pin->next)
+		pin->verified = 0;
+
+	reader->atr = priv->atr;
+	reader->active_protocol = SC_PROTO_T1;
+	_sc_parse_atr(reader);
+
+	return SC_SUCCESS;
+}
+
+static int virtual_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_release(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv) {
+		sc_log(reader->ctx, "%s: %lu APDUs transmitted", reader->name, priv->apdu_count);
+		sc_apdu_buffer_free(&priv->sbuf);
+		sc_apdu_buffer_free(&priv->rbuf);
+		vcard_free(priv);
+		free(priv->image);
+		free(priv);
+		reader->drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+static int virtual_add_reader(sc_context_t *ctx, scconf_block *conf_block,
+		const char *image, int is_trace, int n)
+{
+	struct virtual_private_data *priv;
+	sc_reader_t *reader;
+	char namebuf[128];
+	int r;
+
+	reader = calloc(1, sizeof(sc_reader_t));
+	priv = calloc(1, sizeof(struct virtual_private_data));
+	if (!priv || !reader) {
+		free(reader);
+		free(priv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	priv->image = strdup(image);
+	priv->latency = MAX(scconf_get_int(conf_block, "latency", 0), 0);
+	priv->trace_latency = MAX(scconf_get_int(conf_block, "trace_latency", 100), 0);
+	priv->se_key_reference = -1;
+	if (priv->image == NULL) {
+		free(reader);
+		free(priv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	if (is_trace)
+		r = vtrace_load(ctx, priv);
+	else
+		r = vcard_load_image(ctx, priv);
+	if (r < 0) {
+		sc_log(ctx, "Cannot load card image '%s': %s", priv->image, sc_strerror(r));
+		free(priv->image);
+		free(priv);
+		free(reader);
+		return r;
+	}
+	priv->present = 1;
+
+	reader->drv_data = priv;
+	reader->ops = &virtual_ops;
+	reader->driver = &virtual_drv;
+	snprintf(namebuf, sizeof(namebuf), "Virtual Reader %d", n);
+	reader->name = strdup(namebuf);
+	reader->max_send_size = scconf_get_int(conf_block, "max_send_size", 0);
+	reader->max_recv_size = scconf_get_int(conf_block, "max_recv_size", 0);
+	reader->supported_protocols = SC_PROTO_T1;
+
+	r = _sc_add_reader(ctx, reader);
+	if (r) {
+		virtual_release(reader);
+		free(reader->name);
+		free(reader);
+	}
+	return r;
+}
+
+static int virtual_init(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+	const scconf_list *list;
+	int n = 0, r;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block == NULL)
+		return SC_SUCCESS;
+
+	for (list = scconf_find_list(conf_block, "images"); list != NULL; list = list->next) {
+		r = virtual_add_reader(ctx, conf_block, list->data, 0, n);
+		if (r == SC_ERROR_OUT_OF_MEMORY)
+			return r;
+		if (r == SC_SUCCESS)
+			n++;
+	}
+	for (list = scconf_find_list(conf_block, "traces"); list != NULL; list = list->next) {
+		r = virtual_add_reader(ctx, conf_block, list->data, 1, n);
+		if (r == SC_ERROR_OUT_OF_MEMORY)
+			return r;
+		if (r == SC_SUCCESS)
+			n++;
+	}
+
+	return SC_SUCCESS;
+}
+
+static int virtual_finish(sc_context_t *ctx)
+{
+	return SC_SUCCESS;
+}
+
+int sc_virtual_reader_enabled(sc_context_t *ctx)
+{
+	scconf_block *conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+
+	return conf_block != NULL && (scconf_find_list(conf_block, "images") != NULL
+			|| scconf_find_list(conf_block, "traces") != NULL);
+}
+
+struct sc_reader_driver * sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.transmit = virtual_transmit;
+	virtual_ops.detect_card_presence = virtual_detect_card_presence;
+	virtual_ops.lock = virtual_lock;
+	virtual_ops.unlock = virtual_unlock;
+	virtual_ops.release = virtual_release;
+	virtual_ops.connect = virtual_connect;
+	virtual_ops.disconnect = virtual_disconnect;
+	virtual_ops.perform_verify = NULL;
+	virtual_ops.perform_pace = NULL;
+	virtual_ops.use_reader = NULL;
+
+	return &virtual_drv;
+}
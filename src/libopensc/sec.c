@@ -44,6 +44,8 @@ int sc_decipher(sc_card_t *card,
 	if (card->ops->decipher == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+	if (r < 0)
+		card->cache.sec_env_valid = 0;
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -60,9 +62,31 @@ int sc_compute_signature(sc_card_t *card,
 	if (card->ops->compute_signature == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->compute_signature(card, data, datalen, out, outlen);
+	if (r < 0)
+		card->cache.sec_env_valid = 0;
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
+static int sec_env_equal(const sc_security_env_t *env1, const sc_security_env_t *env2)
+{
+	if (env1->flags != env2->flags
+			|| env1->operation != env2->operation
+			|| env1->algorithm != env2->algorithm
+			|| env1->algorithm_flags != env2->algorithm_flags
+			|| env1->algorithm_ref != env2->algorithm_ref)
+		return 0;
+	if ((env1->flags & SC_SEC_ENV_FILE_REF_PRESENT)
+			&& !sc_compare_path(&env1->file_ref, &env2->file_ref))
+		return 0;
+	if ((env1->flags & SC_SEC_ENV_KEY_REF_PRESENT)
+			&& (env1->key_ref_len != env2->key_ref_len
+				|| env1->key_ref_len > sizeof(env1->key_ref)
+				|| memcmp(env1->key_ref, env2->key_ref, env1->key_ref_len)))
+		return 0;
+	return !memcmp(env1->supported_algos, env2->supported_algos,
+			sizeof(env1->supported_algos));
+}
+
 int sc_set_security_env(sc_card_t *card,
 			const sc_security_env_t *env,
 			int se_num)
@@ -75,7 +99,20 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+
+	if ((card->caps & SC_CARD_CAP_REUSE_SEC_ENV) && se_num == 0
+			&& card->cache.sec_env_valid
+			&& sec_env_equal(&card->cache.sec_env, env)) {
+		sc_log(card->ctx, "security environment unchanged, not set again");
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
+
+	card->cache.sec_env_valid = 0;
 	r = card->ops->set_security_env(card, env, se_num);
+	if (r == SC_SUCCESS && (card->caps & SC_CARD_CAP_REUSE_SEC_ENV) && se_num == 0) {
+		card->cache.sec_env = *env;
+		card->cache.sec_env_valid = 1;
+	}
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -89,6 +126,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.sec_env_valid = 0;
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
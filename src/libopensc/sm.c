@@ -140,7 +140,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	if (rv == SC_ERROR_SM_NOT_APPLIED)   {
 		/* SM wrap of this APDU is ignored by card driver.
 		 * Send plain APDU to the reader driver */
-		rv = card->reader->ops->transmit(card->reader, apdu);
+		rv = sc_trace_transmit(card, apdu);
 		LOG_FUNC_RETURN(ctx, rv);
 	} else {
 		if (rv < 0)
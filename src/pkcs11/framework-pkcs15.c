@@ -492,6 +492,7 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 
+	attr_cache_clear(&obj->base);
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -643,6 +644,7 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 	struct sc_pkcs15_cert *p15_cert = NULL;
 	struct pkcs15_cert_object *object = NULL;
 	struct pkcs15_pubkey_object *obj2 = NULL;
+	struct pkcs15_any_object *any = NULL;
 	int rv;
 
 	p15_info = (struct sc_pkcs15_cert_info *) cert->data;
@@ -657,8 +659,9 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 	}
 
 	/* Certificate object */
-	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
+	rv = __pkcs15_create_object(fw_data, &any,
 			cert, &pkcs15_cert_ops, sizeof(struct pkcs15_cert_object));
+	object = (struct pkcs15_cert_object *) any;
 	if (rv < 0) {
 		if (p15_cert != NULL)
 			sc_pkcs15_free_certificate(p15_cert);
@@ -667,14 +670,16 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 
 	object->cert_info = p15_info;
 	object->cert_data = p15_cert;
+	object->cert_flags |= SC_PKCS11_OBJECT_CACHE_ATTRS;
 
 	/* Corresponding public key */
-	rv = public_key_created(fw_data, &p15_info->id, (struct pkcs15_any_object **) &obj2);
+	rv = public_key_created(fw_data, &p15_info->id, &any);
 	if (rv != SC_SUCCESS)
-		rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &obj2,
+		rv = __pkcs15_create_object(fw_data, &any,
 				NULL, &pkcs15_pubkey_ops, sizeof(struct pkcs15_pubkey_object));
 	if (rv < 0)
 		return rv;
+	obj2 = (struct pkcs15_pubkey_object *) any;
 
 	if (p15_cert) {
 		 /* make a copy of public key from the cert */
@@ -686,6 +691,7 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 
 	obj2->pub_genfrom = object;
 	object->cert_pubkey = obj2;
+	obj2->pub_flags |= SC_PKCS11_OBJECT_CACHE_ATTRS;
 
 	/* Find missing labels for certificate */
 	pkcs15_cert_extract_label(object);
@@ -702,6 +708,7 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 	struct sc_pkcs15_object *pubkey, struct pkcs15_any_object **pubkey_object)
 {
 	struct pkcs15_pubkey_object *object = NULL;
+	struct pkcs15_any_object *any = NULL;
 	struct sc_pkcs15_pubkey *p15_key = NULL;
 	int rv;
 
@@ -730,11 +737,13 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 	}
 
 	/* Public key object */
-	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
+	rv = __pkcs15_create_object(fw_data, &any,
 			pubkey, &pkcs15_pubkey_ops, sizeof(struct pkcs15_pubkey_object));
+	object = (struct pkcs15_pubkey_object *) any;
 	if (rv >= 0) {
 		object->pub_info = (struct sc_pkcs15_pubkey_info *) pubkey->data;
 		object->pub_data = p15_key;
+		object->pub_flags |= SC_PKCS11_OBJECT_CACHE_ATTRS;
 		if (p15_key && object->pub_info->modulus_length == 0 && p15_key->algorithm == SC_ALGORITHM_RSA)
 			object->pub_info->modulus_length = 8 * p15_key->u.rsa.modulus.len;
 	} else if (!(pubkey->emulated && (fw_data->p15_card->flags & SC_PKCS15_CARD_FLAG_EMULATED))) {
@@ -757,12 +766,16 @@ __pkcs15_create_prkey_object(struct pkcs15_fw_data *fw_data,
 	struct sc_pkcs15_object *prkey, struct pkcs15_any_object **prkey_object)
 {
 	struct pkcs15_prkey_object *object = NULL;
+	struct pkcs15_any_object *any = NULL;
 	int rv;
 
-	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
+	rv = __pkcs15_create_object(fw_data, &any,
 			prkey, &pkcs15_prkey_ops, sizeof(struct pkcs15_prkey_object));
-	if (rv >= 0)
+	object = (struct pkcs15_prkey_object *) any;
+	if (rv >= 0) {
 		object->prv_info = (struct sc_pkcs15_prkey_info *) prkey->data;
+		object->prv_flags |= SC_PKCS11_OBJECT_CACHE_ATTRS;
+	}
 
 	if (prkey_object != NULL)
 		*prkey_object = (struct pkcs15_any_object *) object;
@@ -776,10 +789,12 @@ __pkcs15_create_data_object(struct pkcs15_fw_data *fw_data,
 		struct sc_pkcs15_object *object, struct pkcs15_any_object **data_object)
 {
 	struct pkcs15_data_object *dobj = NULL;
+	struct pkcs15_any_object *any = NULL;
 	int rv;
 
-	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &dobj,
+	rv = __pkcs15_create_object(fw_data, &any,
 			object, &pkcs15_dobj_ops, sizeof(struct pkcs15_data_object));
+	dobj = (struct pkcs15_data_object *) any;
 	if (rv >= 0)   {
 	    dobj->info = (struct sc_pkcs15_data_info *) object->data;
 	    dobj->value = NULL;
@@ -798,10 +813,12 @@ __pkcs15_create_secret_key_object(struct pkcs15_fw_data *fw_data,
 		struct sc_pkcs15_object *object, struct pkcs15_any_object **skey_object)
 {
 	struct pkcs15_skey_object *skey = NULL;
+	struct pkcs15_any_object *any = NULL;
 	int rv;
 
-	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &skey,
+	rv = __pkcs15_create_object(fw_data, &any,
 			object, &pkcs15_skey_ops, sizeof(struct pkcs15_skey_object));
+	skey = (struct pkcs15_skey_object *) any;
 	if (rv >= 0)
 	    skey->info = (struct sc_pkcs15_skey_info *) object->data;
 
@@ -966,6 +983,8 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 
 	/* Find missing labels for certificate */
 	pkcs15_cert_extract_label(cert);
+	attr_cache_clear(&cert->base.base);
+	attr_cache_clear(&obj2->base.base);
 
 	/* now that we have the cert and pub key, lets see if we can bind anything else */
 	pkcs15_bind_related_objects(fw_data);
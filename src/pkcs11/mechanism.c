@@ -234,13 +234,10 @@ sc_pkcs11_md_final(struct sc_pkcs11_session *session,
 	LOG_FUNC_RETURN(context, rv);
 }
 
-/*
- * Initialize a signing context. When we get here, we know
- * the key object is capable of signing _something_
- */
-CK_RV
-sc_pkcs11_sign_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechanism,
-		    struct sc_pkcs11_object *key, CK_MECHANISM_TYPE key_type)
+static CK_RV
+sc_pkcs11_sign_start(struct sc_pkcs11_session *session, int type, CK_MECHANISM_PTR pMechanism,
+		    struct sc_pkcs11_object *key, CK_MECHANISM_TYPE key_type,
+		    sc_pkcs11_operation_t **op)
 {
 	struct sc_pkcs11_card *p11card;
 	sc_pkcs11_operation_t *operation;
@@ -262,18 +259,32 @@ sc_pkcs11_sign_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechani
 	if (mt->key_type != key_type)
 		LOG_FUNC_RETURN(context, CKR_KEY_TYPE_INCONSISTENT);
 
-	rv = session_start_operation(session, SC_PKCS11_OPERATION_SIGN, mt, &operation);
+	rv = session_start_operation(session, type, mt, &operation);
 	if (rv != CKR_OK)
 		LOG_FUNC_RETURN(context, rv);
 
 	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
 	rv = mt->sign_init(operation, key);
 	if (rv != CKR_OK)
-		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+		session_stop_operation(session, type);
+	else if (op)
+		*op = operation;
 
 	LOG_FUNC_RETURN(context, rv);
 }
 
+/*
+ * Initialize a signing context. When we get here, we know
+ * the key object is capable of signing _something_
+ */
+CK_RV
+sc_pkcs11_sign_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechanism,
+		    struct sc_pkcs11_object *key, CK_MECHANISM_TYPE key_type)
+{
+	return sc_pkcs11_sign_start(session, SC_PKCS11_OPERATION_SIGN,
+			pMechanism, key, key_type, NULL);
+}
+
 CK_RV
 sc_pkcs11_sign_update(struct sc_pkcs11_session *session,
 		      CK_BYTE_PTR pData, CK_ULONG ulDataLen)
@@ -518,6 +529,98 @@ sc_pkcs11_signature_release(sc_pkcs11_operation_t *operation)
 	free(data);
 }
 
+/*
+ * Message-based signing: the operation is set up once by
+ * sc_pkcs11_message_sign_init() and then signs any number of
+ * independent messages until sc_pkcs11_message_sign_final().
+ * Each message locks the card only while it is signed; a burst of
+ * signatures shares one reader transaction through the bounded
+ * transaction_linger of the pcsc driver, not through a lock held by
+ * the operation.
+ */
+CK_RV
+sc_pkcs11_message_sign_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechanism,
+		    struct sc_pkcs11_object *key, CK_MECHANISM_TYPE key_type)
+{
+	sc_pkcs11_operation_t *operation;
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	rv = sc_pkcs11_sign_start(session, SC_PKCS11_OPERATION_SIGN_MESSAGE,
+			pMechanism, key, key_type, &operation);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, rv);
+
+	if (operation->type->sign_init != sc_pkcs11_signature_init) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN_MESSAGE);
+		LOG_FUNC_RETURN(context, CKR_MECHANISM_INVALID);
+	}
+
+	LOG_FUNC_RETURN(context, CKR_OK);
+}
+
+CK_RV
+sc_pkcs11_sign_message_size(struct sc_pkcs11_session *session, CK_ULONG_PTR pLength)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN_MESSAGE, &op);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, rv);
+
+	rv = sc_pkcs11_signature_size(op, pLength);
+	LOG_FUNC_RETURN(context, rv);
+}
+
+CK_RV
+sc_pkcs11_sign_message(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data;
+	CK_RV rv, rv_md;
+
+	LOG_FUNC_CALLED(context);
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN_MESSAGE, &op);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, rv);
+
+	rv = sc_pkcs11_signature_update(op, pData, ulDataLen);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_signature_final(op, pSignature, pulSignatureLen);
+
+	/* Rewind the operation for the next message. An error in one
+	 * message does not terminate the operation. */
+	data = (struct signature_data *) op->priv_data;
+	data->buffer_len = 0;
+	if (data->md) {
+		data->md->type->release(data->md);
+		rv_md = data->md->type->md_init(data->md);
+		if (rv_md != CKR_OK) {
+			session_stop_operation(session, SC_PKCS11_OPERATION_SIGN_MESSAGE);
+			if (rv == CKR_OK)
+				rv = rv_md;
+		}
+	}
+
+	LOG_FUNC_RETURN(context, rv);
+}
+
+CK_RV
+sc_pkcs11_message_sign_final(struct sc_pkcs11_session *session)
+{
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN_MESSAGE, NULL);
+	if (rv == CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN_MESSAGE);
+
+	LOG_FUNC_RETURN(context, rv);
+}
+
 #ifdef ENABLE_OPENSSL
 /*
  * Initialize a verify context. When we get here, we know
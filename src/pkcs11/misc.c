@@ -22,6 +22,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "sc-pkcs11.h"
 
@@ -344,6 +345,207 @@ CK_RV attr_extract(CK_ATTRIBUTE_PTR pAttr, void *ptr, size_t * sizep)
 	return CKR_OK;
 }
 
+/*
+ * The attribute cache of an object is a single buffer holding one record per
+ * attribute: the type, the length and the value, padded to the alignment of
+ * the next record. Only attributes that are expensive to compute and cannot
+ * change are cached; the object opts in with SC_PKCS11_OBJECT_CACHE_ATTRS.
+ */
+struct attr_cache_record {
+	CK_ATTRIBUTE_TYPE type;
+	CK_ULONG len;
+};
+
+#define ATTR_CACHE_ALIGN(n) \
+	(((n) + sizeof(struct attr_cache_record) - 1) / sizeof(struct attr_cache_record) \
+	 * sizeof(struct attr_cache_record))
+
+int attr_cache_type(CK_ATTRIBUTE_TYPE type)
+{
+	switch (type) {
+	case CKA_VALUE:
+	case CKA_SUBJECT:
+	case CKA_ISSUER:
+	case CKA_SERIAL_NUMBER:
+	case CKA_MODULUS:
+	case CKA_PUBLIC_EXPONENT:
+	case CKA_EC_PARAMS:
+	case CKA_EC_POINT:
+		return 1;
+	}
+	return 0;
+}
+
+int attr_cache_find(struct sc_pkcs11_object *object, CK_ATTRIBUTE_TYPE type,
+		const void **value, CK_ULONG *len)
+{
+	const struct attr_cache_record *rec;
+	size_t offs = 0;
+
+	while (offs < object->attr_cache_len) {
+		rec = (const struct attr_cache_record *)(object->attr_cache + offs);
+		if (rec->type == type) {
+			*value = rec + 1;
+			*len = rec->len;
+			return 1;
+		}
+		offs += sizeof(*rec) + ATTR_CACHE_ALIGN(rec->len);
+	}
+	return 0;
+}
+
+CK_RV attr_cache_add(struct sc_pkcs11_object *object, CK_ATTRIBUTE_TYPE type,
+		const void *value, CK_ULONG len)
+{
+	struct attr_cache_record *rec;
+	size_t size = sizeof(*rec) + ATTR_CACHE_ALIGN(len);
+	u8 *p;
+
+	p = realloc(object->attr_cache, object->attr_cache_len + size);
+	if (p == NULL)
+		return CKR_HOST_MEMORY;
+	object->attr_cache = p;
+
+	rec = (struct attr_cache_record *)(p + object->attr_cache_len);
+	memset(rec, 0, size);
+	rec->type = type;
+	rec->len = len;
+	memcpy(rec + 1, value, len);
+	object->attr_cache_len += size;
+	return CKR_OK;
+}
+
+void attr_cache_clear(struct sc_pkcs11_object *object)
+{
+	free(object->attr_cache);
+	object->attr_cache = NULL;
+	object->attr_cache_len = 0;
+	free(object->fingerprint);
+	object->fingerprint = NULL;
+}
+
+/* Clears the caches of all objects of the slot, for example when the login
+ * state changes what the objects can read from the card */
+void attr_cache_clear_slot(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	for (i = 0; i < list_size(&slot->objects); i++)
+		attr_cache_clear((struct sc_pkcs11_object *)list_get_at(&slot->objects, i));
+}
+
+/*
+ * The fingerprint of an object holds the length and a 64-bit key of the
+ * attributes that search templates usually contain. The key of a value of up
+ * to 8 bytes (class, key type, booleans) is the value itself, longer values
+ * are hashed with FNV-1a. A template attribute whose length or key differs
+ * is rejected without fetching the value from the object.
+ */
+static const CK_ATTRIBUTE_TYPE fingerprint_types[] = {
+	CKA_CLASS, CKA_TOKEN, CKA_PRIVATE, CKA_LABEL, CKA_APPLICATION,
+	CKA_OBJECT_ID, CKA_CERTIFICATE_TYPE, CKA_ISSUER, CKA_SERIAL_NUMBER,
+	CKA_KEY_TYPE, CKA_SUBJECT, CKA_ID, CKA_SENSITIVE, CKA_ENCRYPT,
+	CKA_DECRYPT, CKA_WRAP, CKA_UNWRAP, CKA_SIGN, CKA_SIGN_RECOVER,
+	CKA_VERIFY, CKA_VERIFY_RECOVER, CKA_DERIVE, CKA_EXTRACTABLE,
+	CKA_LOCAL, CKA_NEVER_EXTRACTABLE, CKA_ALWAYS_SENSITIVE,
+	CKA_MODIFIABLE, CKA_ALWAYS_AUTHENTICATE
+};
+#define FINGERPRINT_SIZE	(sizeof(fingerprint_types) / sizeof(fingerprint_types[0]))
+
+struct sc_pkcs11_fingerprint {
+	uint32_t known;		/* bit i is set if entry i is valid */
+	CK_ULONG len[FINGERPRINT_SIZE];
+	uint64_t key[FINGERPRINT_SIZE];
+};
+
+static uint64_t fingerprint_key(const void *value, CK_ULONG len)
+{
+	const u8 *p = value;
+	uint64_t key = 0;
+	CK_ULONG i;
+
+	if (len <= sizeof(key)) {
+		memcpy(&key, value, len);
+		return key;
+	}
+	key = 0xcbf29ce484222325ULL;
+	for (i = 0; i < len; i++) {
+		key ^= p[i];
+		key *= 0x100000001b3ULL;
+	}
+	return key;
+}
+
+static int fingerprint_index(CK_ATTRIBUTE_TYPE type)
+{
+	unsigned int i;
+
+	for (i = 0; i < FINGERPRINT_SIZE; i++)
+		if (fingerprint_types[i] == type)
+			return (int)i;
+	return -1;
+}
+
+static int fingerprint_fill(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		int idx)
+{
+	struct sc_pkcs11_fingerprint *fp = object->fingerprint;
+	CK_ATTRIBUTE attr;
+	u8 buf[1024];
+	int r = -1;
+
+	attr.type = fingerprint_types[idx];
+	attr.pValue = NULL;
+	attr.ulValueLen = 0;
+	if (object->ops->get_attribute(session, object, &attr) != CKR_OK
+			|| attr.ulValueLen == (CK_ULONG)-1)
+		return -1;
+	/* As in the attribute cache, an empty certificate value means that the
+	 * certificate could not be read (yet): leave the entry unknown */
+	if (attr.ulValueLen == 0 && attr_cache_type(attr.type))
+		return -1;
+
+	attr.pValue = attr.ulValueLen <= sizeof(buf) ? buf : malloc(attr.ulValueLen);
+	if (attr.pValue == NULL)
+		return -1;
+	if (object->ops->get_attribute(session, object, &attr) == CKR_OK
+			&& (attr.ulValueLen != 0 || !attr_cache_type(attr.type))) {
+		fp->len[idx] = attr.ulValueLen;
+		fp->key[idx] = fingerprint_key(attr.pValue, attr.ulValueLen);
+		fp->known |= 1U << idx;
+		r = 0;
+	}
+	if (attr.pValue != buf)
+		free(attr.pValue);
+	return r;
+}
+
+/* Returns 0 if 'attr' does not match the object, 1 if it matches and -1 if
+ * the values need to be compared */
+int attr_fingerprint_match(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR attr)
+{
+	struct sc_pkcs11_fingerprint *fp;
+	int idx = fingerprint_index(attr->type);
+
+	if (idx < 0 || attr->pValue == NULL_PTR)
+		return -1;
+
+	if (object->fingerprint == NULL) {
+		object->fingerprint = calloc(1, sizeof(struct sc_pkcs11_fingerprint));
+		if (object->fingerprint == NULL)
+			return -1;
+	}
+	fp = object->fingerprint;
+	if (!(fp->known & (1U << idx)) && fingerprint_fill(session, object, idx) < 0)
+		return -1;
+
+	if (fp->len[idx] != attr->ulValueLen
+			|| fp->key[idx] != fingerprint_key(attr->pValue, attr->ulValueLen))
+		return 0;
+	return attr->ulValueLen <= sizeof(fp->key[idx]) ? 1 : -1;
+}
+
 CK_RV attr_find(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_ULONG type, void *ptr, size_t * sizep)
 {
 	unsigned int n;
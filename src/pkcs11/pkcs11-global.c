@@ -36,6 +36,9 @@
 
 #include "sc-pkcs11.h"
 #include "ui/notify.h"
+#ifdef USE_PKCS15_INIT
+#include "pkcs15init/pkcs15-init.h"
+#endif
 
 #ifndef MODULE_APP_NAME
 #define MODULE_APP_NAME "opensc-pkcs11"
@@ -50,6 +53,14 @@ pid_t initialized_pid = (pid_t)-1;
 #endif
 static int in_finalize = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
+extern CK_FUNCTION_LIST_3_0 pkcs11_function_list_3_0;
+
+/* The v3.0 function list comes first, so that it is the default interface */
+static CK_INTERFACE pkcs11_interfaces[] = {
+	{ "PKCS 11", &pkcs11_function_list_3_0, 0 },
+	{ "PKCS 11", &pkcs11_function_list, 0 }
+};
+#define NUM_INTERFACES (sizeof(pkcs11_interfaces) / sizeof(pkcs11_interfaces[0]))
 
 #ifdef PKCS11_THREAD_LOCKING
 
@@ -335,6 +346,10 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	sc_release_context(context);
 	context = NULL;
 
+#ifdef USE_PKCS15_INIT
+	sc_pkcs15init_free_profile_cache();
+#endif
+
 	/* Release and destroy the mutex */
 	sc_pkcs11_free_lock();
 
@@ -379,6 +394,57 @@ CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 	return CKR_OK;
 }
 
+CK_RV C_GetInterfaceList(CK_INTERFACE_PTR pInterfacesList, /* receives the interfaces */
+			 CK_ULONG_PTR     pulCount)        /* receives the number of interfaces */
+{
+	CK_ULONG i;
+
+	if (pulCount == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	if (pInterfacesList == NULL_PTR) {
+		*pulCount = NUM_INTERFACES;
+		return CKR_OK;
+	}
+	if (*pulCount < NUM_INTERFACES) {
+		*pulCount = NUM_INTERFACES;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	for (i = 0; i < NUM_INTERFACES; i++)
+		pInterfacesList[i] = pkcs11_interfaces[i];
+	*pulCount = NUM_INTERFACES;
+	return CKR_OK;
+}
+
+CK_RV C_GetInterface(CK_UTF8CHAR_PTR      pInterfaceName, /* NULL for the default interface */
+		     CK_VERSION_PTR       pVersion,       /* NULL for any version */
+		     CK_INTERFACE_PTR_PTR ppInterface,    /* receives the interface */
+		     CK_FLAGS             flags)          /* flags the interface must support */
+{
+	CK_ULONG i;
+
+	if (ppInterface == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	for (i = 0; i < NUM_INTERFACES; i++) {
+		/* every function list starts with its version */
+		CK_VERSION *version = (CK_VERSION *)pkcs11_interfaces[i].pFunctionList;
+
+		if (pInterfaceName != NULL_PTR
+				&& strcmp((char *)pInterfaceName, pkcs11_interfaces[i].pInterfaceName) != 0)
+			continue;
+		if (pVersion != NULL_PTR
+				&& (pVersion->major != version->major || pVersion->minor != version->minor))
+			continue;
+		if ((pkcs11_interfaces[i].flags & flags) != flags)
+			continue;
+		*ppInterface = &pkcs11_interfaces[i];
+		return CKR_OK;
+	}
+	return CKR_FUNCTION_FAILED;
+}
+
 CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token present */
 		    CK_SLOT_ID_PTR pSlotList,     /* receives the array of slot IDs */
 		    CK_ULONG_PTR   pulCount)      /* receives the number of slots */
@@ -899,3 +965,99 @@ CK_FUNCTION_LIST pkcs11_function_list = {
 	C_CancelFunction,
 	C_WaitForSlotEvent
 };
+
+CK_FUNCTION_LIST_3_0 pkcs11_function_list_3_0 = {
+	{ 3, 0 },
+	C_Initialize,
+	C_Finalize,
+	C_GetInfo,
+	C_GetFunctionList,
+	C_GetSlotList,
+	C_GetSlotInfo,
+	C_GetTokenInfo,
+	C_GetMechanismList,
+	C_GetMechanismInfo,
+	C_InitToken,
+	C_InitPIN,
+	C_SetPIN,
+	C_OpenSession,
+	C_CloseSession,
+	C_CloseAllSessions,
+	C_GetSessionInfo,
+	C_GetOperationState,
+	C_SetOperationState,
+	C_Login,
+	C_Logout,
+	C_CreateObject,
+	C_CopyObject,
+	C_DestroyObject,
+	C_GetObjectSize,
+	C_GetAttributeValue,
+	C_SetAttributeValue,
+	C_FindObjectsInit,
+	C_FindObjects,
+	C_FindObjectsFinal,
+	C_EncryptInit,
+	C_Encrypt,
+	C_EncryptUpdate,
+	C_EncryptFinal,
+	C_DecryptInit,
+	C_Decrypt,
+	C_DecryptUpdate,
+	C_DecryptFinal,
+	C_DigestInit,
+	C_Digest,
+	C_DigestUpdate,
+	C_DigestKey,
+	C_DigestFinal,
+	C_SignInit,
+	C_Sign,
+	C_SignUpdate,
+	C_SignFinal,
+	C_SignRecoverInit,
+	C_SignRecover,
+	C_VerifyInit,
+	C_Verify,
+	C_VerifyUpdate,
+	C_VerifyFinal,
+	C_VerifyRecoverInit,
+	C_VerifyRecover,
+	C_DigestEncryptUpdate,
+	C_DecryptDigestUpdate,
+	C_SignEncryptUpdate,
+	C_DecryptVerifyUpdate,
+	C_GenerateKey,
+	C_GenerateKeyPair,
+	C_WrapKey,
+	C_UnwrapKey,
+	C_DeriveKey,
+	C_SeedRandom,
+	C_GenerateRandom,
+	C_GetFunctionStatus,
+	C_CancelFunction,
+	C_WaitForSlotEvent,
+	C_GetInterfaceList,
+	C_GetInterface,
+	C_LoginUser,
+	C_SessionCancel,
+	C_MessageEncryptInit,
+	C_EncryptMessage,
+	C_EncryptMessageBegin,
+	C_EncryptMessageNext,
+	C_MessageEncryptFinal,
+	C_MessageDecryptInit,
+	C_DecryptMessage,
+	C_DecryptMessageBegin,
+	C_DecryptMessageNext,
+	C_MessageDecryptFinal,
+	C_MessageSignInit,
+	C_SignMessage,
+	C_SignMessageBegin,
+	C_SignMessageNext,
+	C_MessageSignFinal,
+	C_MessageVerifyInit,
+	C_VerifyMessage,
+	C_VerifyMessageBegin,
+	C_VerifyMessageNext,
+	C_MessageVerifyFinal
+};
@@ -193,6 +193,55 @@ C_GetObjectSize(CK_SESSION_HANDLE hSession,	/* the session's handle */
 }
 
 
+/* Returns the attribute from the cache of the object, if it may be cached */
+static CK_RV
+get_attribute(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR attr)
+{
+	CK_ATTRIBUTE value;
+	const void *cached;
+	CK_ULONG len;
+	CK_RV rv;
+
+	if (!(object->flags & SC_PKCS11_OBJECT_CACHE_ATTRS) || !attr_cache_type(attr->type))
+		return object->ops->get_attribute(session, object, attr);
+
+	if (attr_cache_find(object, attr->type, &cached, &len)) {
+		if (attr->pValue == NULL_PTR) {
+			attr->ulValueLen = len;
+			return CKR_OK;
+		}
+		if (attr->ulValueLen < len) {
+			attr->ulValueLen = len;
+			return CKR_BUFFER_TOO_SMALL;
+		}
+		memcpy(attr->pValue, cached, len);
+		attr->ulValueLen = len;
+		return CKR_OK;
+	}
+
+	rv = object->ops->get_attribute(session, object, attr);
+	/* An empty value means that the object could not be read (yet), for
+	 * example a private certificate before login: do not cache it */
+	if (rv != CKR_OK || attr->ulValueLen == 0 || attr->ulValueLen == (CK_ULONG)-1)
+		return rv;
+	if (attr->pValue != NULL_PTR) {
+		attr_cache_add(object, attr->type, attr->pValue, attr->ulValueLen);
+		return rv;
+	}
+
+	/* A size query is followed by the query of the value: compute it now */
+	value.type = attr->type;
+	value.ulValueLen = attr->ulValueLen;
+	value.pValue = malloc(value.ulValueLen);
+	if (value.pValue != NULL
+			&& object->ops->get_attribute(session, object, &value) == CKR_OK
+			&& value.ulValueLen != 0)
+		attr_cache_add(object, value.type, value.pValue, value.ulValueLen);
+	free(value.pValue);
+	return rv;
+}
+
 CK_RV
 C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_OBJECT_HANDLE hObject,	/* the object's handle */
@@ -230,7 +279,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	res_type = 0;
 	for (i = 0; i < ulCount; i++) {
-		res = object->ops->get_attribute(session, object, &pTemplate[i]);
+		res = get_attribute(session, object, &pTemplate[i]);
 		if (res != CKR_OK)
 			pTemplate[i].ulValueLen = (CK_ULONG) - 1;
 
@@ -299,6 +348,8 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		/* related objects may share the changed PKCS#15 object */
+		attr_cache_clear_slot(session->slot);
 	}
 
 out:
@@ -604,15 +655,44 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 }
 
 
+/* Look up a key usable for signing and its key type */
+static CK_RV
+get_sign_key(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey,
+		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object,
+		CK_KEY_TYPE *key_type)
+{
+	CK_BBOOL can_sign;
+	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, key_type, sizeof(*key_type) };
+	CK_RV rv;
+
+	rv = get_object_from_session(hSession, hKey, session, object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		return rv;
+	}
+
+	if ((*object)->ops->sign == NULL_PTR)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = (*object)->ops->get_attribute(*session, *object, &sign_attribute);
+	if (rv != CKR_OK || !can_sign)
+		return CKR_KEY_TYPE_INCONSISTENT;
+	rv = (*object)->ops->get_attribute(*session, *object, &key_type_attr);
+	if (rv != CKR_OK)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	return CKR_OK;
+}
+
+
 CK_RV
 C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of the signature key */
 {
-	CK_BBOOL can_sign;
 	CK_KEY_TYPE key_type;
-	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
-	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
@@ -624,32 +704,10 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
-	if (rv != CKR_OK) {
-		if (rv == CKR_OBJECT_HANDLE_INVALID)
-			rv = CKR_KEY_HANDLE_INVALID;
-		goto out;
-	}
-
-	if (object->ops->sign == NULL_PTR) {
-		rv = CKR_KEY_TYPE_INCONSISTENT;
-		goto out;
-	}
-
-	rv = object->ops->get_attribute(session, object, &sign_attribute);
-	if (rv != CKR_OK || !can_sign) {
-		rv = CKR_KEY_TYPE_INCONSISTENT;
-		goto out;
-	}
-	rv = object->ops->get_attribute(session, object, &key_type_attr);
-	if (rv != CKR_OK) {
-		rv = CKR_KEY_TYPE_INCONSISTENT;
-		goto out;
-	}
-
-	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
+	rv = get_sign_key(hSession, hKey, &session, &object, &key_type);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
-out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
 	sc_pkcs11_unlock();
 	return rv;
@@ -768,6 +826,121 @@ out:
 }
 
 
+CK_RV
+C_MessageSignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
+		CK_OBJECT_HANDLE hKey)		/* handle of the signature key */
+{
+	CK_KEY_TYPE key_type;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_sign_key(hSession, hKey, &session, &object, &key_type);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_message_sign_init(session, pMechanism, object, key_type);
+
+	sc_log(context, "C_MessageSignInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+
+CK_RV
+C_SignMessage(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen,	/* length of the parameter */
+		CK_BYTE_PTR pData,		/* the data (digest) to be signed */
+		CK_ULONG ulDataLen,		/* count of bytes to be signed */
+		CK_BYTE_PTR pSignature,		/* receives the signature */
+		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
+{
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	CK_ULONG length;
+
+	/* None of the supported mechanisms takes per-message parameters */
+	if (pParameter != NULL_PTR || ulParameterLen != 0)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	if ((rv = sc_pkcs11_sign_message_size(session, &length)) != CKR_OK)
+		goto out;
+
+	if (pSignature == NULL || length > *pulSignatureLen) {
+		*pulSignatureLen = length;
+		rv = pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+		goto out;
+	}
+
+	rv = restore_login_state(session->slot);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_sign_message(session, pData, ulDataLen, pSignature, pulSignatureLen);
+	rv = reset_login_state(session->slot, rv);
+
+out:
+	sc_log(context, "C_SignMessage() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+
+CK_RV
+C_MessageSignFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
+{
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_message_sign_final(session);
+
+	sc_log(context, "C_MessageSignFinal() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+
+CK_RV
+C_SignMessageBegin(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen)	/* length of the parameter */
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+CK_RV
+C_SignMessageNext(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_VOID_PTR pParameter,		/* message specific parameter */
+		CK_ULONG ulParameterLen,	/* length of the parameter */
+		CK_BYTE_PTR pDataPart,		/* the data part to be signed */
+		CK_ULONG ulDataPartLen,		/* count of bytes to be signed */
+		CK_BYTE_PTR pSignature,		/* receives the signature */
+		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
 CK_RV
 C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
@@ -1165,6 +1338,109 @@ CK_RV C_CancelFunction(CK_SESSION_HANDLE hSession)
 	return CKR_FUNCTION_NOT_PARALLEL;
 }
 
+/* Message-based encryption, decryption and verification are not supported */
+CK_RV C_MessageEncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+			   CK_OBJECT_HANDLE hKey)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptMessage(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+		       CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData,
+		       CK_ULONG ulAssociatedDataLen, CK_BYTE_PTR pPlaintext,
+		       CK_ULONG ulPlaintextLen, CK_BYTE_PTR pCiphertext,
+		       CK_ULONG_PTR pulCiphertextLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptMessageBegin(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+			    CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData,
+			    CK_ULONG ulAssociatedDataLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_EncryptMessageNext(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+			   CK_ULONG ulParameterLen, CK_BYTE_PTR pPlaintextPart,
+			   CK_ULONG ulPlaintextPartLen, CK_BYTE_PTR pCiphertextPart,
+			   CK_ULONG_PTR pulCiphertextPartLen, CK_FLAGS flags)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageEncryptFinal(CK_SESSION_HANDLE hSession)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageDecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+			   CK_OBJECT_HANDLE hKey)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptMessage(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+		       CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData,
+		       CK_ULONG ulAssociatedDataLen, CK_BYTE_PTR pCiphertext,
+		       CK_ULONG ulCiphertextLen, CK_BYTE_PTR pPlaintext,
+		       CK_ULONG_PTR pulPlaintextLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptMessageBegin(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+			    CK_ULONG ulParameterLen, CK_BYTE_PTR pAssociatedData,
+			    CK_ULONG ulAssociatedDataLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptMessageNext(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+			   CK_ULONG ulParameterLen, CK_BYTE_PTR pCiphertextPart,
+			   CK_ULONG ulCiphertextPartLen, CK_BYTE_PTR pPlaintextPart,
+			   CK_ULONG_PTR pulPlaintextPartLen, CK_FLAGS flags)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageDecryptFinal(CK_SESSION_HANDLE hSession)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageVerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+			  CK_OBJECT_HANDLE hKey)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyMessage(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+		      CK_ULONG ulParameterLen, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		      CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyMessageBegin(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+			   CK_ULONG ulParameterLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyMessageNext(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter,
+			  CK_ULONG ulParameterLen, CK_BYTE_PTR pDataPart,
+			  CK_ULONG ulDataPartLen, CK_BYTE_PTR pSignature,
+			  CK_ULONG ulSignatureLen)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_MessageVerifyFinal(CK_SESSION_HANDLE hSession)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
 CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		   CK_MECHANISM_PTR pMechanism,	/* the verification mechanism */
 		   CK_OBJECT_HANDLE hKey)
@@ -1323,12 +1599,16 @@ int sc_pkcs11_any_cmp_attribute(struct sc_pkcs11_session *session, void *ptr, CK
 	int res;
 
 	object = (struct sc_pkcs11_object *)ptr;
+	res = attr_fingerprint_match(session, object, attr);
+	if (res >= 0)
+		return res;
+
 	temp_attr.type = attr->type;
 	temp_attr.pValue = NULL;
 	temp_attr.ulValueLen = 0;
 
 	/* Get the length of the attribute */
-	rv = object->ops->get_attribute(session, object, &temp_attr);
+	rv = get_attribute(session, object, &temp_attr);
 	if (rv != CKR_OK || temp_attr.ulValueLen != attr->ulValueLen)
 		return 0;
 
@@ -1342,7 +1622,7 @@ int sc_pkcs11_any_cmp_attribute(struct sc_pkcs11_session *session, void *ptr, CK
 	}
 
 	/* Get the attribute */
-	rv = object->ops->get_attribute(session, object, &temp_attr);
+	rv = get_attribute(session, object, &temp_attr);
 	if (rv != CKR_OK) {
 		res = 0;
 		goto done;
@@ -105,6 +105,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_session *session;
+	int i;
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
@@ -112,6 +113,10 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 	if (!session)
 		return CKR_SESSION_HANDLE_INVALID;
 
+	/* Release pending operations, some of them keep the card locked */
+	for (i = 0; i < SC_PKCS11_OPERATION_MAX; i++)
+		session_stop_operation(session, i);
+
 	/* If we're the last session using this slot, make sure
 	 * we log out */
 	slot = session->slot;
@@ -314,6 +319,8 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = push_login_state(slot, userType, pPin, ulPinLen);
 		if (rv == CKR_OK) {
 			slot->login_user = userType;
+			/* values that could not be read before login may be readable now */
+			attr_cache_clear_slot(slot);
 		}
 		rv = reset_login_state(slot, rv);
 	}
@@ -345,6 +352,7 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 
 	if (slot->login_user >= 0) {
 		slot->login_user = -1;
+		attr_cache_clear_slot(slot);
 		if (sc_pkcs11_conf.atomic)
 			pop_all_login_states(slot);
 		else
@@ -438,3 +446,19 @@ out:
 	sc_pkcs11_unlock();
 	return rv;
 }
+
+CK_RV C_LoginUser(CK_SESSION_HANDLE hSession, /* the session's handle */
+		  CK_USER_TYPE userType,      /* the user type */
+		  CK_UTF8CHAR_PTR pPin,       /* the user's PIN */
+		  CK_ULONG ulPinLen,          /* the length of the PIN */
+		  CK_UTF8CHAR_PTR pUsername,  /* the user's name */
+		  CK_ULONG ulUsernameLen)     /* the length of the user's name */
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SessionCancel(CK_SESSION_HANDLE hSession, /* the session's handle */
+		      CK_FLAGS flags)             /* operations to cancel */
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
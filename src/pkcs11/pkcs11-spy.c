@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -33,6 +34,7 @@
 
 #define CRYPTOKI_EXPORTS
 #include "pkcs11-display.h"
+#include "common/libscdl.h"
 
 #define __PASTE(x,y)      x##y
 
@@ -47,6 +49,10 @@ static CK_FUNCTION_LIST_PTR pkcs11_spy = NULL;
 static CK_FUNCTION_LIST_PTR po = NULL;
 /* Dynamic Module Handle */
 static void *modhandle = NULL;
+/* PKCS#11 v3.0 message signing functions of the real module, if present */
+static CK_C_MessageSignInit po_MessageSignInit = NULL;
+static CK_C_SignMessage po_SignMessage = NULL;
+static CK_C_MessageSignFinal po_MessageSignFinal = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
 
@@ -223,7 +229,14 @@ init_spy(void)
 
 	modhandle = C_LoadModule(module, &po);
 	if (modhandle && po) {
+		void *handle = sc_dlopen(module);
+
 		fprintf(spy_output, "Loaded: \"%s\"\n", module);
+		if (handle) {
+			po_MessageSignInit = (CK_C_MessageSignInit) sc_dlsym(handle, "C_MessageSignInit");
+			po_SignMessage = (CK_C_SignMessage) sc_dlsym(handle, "C_SignMessage");
+			po_MessageSignFinal = (CK_C_MessageSignFinal) sc_dlsym(handle, "C_MessageSignFinal");
+		}
 	}
 	else {
 		po = NULL;
@@ -352,6 +365,64 @@ CK_RV C_GetFunctionList
 	return retne(CKR_OK);
 }
 
+/* The spy offers its v2.11 function list as the only interface */
+CK_RV C_GetInterfaceList
+(CK_INTERFACE_PTR pInterfacesList, CK_ULONG_PTR pulCount)
+{
+	CK_RV rv;
+
+	if (po == NULL) {
+		rv = init_spy();
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	enter("C_GetInterfaceList");
+	if (pulCount == NULL_PTR)
+		return retne(CKR_ARGUMENTS_BAD);
+	if (pInterfacesList == NULL_PTR) {
+		*pulCount = 1;
+		return retne(CKR_OK);
+	}
+	if (*pulCount < 1) {
+		*pulCount = 1;
+		return retne(CKR_BUFFER_TOO_SMALL);
+	}
+	pInterfacesList[0].pInterfaceName = "PKCS 11";
+	pInterfacesList[0].pFunctionList = pkcs11_spy;
+	pInterfacesList[0].flags = 0;
+	*pulCount = 1;
+	return retne(CKR_OK);
+}
+
+CK_RV C_GetInterface
+(CK_UTF8CHAR_PTR pInterfaceName, CK_VERSION_PTR pVersion,
+ CK_INTERFACE_PTR_PTR ppInterface, CK_FLAGS flags)
+{
+	static CK_INTERFACE spy_interface = { "PKCS 11", NULL, 0 };
+	CK_RV rv;
+
+	if (po == NULL) {
+		rv = init_spy();
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	enter("C_GetInterface");
+	if (ppInterface == NULL_PTR)
+		return retne(CKR_ARGUMENTS_BAD);
+	if ((pInterfaceName != NULL_PTR
+				&& strcmp((char *)pInterfaceName, spy_interface.pInterfaceName) != 0)
+			|| (pVersion != NULL_PTR
+				&& (pVersion->major != pkcs11_spy->version.major
+					|| pVersion->minor != pkcs11_spy->version.minor))
+			|| flags != 0)
+		return retne(CKR_FUNCTION_FAILED);
+	spy_interface.pFunctionList = pkcs11_spy;
+	*ppInterface = &spy_interface;
+	return retne(CKR_OK);
+}
+
 CK_RV
 C_Initialize(CK_VOID_PTR pInitArgs)
 {
@@ -1387,3 +1458,52 @@ C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pRserved)
 	rv = po->C_WaitForSlotEvent(flags, pSlot, pRserved);
 	return retne(rv);
 }
+
+CK_RV
+C_MessageSignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	CK_RV rv;
+
+	enter("C_MessageSignInit");
+	spy_dump_ulong_in("hSession", hSession);
+	fprintf(spy_output, "pMechanism->type=%s\n",
+			lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_ulong_in("hKey", hKey);
+	if (po_MessageSignInit == NULL)
+		return retne(CKR_FUNCTION_NOT_SUPPORTED);
+	rv = po_MessageSignInit(hSession, pMechanism, hKey);
+	return retne(rv);
+}
+
+CK_RV
+C_SignMessage(CK_SESSION_HANDLE hSession, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	CK_RV rv;
+
+	enter("C_SignMessage");
+	spy_dump_ulong_in("hSession", hSession);
+	spy_dump_string_in("pParameter[ulParameterLen]", pParameter, ulParameterLen);
+	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
+	if (po_SignMessage == NULL)
+		return retne(CKR_FUNCTION_NOT_SUPPORTED);
+	rv = po_SignMessage(hSession, pParameter, ulParameterLen, pData, ulDataLen,
+			pSignature, pulSignatureLen);
+	if (rv == CKR_OK)
+		spy_dump_string_out("pSignature[*pulSignatureLen]", pSignature, *pulSignatureLen);
+	return retne(rv);
+}
+
+CK_RV
+C_MessageSignFinal(CK_SESSION_HANDLE hSession)
+{
+	CK_RV rv;
+
+	enter("C_MessageSignFinal");
+	spy_dump_ulong_in("hSession", hSession);
+	if (po_MessageSignFinal == NULL)
+		return retne(CKR_FUNCTION_NOT_SUPPORTED);
+	rv = po_MessageSignFinal(hSession);
+	return retne(rv);
+}
@@ -128,10 +128,18 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+
+	/* Values of immutable attributes returned before (misc.c) */
+	u8 *attr_cache;
+	size_t attr_cache_len;
+	/* Lengths and hashes of attributes used in search templates (misc.c) */
+	struct sc_pkcs11_fingerprint *fingerprint;
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
+/* The public attributes do not change while the object exists */
+#define SC_PKCS11_OBJECT_CACHE_ATTRS	0x0004
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
 
@@ -236,6 +244,7 @@ enum {
 	SC_PKCS11_OPERATION_DIGEST,
 	SC_PKCS11_OPERATION_DECRYPT,
 	SC_PKCS11_OPERATION_DERIVE,
+	SC_PKCS11_OPERATION_SIGN_MESSAGE,
 	SC_PKCS11_OPERATION_MAX
 };
 
@@ -391,6 +400,14 @@ CK_RV attr_find_and_allocate_ptr(CK_ATTRIBUTE_PTR, CK_ULONG, CK_ULONG, void **,
 CK_RV attr_find_var(CK_ATTRIBUTE_PTR, CK_ULONG, CK_ULONG, void *, size_t *);
 CK_RV attr_extract(CK_ATTRIBUTE_PTR, void *, size_t *);
 
+/* Cache of attribute values of an object (misc.c) */
+int attr_cache_type(CK_ATTRIBUTE_TYPE);
+int attr_cache_find(struct sc_pkcs11_object *, CK_ATTRIBUTE_TYPE, const void **, CK_ULONG *);
+CK_RV attr_cache_add(struct sc_pkcs11_object *, CK_ATTRIBUTE_TYPE, const void *, CK_ULONG);
+void attr_cache_clear(struct sc_pkcs11_object *);
+void attr_cache_clear_slot(struct sc_pkcs11_slot *);
+int attr_fingerprint_match(struct sc_pkcs11_session *, struct sc_pkcs11_object *, CK_ATTRIBUTE_PTR);
+
 /* Generic Mechanism functions */
 CK_RV sc_pkcs11_register_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
@@ -406,6 +423,12 @@ CK_RV sc_pkcs11_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 CK_RV sc_pkcs11_sign_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_sign_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_size(struct sc_pkcs11_session *, CK_ULONG_PTR);
+CK_RV sc_pkcs11_message_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
+				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_sign_message(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+				CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_sign_message_size(struct sc_pkcs11_session *, CK_ULONG_PTR);
+CK_RV sc_pkcs11_message_sign_final(struct sc_pkcs11_session *);
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
@@ -298,9 +298,15 @@ extern void		sc_pkcs15init_free_object(struct sc_pkcs15_object *);
 extern void	sc_pkcs15init_set_callbacks(struct sc_pkcs15init_callbacks *);
 extern int	sc_pkcs15init_bind(struct sc_card *, const char *, const char *,
 				struct sc_app_info *app_info, struct sc_profile **);
+extern int	sc_pkcs15init_bind_copy(struct sc_card *, const char *, const char *,
+				const struct sc_profile *, struct sc_profile **);
 extern void	sc_pkcs15init_unbind(struct sc_profile *);
+extern void	sc_pkcs15init_free_profile_cache(void);
 extern void	sc_pkcs15init_set_p15card(struct sc_profile *,
 				struct sc_pkcs15_card *);
+extern int	sc_pkcs15init_begin_batch(struct sc_profile *);
+extern int	sc_pkcs15init_end_batch(struct sc_pkcs15_card *,
+				struct sc_profile *);
 extern int	sc_pkcs15init_set_lifecycle(struct sc_card *, int);
 extern int	sc_pkcs15init_erase_card(struct sc_pkcs15_card *,
 				struct sc_profile *, struct sc_aid *);
@@ -297,17 +297,17 @@ load_dynamic_driver(struct sc_context *ctx, void **dll,
 
 
 /*
- * Set up profile
+ * Create the profile of a card, with the card operations and the
+ * profile name and options, before any profile file is read
  */
-int
-sc_pkcs15init_bind(struct sc_card *card, const char *name, const char *profile_option,
-		struct sc_app_info *app_info, struct sc_profile **result)
+static int
+sc_pkcs15init_new_profile(struct sc_card *card, const char *name,
+		struct sc_profile **result)
 {
 	struct sc_context *ctx = card->ctx;
 	struct sc_profile *profile;
 	struct sc_pkcs15init_operations * (* func)(void) = NULL;
 	const char	*driver = card->driver->short_name;
-	char		card_profile[PATH_MAX];
 	int		r, i;
 
 	LOG_FUNC_CALLED(ctx);
@@ -356,15 +356,33 @@ sc_pkcs15init_bind(struct sc_card *card, const char *name, const char *profile_o
 
 	r = sc_pkcs15init_read_info(card, profile);
 	if (r < 0) {
+		if (profile->dll)
+			sc_dlclose(profile->dll);
 		sc_profile_free(profile);
 		LOG_TEST_RET(ctx, r, "Read info error");
 	}
 
+	*result = profile;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * Read the profile files into the profile
+ */
+static int
+sc_pkcs15init_load_profile(struct sc_card *card, struct sc_profile *profile,
+		const char *profile_option, struct sc_app_info *app_info)
+{
+	struct sc_context *ctx = card->ctx;
+	char		card_profile[PATH_MAX];
+	int		r;
+
 	/* Check the config file for a profile name.
 	 * If none is defined, use the default profile name.
 	 */
 	if (!get_profile_from_config(card, card_profile, sizeof(card_profile)))
-		strlcpy(card_profile, driver, sizeof card_profile);
+		strlcpy(card_profile, card->driver->short_name, sizeof card_profile);
 	if (profile_option != NULL)
 		strlcpy(card_profile, profile_option, sizeof(card_profile));
 
@@ -386,7 +404,29 @@ sc_pkcs15init_bind(struct sc_card *card, const char *name, const char *profile_o
 			sc_log(ctx, "Failed to finalize profile: %s", sc_strerror(r));
 	}  while (0);
 
+	return r;
+}
+
+
+/*
+ * Set up profile
+ */
+int
+sc_pkcs15init_bind(struct sc_card *card, const char *name, const char *profile_option,
+		struct sc_app_info *app_info, struct sc_profile **result)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_profile *profile;
+	int		r;
+
+	LOG_FUNC_CALLED(ctx);
+	r = sc_pkcs15init_new_profile(card, name, &profile);
+	LOG_TEST_RET(ctx, r, "Cannot create profile");
+
+	r = sc_pkcs15init_load_profile(card, profile, profile_option, app_info);
 	if (r < 0)   {
+		if (profile->dll)
+			sc_dlclose(profile->dll);
 		sc_profile_free(profile);
 		LOG_TEST_RET(ctx, r, "Load profile error");
 	}
@@ -421,6 +461,68 @@ sc_pkcs15init_bind(struct sc_card *card, const char *name, const char *profile_o
 }
 
 
+
+/*
+ * Set up the profile of a card from a copy of the profile bound to
+ * another card with the same driver, name and options, without
+ * reading the profile files again. The profile is loaded as usual
+ * when the card needs a different one or there is no template.
+ * The template must have been bound without an application.
+ */
+int
+sc_pkcs15init_bind_copy(struct sc_card *card, const char *name, const char *profile_option,
+		const struct sc_profile *template, struct sc_profile **result)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_profile *profile, *copy;
+	int		r, i;
+
+	LOG_FUNC_CALLED(ctx);
+	r = sc_pkcs15init_new_profile(card, name, &profile);
+	LOG_TEST_RET(ctx, r, "Cannot create profile");
+
+	if (template != NULL && template->card->driver != card->driver)
+		template = NULL;
+	if (template != NULL && strcmp(template->name, profile->name))
+		template = NULL;
+	for (i = 0; template != NULL && i < SC_PKCS15INIT_MAX_OPTIONS; i++) {
+		if (!template->options[i] && !profile->options[i])
+			break;
+		if (!template->options[i] || !profile->options[i]
+				|| strcmp(template->options[i], profile->options[i]))
+			template = NULL;
+	}
+
+	if (template == NULL) {
+		sc_log(ctx, "No matching profile to copy, loading profile '%s'", profile->name);
+		r = sc_pkcs15init_load_profile(card, profile, profile_option, NULL);
+		if (r < 0)   {
+			if (profile->dll)
+				sc_dlclose(profile->dll);
+			sc_profile_free(profile);
+			LOG_TEST_RET(ctx, r, "Load profile error");
+		}
+		*result = profile;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	copy = sc_profile_dup(template);
+	if (copy == NULL) {
+		if (profile->dll)
+			sc_dlclose(profile->dll);
+		sc_profile_free(profile);
+		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "Cannot copy profile");
+	}
+	copy->card = card;
+	copy->ops = profile->ops;
+	copy->dll = profile->dll;
+	profile->dll = NULL;
+	sc_profile_free(profile);
+
+	*result = copy;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 void
 sc_pkcs15init_unbind(struct sc_profile *profile)
 {
@@ -440,6 +542,68 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 }
 
 
+/*
+ * Start a batch of operations (key generation, certificate storage, ...).
+ * Until sc_pkcs15init_end_batch() is called, the card stays locked and
+ * the xDF, ODF and TokenInfo files are not written: each of them is
+ * written once at the end of the batch, whatever the number of objects added.
+ */
+int
+sc_pkcs15init_begin_batch(struct sc_profile *profile)
+{
+	struct sc_context *ctx = profile->card->ctx;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.state != SC_PKCS15INIT_BATCH_NONE)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "Batch already started");
+
+	r = sc_lock(profile->card);
+	LOG_TEST_RET(ctx, r, "Cannot lock card");
+
+	memset(&profile->batch, 0, sizeof(profile->batch));
+	profile->batch.state = SC_PKCS15INIT_BATCH_COLLECT;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * Write the directory files changed since sc_pkcs15init_begin_batch().
+ * Has to be called even if an operation of the batch failed,
+ * to store the objects successfully created.
+ */
+int
+sc_pkcs15init_end_batch(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = profile->card->ctx;
+	unsigned int n;
+	int r = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.state != SC_PKCS15INIT_BATCH_COLLECT)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "No batch started");
+
+	sc_log(ctx, "Batch: %u DF(s) to update, ODF %i, TokenInfo %i", profile->batch.df_count,
+			profile->batch.update_odf, profile->batch.update_tokeninfo);
+
+	/* the ODF and TokenInfo updates are still collected while writing the xDFs */
+	profile->batch.state = SC_PKCS15INIT_BATCH_FLUSH;
+	for (n = 0; n < profile->batch.df_count && r >= 0; n++)
+		r = sc_pkcs15init_update_any_df(p15card, profile,
+				profile->batch.df[n], profile->batch.df_is_new[n]);
+	profile->batch.state = SC_PKCS15INIT_BATCH_NONE;
+
+	if (r >= 0 && profile->batch.update_odf)
+		r = sc_pkcs15init_update_odf(p15card, profile);
+	if (r >= 0 && profile->batch.update_tokeninfo)
+		r = sc_pkcs15init_update_tokeninfo(p15card, profile);
+
+	memset(&profile->batch, 0, sizeof(profile->batch));
+	sc_unlock(profile->card);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 void
 sc_pkcs15init_set_p15card(struct sc_profile *profile, struct sc_pkcs15_card *p15card)
 {
@@ -2982,6 +3146,11 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile
 
 	LOG_FUNC_CALLED(ctx);
 
+	if (profile->batch.state != SC_PKCS15INIT_BATCH_NONE) {
+		profile->batch.update_tokeninfo = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	/* set lastUpdate field */
 	if (p15card->tokeninfo->last_update.gtime != NULL)   {
 		free(p15card->tokeninfo->last_update.gtime);
@@ -3065,6 +3234,11 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	int		r;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.state != SC_PKCS15INIT_BATCH_NONE) {
+		profile->batch.update_odf = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &size);
 	if (r >= 0)
 		r = sc_pkcs15init_update_file(profile, p15card, p15card->file_odf, buf, size);
@@ -3093,6 +3267,23 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	if (!df)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
 
+	if (profile->batch.state == SC_PKCS15INIT_BATCH_COLLECT) {
+		unsigned int n;
+
+		for (n = 0; n < profile->batch.df_count; n++)
+			if (profile->batch.df[n] == df)
+				break;
+		if (n < SC_PKCS15INIT_MAX_BATCH_DF) {
+			if (n == profile->batch.df_count) {
+				profile->batch.df[n] = df;
+				profile->batch.df_count++;
+			}
+			profile->batch.df_is_new[n] |= is_new;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* too many different DFs: write this one now */
+	}
+
 	r = sc_profile_get_file_by_path(profile, &df->path, &file);
 	if (r < 0 || file == NULL)
 		sc_select_file(card, &df->path, &file);
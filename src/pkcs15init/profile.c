@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <string.h>
 #include <limits.h>
@@ -36,6 +37,11 @@
 #endif
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -44,6 +50,7 @@
 
 #include "common/compat_strlcpy.h"
 #include "scconf/scconf.h"
+#include "libopensc/internal.h"
 #include "libopensc/log.h"
 #include "libopensc/pkcs15.h"
 #include "pkcs15-init.h"
@@ -225,6 +232,44 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * Profile files parsed so far. They are kept until
+ * sc_pkcs15init_free_profile_cache() and parsed again only when they
+ * change on disk. The list is shared by all contexts of the process.
+ */
+struct profile_conf {
+	char *			path;
+	time_t			mtime;
+	off_t			size;
+	scconf_context *	conf;
+	struct profile_conf *	next;
+};
+static struct profile_conf *	profile_confs = NULL;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t		profile_confs_lock = PTHREAD_MUTEX_INITIALIZER;
+#define profile_confs_acquire()	pthread_mutex_lock(&profile_confs_lock)
+#define profile_confs_release()	pthread_mutex_unlock(&profile_confs_lock)
+#elif defined(_WIN32)
+static SRWLOCK			profile_confs_lock = SRWLOCK_INIT;
+#define profile_confs_acquire()	AcquireSRWLockExclusive(&profile_confs_lock)
+#define profile_confs_release()	ReleaseSRWLockExclusive(&profile_confs_lock)
+#else
+#define profile_confs_acquire()
+#define profile_confs_release()
+#endif
+
+/*
+ * Compiled profiles in the cache directory: magic, version, mtime and
+ * size of the profile file (8 bytes each), path of the profile file,
+ * then the parsed tree. Strings are a 4 byte length and the bytes,
+ * lists and blocks start with a 4 byte count.
+ */
+#define PROFILE_CACHE_MAGIC	"OSCP"
+#define PROFILE_CACHE_VERSION	1
+#define PROFILE_CACHE_NULL	0xFFFFFFFFU
+#define PROFILE_CACHE_MAX_DEPTH	16
+
 static int		process_conf(struct sc_profile *, scconf_context *);
 static int		process_block(struct state *, struct block *,
 				const char *, scconf_block *);
@@ -263,6 +308,17 @@ static void		set_pin_defaults(struct sc_profile *,
 static void		new_macro(sc_profile_t *, const char *, scconf_list *);
 static sc_macro_t *	find_macro(sc_profile_t *, const char *);
 
+static unsigned int
+name_hash(const char *name)
+{
+	unsigned int	h = 0;
+
+	/* file names are compared case insensitively */
+	while (name && *name)
+		h = h * 31 + tolower((unsigned char) *name++);
+	return h % SC_PROFILE_HASH_SIZE;
+}
+
 static sc_file_t *
 init_file(unsigned int type)
 {
@@ -320,6 +376,405 @@ sc_profile_new(void)
 	return pro;
 }
 
+static int
+cache_put_u32(FILE *f, unsigned long v)
+{
+	unsigned char	buf[4];
+
+	buf[0] = (v >> 24) & 0xFF;
+	buf[1] = (v >> 16) & 0xFF;
+	buf[2] = (v >> 8) & 0xFF;
+	buf[3] = v & 0xFF;
+	return fwrite(buf, 1, sizeof(buf), f) == sizeof(buf) ? 0 : -1;
+}
+
+static int
+cache_put_str(FILE *f, const char *str)
+{
+	size_t	len;
+
+	if (str == NULL)
+		return cache_put_u32(f, PROFILE_CACHE_NULL);
+	len = strlen(str);
+	if (cache_put_u32(f, len) < 0)
+		return -1;
+	return fwrite(str, 1, len, f) == len ? 0 : -1;
+}
+
+static int
+cache_put_list(FILE *f, const scconf_list *list)
+{
+	const scconf_list *l;
+	unsigned long	count = 0;
+
+	for (l = list; l; l = l->next)
+		count++;
+	if (cache_put_u32(f, count) < 0)
+		return -1;
+	for (l = list; l; l = l->next)
+		if (cache_put_str(f, l->data) < 0)
+			return -1;
+	return 0;
+}
+
+static int
+cache_put_block(FILE *f, const scconf_block *block)
+{
+	const scconf_item *item;
+	unsigned long	count = 0;
+	int		r = 0;
+
+	if (cache_put_list(f, block->name) < 0)
+		return -1;
+	for (item = block->items; item; item = item->next)
+		count++;
+	if (cache_put_u32(f, count) < 0)
+		return -1;
+	for (item = block->items; item && r == 0; item = item->next) {
+		if (cache_put_u32(f, item->type) < 0 || cache_put_str(f, item->key) < 0)
+			return -1;
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			r = cache_put_str(f, item->value.comment);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			r = cache_put_block(f, item->value.block);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			r = cache_put_list(f, item->value.list);
+			break;
+		default:
+			r = -1;
+		}
+	}
+	return r;
+}
+
+struct cache_reader {
+	const unsigned char *	p;
+	const unsigned char *	end;
+};
+
+static int
+cache_get_u32(struct cache_reader *in, unsigned long *v)
+{
+	if (in->end - in->p < 4)
+		return -1;
+	*v = ((unsigned long) in->p[0] << 24) | (in->p[1] << 16) | (in->p[2] << 8) | in->p[3];
+	in->p += 4;
+	return 0;
+}
+
+static int
+cache_get_str(struct cache_reader *in, char **str)
+{
+	unsigned long	len;
+
+	*str = NULL;
+	if (cache_get_u32(in, &len) < 0)
+		return -1;
+	if (len == PROFILE_CACHE_NULL)
+		return 0;
+	if (len > (unsigned long) (in->end - in->p) || memchr(in->p, '\0', len))
+		return -1;
+	*str = malloc(len + 1);
+	if (*str == NULL)
+		return -1;
+	memcpy(*str, in->p, len);
+	(*str)[len] = '\0';
+	in->p += len;
+	return 0;
+}
+
+static int
+cache_get_list(struct cache_reader *in, scconf_list **list)
+{
+	scconf_list	**tail = list;
+	unsigned long	count;
+
+	if (cache_get_u32(in, &count) < 0)
+		return -1;
+	while (count--) {
+		if ((*tail = calloc(1, sizeof(**tail))) == NULL
+				|| cache_get_str(in, &(*tail)->data) < 0)
+			return -1;
+		tail = &(*tail)->next;
+	}
+	return 0;
+}
+
+static int
+cache_get_block(struct cache_reader *in, scconf_block *block, int depth)
+{
+	scconf_item	**tail = &block->items;
+	unsigned long	count, type;
+	int		r;
+
+	if (depth > PROFILE_CACHE_MAX_DEPTH || cache_get_list(in, &block->name) < 0
+			|| cache_get_u32(in, &count) < 0)
+		return -1;
+	while (count--) {
+		scconf_item *item = calloc(1, sizeof(*item));
+
+		if (item == NULL)
+			return -1;
+		*tail = item;
+		tail = &item->next;
+		if (cache_get_u32(in, &type) < 0 || cache_get_str(in, &item->key) < 0)
+			return -1;
+		switch (type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			item->type = SCCONF_ITEM_TYPE_COMMENT;
+			r = cache_get_str(in, &item->value.comment);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			item->type = SCCONF_ITEM_TYPE_BLOCK;
+			item->value.block = calloc(1, sizeof(scconf_block));
+			if (item->value.block == NULL)
+				return -1;
+			item->value.block->parent = block;
+			r = cache_get_block(in, item->value.block, depth + 1);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			item->type = SCCONF_ITEM_TYPE_VALUE;
+			r = cache_get_list(in, &item->value.list);
+			break;
+		default:
+			return -1;
+		}
+		if (r < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+cache_put_header(FILE *f, const char *path, const struct stat *st)
+{
+	unsigned long long mtime = (unsigned long long) st->st_mtime;
+	unsigned long long size = (unsigned long long) st->st_size;
+
+	if (fwrite(PROFILE_CACHE_MAGIC, 1, 4, f) != 4
+			|| cache_put_u32(f, PROFILE_CACHE_VERSION) < 0
+			|| cache_put_u32(f, mtime >> 32) < 0
+			|| cache_put_u32(f, mtime & 0xFFFFFFFFU) < 0
+			|| cache_put_u32(f, size >> 32) < 0
+			|| cache_put_u32(f, size & 0xFFFFFFFFU) < 0
+			|| cache_put_str(f, path) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Name of the compiled form of a profile file in the cache directory,
+ * or -1 when compiled profiles are not used.
+ */
+static int
+profile_cache_file(struct sc_context *ctx, const char *path, char *buf, size_t bufsize)
+{
+	const char	*name;
+	char		dir[PATH_MAX];
+	int		i, use_cache = 0;
+
+	for (i = 0; ctx->conf_blocks[i]; i++)
+		use_cache = scconf_get_bool(ctx->conf_blocks[i], "use_profile_cache", use_cache);
+	if (!use_cache || sc_get_cache_dir(ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return -1;
+
+	name = strrchr(path, '/');
+#ifdef _WIN32
+	if (strrchr(path, '\\') > name)
+		name = strrchr(path, '\\');
+#endif
+	name = name ? name + 1 : path;
+	if ((size_t) snprintf(buf, bufsize, "%s/profile_%s", dir, name) >= bufsize)
+		return -1;
+	return 0;
+}
+
+/*
+ * Read the compiled form of a profile file, if it was made from the
+ * file as it is now.
+ */
+static scconf_context *
+load_compiled_profile(struct sc_context *ctx, const char *path, const struct stat *st)
+{
+	char		cache_file[PATH_MAX], *cached_path = NULL;
+	unsigned char	*buf = NULL;
+	struct cache_reader in;
+	unsigned long	version, w[4];
+	scconf_context	*conf = NULL;
+	long		len;
+	FILE		*f;
+
+	if (profile_cache_file(ctx, path, cache_file, sizeof(cache_file)) < 0)
+		return NULL;
+	f = fopen(cache_file, "rb");
+	if (f == NULL)
+		return NULL;
+	if (fseek(f, 0L, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0L, SEEK_SET) == 0
+			&& (buf = malloc(len)) != NULL && fread(buf, 1, len, f) != (size_t) len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	if (buf == NULL)
+		return NULL;
+
+	in.p = buf;
+	in.end = buf + len;
+	if (len < 4 || memcmp(buf, PROFILE_CACHE_MAGIC, 4))
+		goto out;
+	in.p += 4;
+	if (cache_get_u32(&in, &version) < 0 || version != PROFILE_CACHE_VERSION
+			|| cache_get_u32(&in, &w[0]) < 0 || cache_get_u32(&in, &w[1]) < 0
+			|| cache_get_u32(&in, &w[2]) < 0 || cache_get_u32(&in, &w[3]) < 0
+			|| ((unsigned long long) w[0] << 32 | w[1]) != (unsigned long long) st->st_mtime
+			|| ((unsigned long long) w[2] << 32 | w[3]) != (unsigned long long) st->st_size
+			|| cache_get_str(&in, &cached_path) < 0
+			|| cached_path == NULL || strcmp(cached_path, path))
+		goto out;
+
+	conf = scconf_new(path);
+	if (conf == NULL)
+		goto out;
+	if (cache_get_block(&in, conf->root, 0) < 0 || in.p != in.end) {
+		sc_log(ctx, "compiled profile %s is corrupted", cache_file);
+		scconf_free(conf);
+		conf = NULL;
+		goto out;
+	}
+	sc_log(ctx, "profile %s loaded from %s", path, cache_file);
+out:
+	free(cached_path);
+	free(buf);
+	return conf;
+}
+
+/*
+ * Write the compiled form of a profile file. It is written to a
+ * temporary file first, so that readers never see a partial file.
+ */
+static void
+save_compiled_profile(struct sc_context *ctx, const char *path, const struct stat *st,
+		scconf_context *conf)
+{
+	char	cache_file[PATH_MAX], tmp_file[PATH_MAX];
+	FILE	*f;
+	int	r;
+
+	if (profile_cache_file(ctx, path, cache_file, sizeof(cache_file)) < 0)
+		return;
+	if ((size_t) snprintf(tmp_file, sizeof(tmp_file), "%s.%lu", cache_file,
+				(unsigned long) getpid()) >= sizeof(tmp_file))
+		return;
+
+	f = fopen(tmp_file, "wb");
+	if (f == NULL && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(tmp_file, "wb");
+	if (f == NULL)
+		return;
+	r = cache_put_header(f, path, st);
+	if (r == 0)
+		r = cache_put_block(f, conf->root);
+	if (fclose(f) != 0)
+		r = -1;
+#ifdef _WIN32
+	if (r == 0)
+		remove(cache_file);
+#endif
+	if (r != 0 || rename(tmp_file, cache_file) != 0) {
+		sc_log(ctx, "cannot write compiled profile %s", cache_file);
+		remove(tmp_file);
+	}
+}
+
+/*
+ * Get the parsed content of a profile file.
+ * Called with profile_confs_lock held.
+ */
+static scconf_context *
+get_profile_conf(struct sc_context *ctx, const char *path, int *res)
+{
+	struct profile_conf *pc;
+	scconf_context	*conf;
+	struct stat	st;
+
+	if (stat(path, &st) != 0) {
+		*res = SC_ERROR_FILE_NOT_FOUND;
+		return NULL;
+	}
+
+	for (pc = profile_confs; pc; pc = pc->next)
+		if (!strcmp(pc->path, path))
+			break;
+
+	if (pc && pc->mtime == st.st_mtime && pc->size == st.st_size) {
+		sc_log(ctx, "profile %s already parsed", path);
+		*res = SC_SUCCESS;
+		return pc->conf;
+	}
+
+	conf = load_compiled_profile(ctx, path, &st);
+	if (conf == NULL) {
+		conf = scconf_new(path);
+		if (conf == NULL) {
+			*res = SC_ERROR_OUT_OF_MEMORY;
+			return NULL;
+		}
+		*res = scconf_parse(conf);
+
+		sc_log(ctx, "profile %s loaded ok", path);
+
+		if (*res <= 0) {
+			scconf_free(conf);
+			*res = *res < 0 ? SC_ERROR_FILE_NOT_FOUND : SC_ERROR_SYNTAX_ERROR;
+			return NULL;
+		}
+		save_compiled_profile(ctx, path, &st, conf);
+	}
+
+	if (pc == NULL) {
+		pc = calloc(1, sizeof(*pc));
+		if (pc == NULL || (pc->path = strdup(path)) == NULL) {
+			free(pc);
+			scconf_free(conf);
+			*res = SC_ERROR_OUT_OF_MEMORY;
+			return NULL;
+		}
+		pc->next = profile_confs;
+		profile_confs = pc;
+	}
+	else {
+		scconf_free(pc->conf);
+	}
+	pc->conf = conf;
+	pc->mtime = st.st_mtime;
+	pc->size = st.st_size;
+
+	*res = SC_SUCCESS;
+	return conf;
+}
+
+/*
+ * Free the profile files kept by sc_profile_load(). Called when the
+ * PKCS#11 module is finalized.
+ */
+void
+sc_pkcs15init_free_profile_cache(void)
+{
+	struct profile_conf *pc;
+
+	profile_confs_acquire();
+	while ((pc = profile_confs) != NULL) {
+		profile_confs = pc->next;
+		scconf_free(pc->conf);
+		free(pc->path);
+		free(pc);
+	}
+	profile_confs_release();
+}
+
 int
 sc_profile_load(struct sc_profile *profile, const char *filename)
 {
@@ -362,23 +817,12 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 
 	sc_log(ctx, "Trying profile file %s", path);
 
-	conf = scconf_new(path);
-	res = scconf_parse(conf);
-
-	sc_log(ctx, "profile %s loaded ok", path);
+	profile_confs_acquire();
+	conf = get_profile_conf(ctx, path, &res);
+	if (conf)
+		res = process_conf(profile, conf);
+	profile_confs_release();
 
-	if (res < 0) {
-		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
-	}
-
-	if (res == 0) {
-		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
-	}
-
-	res = process_conf(profile, conf);
-	scconf_free(conf);
 	LOG_FUNC_RETURN(ctx, res);
 }
 
@@ -488,6 +932,257 @@ sc_profile_free(struct sc_profile *profile)
 	free(profile);
 }
 
+/*
+ * Find the copy of an entry of a list, given the list and its copy
+ * built so far in the same order.
+ */
+static struct file_info *
+copy_of_file(const struct file_info *list, struct file_info *copy,
+		const struct file_info *fi)
+{
+	for (; list && copy; list = list->next, copy = copy->next)
+		if (list == fi)
+			return copy;
+	return NULL;
+}
+
+static sc_template_t *
+copy_of_template(const sc_template_t *list, sc_template_t *copy,
+		const sc_template_t *ti)
+{
+	for (; list && copy; list = list->next, copy = copy->next)
+		if (list == ti)
+			return copy;
+	return NULL;
+}
+
+static sc_macro_t *
+copy_of_macro(const sc_macro_t *list, sc_macro_t *copy, const sc_macro_t *mi)
+{
+	for (; list && copy; list = list->next, copy = copy->next)
+		if (list == mi)
+			return copy;
+	return NULL;
+}
+
+static int
+copy_pkcs15_spec(struct sc_pkcs15_card *dst, const struct sc_pkcs15_card *src)
+{
+	struct sc_pkcs15_tokeninfo *ti = src->tokeninfo;
+
+	if ((ti->label && (dst->tokeninfo->label = strdup(ti->label)) == NULL)
+			|| (ti->manufacturer_id && (dst->tokeninfo->manufacturer_id
+					= strdup(ti->manufacturer_id)) == NULL)
+			|| (ti->serial_number && (dst->tokeninfo->serial_number
+					= strdup(ti->serial_number)) == NULL))
+		return SC_ERROR_OUT_OF_MEMORY;
+	dst->tokeninfo->flags = ti->flags;
+	dst->tokeninfo->version = ti->version;
+
+	sc_file_dup(&dst->file_tokeninfo, src->file_tokeninfo);
+	sc_file_dup(&dst->file_odf, src->file_odf);
+	sc_file_dup(&dst->file_unusedspace, src->file_unusedspace);
+	if ((src->file_tokeninfo && !dst->file_tokeninfo)
+			|| (src->file_odf && !dst->file_odf)
+			|| (src->file_unusedspace && !dst->file_unusedspace))
+		return SC_ERROR_OUT_OF_MEMORY;
+	return SC_SUCCESS;
+}
+
+/*
+ * Copy the content of a profile; templates are copied recursively.
+ * Files shared with the PKCS#15 spec refer to the copy of the spec.
+ */
+static int
+copy_profile(struct sc_profile *dst, const struct sc_profile *src)
+{
+	const struct file_info *fi;
+	const struct pin_info *pi;
+	const struct auth_info *ai;
+	const sc_template_t *ti;
+	const sc_macro_t *mi;
+	struct pin_info **pin_tail = &dst->pin_list;
+	struct auth_info **auth_tail = &dst->auth_list;
+	sc_template_t **tmpl_tail = &dst->template_list;
+	sc_macro_t **macro_tail = &dst->macro_list;
+	int i;
+
+	for (ti = src->template_list; ti; ti = ti->next) {
+		sc_template_t *nti = calloc(1, sizeof(*nti));
+
+		if (nti == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		*tmpl_tail = nti;
+		tmpl_tail = &nti->next;
+		if ((nti->name = strdup(ti->name)) == NULL
+				|| (nti->data = calloc(1, sizeof(*nti->data))) == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (copy_profile(nti->data, ti->data) != SC_SUCCESS)
+			return SC_ERROR_OUT_OF_MEMORY;
+		nti->file = copy_of_file(ti->data->ef_list, nti->data->ef_list, ti->file);
+	}
+	for (i = 0; i < SC_PROFILE_HASH_SIZE; i++) {
+		sc_template_t **tail = &dst->template_hash[i];
+
+		for (ti = src->template_hash[i]; ti; ti = ti->hash_next) {
+			*tail = copy_of_template(src->template_list, dst->template_list, ti);
+			tail = &(*tail)->hash_next;
+		}
+	}
+
+	for (mi = src->macro_list; mi; mi = mi->next) {
+		sc_macro_t *nmi = calloc(1, sizeof(*nmi));
+
+		if (nmi == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		*macro_tail = nmi;
+		macro_tail = &nmi->next;
+		if ((nmi->name = strdup(mi->name)) == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		nmi->value = mi->value;
+	}
+	for (i = 0; i < SC_PROFILE_HASH_SIZE; i++) {
+		sc_macro_t **tail = &dst->macro_hash[i];
+
+		for (mi = src->macro_hash[i]; mi; mi = mi->hash_next) {
+			*tail = copy_of_macro(src->macro_list, dst->macro_list, mi);
+			tail = &(*tail)->hash_next;
+		}
+	}
+
+	/* parents always come before their children in ef_list */
+	for (fi = src->ef_list; fi; fi = fi->next) {
+		struct file_info *nfi = calloc(1, sizeof(*nfi));
+
+		if (nfi == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		nfi->ident = strdup(fi->ident);
+		nfi->dont_free = fi->dont_free;
+		nfi->inst_index = fi->inst_index;
+		nfi->inst_path = fi->inst_path;
+		append_file(dst, nfi);
+		if (nfi->ident == NULL || (fi->profile_extension
+				&& (nfi->profile_extension = strdup(fi->profile_extension)) == NULL))
+			return SC_ERROR_OUT_OF_MEMORY;
+
+		if (src->p15_spec && fi->file == src->p15_spec->file_tokeninfo)
+			nfi->file = dst->p15_spec->file_tokeninfo;
+		else if (src->p15_spec && fi->file == src->p15_spec->file_odf)
+			nfi->file = dst->p15_spec->file_odf;
+		else if (src->p15_spec && fi->file == src->p15_spec->file_unusedspace)
+			nfi->file = dst->p15_spec->file_unusedspace;
+		else
+			sc_file_dup(&nfi->file, fi->file);
+		if (nfi->file == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (src->p15_spec && fi->file == src->p15_spec->file_app)
+			dst->p15_spec->file_app = nfi->file;
+
+		nfi->parent = copy_of_file(src->ef_list, dst->ef_list, fi->parent);
+		nfi->instance = copy_of_file(src->ef_list, dst->ef_list, fi->instance);
+		nfi->base_template = NULL;
+		if (fi->base_template) {
+			for (ti = src->template_list; ti; ti = ti->next)
+				if (ti->data == fi->base_template)
+					break;
+			if (ti)
+				nfi->base_template = copy_of_template(src->template_list,
+						dst->template_list, ti)->data;
+		}
+	}
+	dst->mf_info = copy_of_file(src->ef_list, dst->ef_list, src->mf_info);
+	dst->df_info = copy_of_file(src->ef_list, dst->ef_list, src->df_info);
+	for (i = 0; i < SC_PKCS15_DF_TYPE_COUNT; i++) {
+		for (fi = src->ef_list; fi; fi = fi->next)
+			if (src->df[i] && fi->file == src->df[i])
+				break;
+		if (fi)
+			dst->df[i] = copy_of_file(src->ef_list, dst->ef_list, fi)->file;
+	}
+
+	for (pi = src->pin_list; pi; pi = pi->next) {
+		struct pin_info *npi = malloc(sizeof(*npi));
+
+		if (npi == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		*npi = *pi;
+		npi->next = NULL;
+		npi->file_name = NULL;
+		*pin_tail = npi;
+		pin_tail = &npi->next;
+		if (pi->file_name && (npi->file_name = strdup(pi->file_name)) == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		npi->file = copy_of_file(src->ef_list, dst->ef_list, pi->file);
+	}
+
+	for (ai = src->auth_list; ai; ai = ai->next) {
+		struct auth_info *nai = malloc(sizeof(*nai));
+
+		if (nai == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		*nai = *ai;
+		nai->next = NULL;
+		*auth_tail = nai;
+		auth_tail = &nai->next;
+	}
+
+	return SC_SUCCESS;
+}
+
+/*
+ * Make a copy of a loaded profile, so that a profile is read only once
+ * for several cards using the same driver. The copy is not bound to a
+ * card, and refers to the card operations and the driver module of the
+ * original, which has to be kept until the copy is freed.
+ */
+struct sc_profile *
+sc_profile_dup(const struct sc_profile *src)
+{
+	struct sc_profile *pro;
+	int i;
+
+	pro = calloc(1, sizeof(*pro));
+	if (pro == NULL)
+		return NULL;
+
+	pro->ops = src->ops;
+	pro->pin_domains = src->pin_domains;
+	pro->pin_maxlen = src->pin_maxlen;
+	pro->pin_minlen = src->pin_minlen;
+	pro->pin_pad_char = src->pin_pad_char;
+	pro->pin_encoding = src->pin_encoding;
+	pro->pin_attempts = src->pin_attempts;
+	pro->puk_attempts = src->puk_attempts;
+	pro->rsa_access_flags = src->rsa_access_flags;
+	pro->dsa_access_flags = src->dsa_access_flags;
+	pro->pkcs15 = src->pkcs15;
+	pro->id_style = src->id_style;
+	pro->md_style = src->md_style;
+
+	if (src->name && (pro->name = strdup(src->name)) == NULL)
+		goto err;
+	for (i = 0; i < SC_PKCS15INIT_MAX_OPTIONS && src->options[i]; i++)
+		if ((pro->options[i] = strdup(src->options[i])) == NULL)
+			goto err;
+	if (src->driver && (pro->driver = strdup(src->driver)) == NULL)
+		goto err;
+
+	if (src->p15_spec) {
+		pro->p15_spec = sc_pkcs15_card_new();
+		if (pro->p15_spec == NULL
+				|| copy_pkcs15_spec(pro->p15_spec, src->p15_spec) != SC_SUCCESS)
+			goto err;
+	}
+
+	if (copy_profile(pro, src) != SC_SUCCESS)
+		goto err;
+	return pro;
+
+err:
+	sc_profile_free(pro);
+	return NULL;
+}
+
 void
 sc_profile_get_pin_info(struct sc_profile *profile,
 		int id, struct sc_pkcs15_auth_info *info)
@@ -676,7 +1371,7 @@ sc_profile_instantiate_template(sc_profile_t *profile,
 	printf("Instantiate %s in template %s\n", file_name, template_name);
 	sc_profile_find_file_by_path(profile, base_path);
 #endif
-	for (info = profile->template_list; info; info = info->next)
+	for (info = profile->template_hash[name_hash(template_name)]; info; info = info->hash_next)
 		if (!strcmp(info->name, template_name))
 			break;
 	if (info == NULL)   {
@@ -686,7 +1381,7 @@ sc_profile_instantiate_template(sc_profile_t *profile,
 
 	tmpl = info->data;
 	idx = id->value[id->len-1];
-	for (fi = profile->ef_list; fi; fi = fi->next) {
+	for (fi = profile->ef_hash[name_hash(file_name)]; fi; fi = fi->hash_next) {
 		if (fi->base_template == tmpl
 		 && fi->inst_index == idx
 		 && sc_compare_path(&fi->inst_path, base_path)
@@ -1121,6 +1816,8 @@ process_tmpl(struct state *cur, struct block *info,
 
 	tinfo->next = cur->profile->template_list;
 	cur->profile->template_list = tinfo;
+	tinfo->hash_next = cur->profile->template_hash[name_hash(name)];
+	cur->profile->template_hash[name_hash(name)] = tinfo;
 
 	init_state(cur, &state);
 	state.profile = tinfo->data;
@@ -1142,11 +1839,18 @@ process_tmpl(struct state *cur, struct block *info,
  */
 static void append_file(sc_profile_t *profile, struct file_info *nfile)
 {
-	struct file_info	**list, *fi;
+	struct file_info	**list;
+
+	if (profile->ef_tail)
+		profile->ef_tail->next = nfile;
+	else
+		profile->ef_list = nfile;
+	profile->ef_tail = nfile;
 
-	list = &profile->ef_list;
-	while ((fi = *list) != NULL)
-		list = &fi->next;
+	/* the hash chains keep the ef_list order too */
+	list = &profile->ef_hash[name_hash(nfile->ident)];
+	while (*list != NULL)
+		list = &(*list)->hash_next;
 	*list = nfile;
 }
 
@@ -1740,6 +2444,8 @@ new_macro(sc_profile_t *profile, const char *name, scconf_list *value)
 		mac->name = strdup(name);
 		mac->next = profile->macro_list;
 		profile->macro_list = mac;
+		mac->hash_next = profile->macro_hash[name_hash(name)];
+		profile->macro_hash[name_hash(name)] = mac;
 	}
 
 	mac->value = value;
@@ -1750,7 +2456,7 @@ find_macro(sc_profile_t *profile, const char *name)
 {
 	sc_macro_t	*mac;
 
-	for (mac = profile->macro_list; mac; mac = mac->next) {
+	for (mac = profile->macro_hash[name_hash(name)]; mac; mac = mac->hash_next) {
 		if (!strcmp(mac->name, name))
 			return mac;
 	}
@@ -2026,7 +2732,7 @@ sc_profile_find_file(struct sc_profile *pro,
 	unsigned int		len;
 
 	len = path? path->len : 0;
-	for (fi = pro->ef_list; fi; fi = fi->next) {
+	for (fi = pro->ef_hash[name_hash(name)]; fi; fi = fi->hash_next) {
 		sc_path_t *fpath = &fi->file->path;
 
 		if (!strcasecmp(fi->ident, name) && fpath->len >= len && !memcmp(fpath->value, path->value, len))
@@ -43,6 +43,7 @@ struct auth_info {
 struct file_info {
 	char *			ident;
 	struct file_info *	next;
+	struct file_info *	hash_next;
 	struct sc_file *	file;
 	unsigned int		dont_free;
 	struct file_info *	parent;
@@ -75,6 +76,7 @@ struct pin_info {
 typedef struct sc_macro {
 	char *			name;
 	struct sc_macro *	next;
+	struct sc_macro *	hash_next;
 	scconf_list *		value;
 } sc_macro_t;
 
@@ -88,11 +90,18 @@ typedef struct sc_macro {
 typedef struct sc_template {
 	char *			name;
 	struct sc_template *	next;
+	struct sc_template *	hash_next;
 	struct sc_profile *	data;
 	struct file_info *	file;
 } sc_template_t;
 
 #define SC_PKCS15INIT_MAX_OPTIONS 16
+#define SC_PROFILE_HASH_SIZE 32
+#define SC_PKCS15INIT_MAX_BATCH_DF 16
+
+#define SC_PKCS15INIT_BATCH_NONE	0
+#define SC_PKCS15INIT_BATCH_COLLECT	1	/* updates are recorded */
+#define SC_PKCS15INIT_BATCH_FLUSH	2	/* recorded updates are written */
 struct sc_profile {
 	char *			name;
 	char *			options[SC_PKCS15INIT_MAX_OPTIONS];
@@ -112,6 +121,12 @@ struct sc_profile {
 	sc_template_t *		template_list;
 	sc_macro_t *		macro_list;
 
+	/* files, templates and macros hashed by name */
+	struct file_info *	ef_tail;
+	struct file_info *	ef_hash[SC_PROFILE_HASH_SIZE];
+	sc_template_t *		template_hash[SC_PROFILE_HASH_SIZE];
+	sc_macro_t *		macro_hash[SC_PROFILE_HASH_SIZE];
+
 	unsigned int		pin_domains;
 	unsigned int		pin_maxlen;
 	unsigned int		pin_minlen;
@@ -136,6 +151,17 @@ struct sc_profile {
 	 * has been changed) */
 	int			dirty;
 
+	/* directory file updates postponed between
+	 * sc_pkcs15init_begin_batch() and sc_pkcs15init_end_batch() */
+	struct {
+		int			state;
+		struct sc_pkcs15_df *	df[SC_PKCS15INIT_MAX_BATCH_DF];
+		int			df_is_new[SC_PKCS15INIT_MAX_BATCH_DF];
+		unsigned int		df_count;
+		int			update_odf;
+		int			update_tokeninfo;
+	} batch;
+
 	/* PKCS15 object ID style */
 	unsigned int id_style;
 
@@ -147,6 +173,7 @@ struct sc_profile *sc_profile_new(void);
 int	sc_profile_load(struct sc_profile *, const char *);
 int	sc_profile_finish(struct sc_profile *, const struct sc_app_info *);
 void	sc_profile_free(struct sc_profile *);
+struct sc_profile *sc_profile_dup(const struct sc_profile *);
 int	sc_profile_build_pkcs15(struct sc_profile *);
 void	sc_profile_get_pin_info(struct sc_profile *, int, struct sc_pkcs15_auth_info *);
 int	sc_profile_get_pin_id(struct sc_profile *, unsigned int, int *);
@@ -0,0 +1,383 @@
+/*
+ * bench.c: Timing loops over the ASN.1/PKCS#15 decoders
+ *
+ * Runs the TokenInfo, directory file, certificate and SubjectPublicKeyInfo
+ * decoders over a corpus of blobs and reports the time per operation.
+ * Without arguments the files of the corpus directory are used; other
+ * captured files can be given as TYPE:FILE arguments.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "common/compat_getopt.h"
+#include "libopensc/opensc.h"
+#include "libopensc/asn1.h"
+#include "libopensc/pkcs15.h"
+
+enum {
+	BENCH_TOKENINFO,
+	BENCH_PRKDF,
+	BENCH_PUKDF,
+	BENCH_SKDF,
+	BENCH_CDF,
+	BENCH_DODF,
+	BENCH_AODF,
+	BENCH_CERT,
+	BENCH_SPKI
+};
+
+static const struct {
+	const char *name;
+	int type;
+} bench_types[] = {
+	{ "tokeninfo",	BENCH_TOKENINFO },
+	{ "prkdf",	BENCH_PRKDF },
+	{ "pukdf",	BENCH_PUKDF },
+	{ "skdf",	BENCH_SKDF },
+	{ "cdf",	BENCH_CDF },
+	{ "dodf",	BENCH_DODF },
+	{ "aodf",	BENCH_AODF },
+	{ "cert",	BENCH_CERT },
+	{ "spki",	BENCH_SPKI },
+	{ NULL, 0 }
+};
+
+struct bench_blob {
+	int type;
+	char *name;
+	u8 *data;
+	size_t len;
+};
+
+#define MAX_BLOBS	64
+
+#ifndef BENCH_CORPUS_DIR
+#define BENCH_CORPUS_DIR	"corpus"
+#endif
+
+/* Files of the corpus directory, see corpus/README */
+static const struct {
+	int type;
+	const char *file;
+} corpus[] = {
+	{ BENCH_TOKENINFO,	"tokeninfo-pkcs15init.der" },
+	{ BENCH_PRKDF,		"prkdf-pkcs15init.der" },
+	{ BENCH_PUKDF,		"pukdf-pkcs15init.der" },
+	{ BENCH_CDF,		"cdf-pkcs15init.der" },
+	{ BENCH_AODF,		"aodf-pkcs15init.der" },
+	{ BENCH_CERT,		"cert-isrg-root-x1.der" },
+	{ BENCH_CERT,		"cert-isrg-root-x2.der" },
+	{ BENCH_SPKI,		"spki-isrg-root-x1.der" },
+	{ BENCH_SPKI,		"spki-isrg-root-x2.der" },
+	{ 0, NULL }
+};
+
+static struct bench_blob blobs[MAX_BLOBS];
+static int blob_count = 0;
+
+static sc_context_t *ctx = NULL;
+static struct sc_card_operations card_ops;
+static struct sc_pkcs15_card *p15card = NULL;
+
+static const struct option options[] = {
+	{ "iterations",	1, NULL, 'n' },
+	{ "corpus",	1, NULL, 'c' },
+	{ "debug",	0, NULL, 'd' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *type_name(int type)
+{
+	int i;
+
+	for (i = 0; bench_types[i].name; i++)
+		if (bench_types[i].type == type)
+			return bench_types[i].name;
+	return "unknown";
+}
+
+static int add_blob(int type, const char *name, u8 *data, size_t len)
+{
+	if (blob_count >= MAX_BLOBS) {
+		free(data);
+		return SC_ERROR_TOO_MANY_OBJECTS;
+	}
+	blobs[blob_count].type = type;
+	blobs[blob_count].name = strdup(name);
+	blobs[blob_count].data = data;
+	blobs[blob_count].len = len;
+	blob_count++;
+	return SC_SUCCESS;
+}
+
+static int load_file(int type, const char *fname)
+{
+	FILE *f;
+	u8 *data = NULL;
+	size_t len = 0, n;
+	u8 buf[4096];
+	const char *name;
+
+	f = fopen(fname, "rb");
+	if (f == NULL) {
+		perror(fname);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		u8 *p = realloc(data, len + n);
+		if (p == NULL) {
+			free(data);
+			fclose(f);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		data = p;
+		memcpy(data + len, buf, n);
+		len += n;
+	}
+	fclose(f);
+
+	name = strrchr(fname, '/');
+	return add_blob(type, name ? name + 1 : fname, data, len);
+}
+
+static int load_blob(const char *arg)
+{
+	const char *sep = strchr(arg, ':');
+	int i;
+
+	if (sep == NULL) {
+		fprintf(stderr, "Expected TYPE:FILE, got '%s'\n", arg);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+	for (i = 0; bench_types[i].name; i++)
+		if (strlen(bench_types[i].name) == (size_t)(sep - arg)
+				&& !strncmp(bench_types[i].name, arg, sep - arg))
+			break;
+	if (bench_types[i].name == NULL) {
+		fprintf(stderr, "Unknown blob type in '%s'\n", arg);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	return load_file(bench_types[i].type, sep + 1);
+}
+
+static int load_corpus(const char *dir)
+{
+	char fname[1024];
+	int i, r;
+
+	for (i = 0; corpus[i].file; i++) {
+		snprintf(fname, sizeof(fname), "%s/%s", dir, corpus[i].file);
+		r = load_file(corpus[i].type, fname);
+		if (r < 0)
+			return r;
+	}
+	return SC_SUCCESS;
+}
+
+static int decode_df(int type, const u8 *data, size_t len)
+{
+	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		     const u8 **nbuf, size_t *nbufsize) = NULL;
+	const u8 *p = data;
+	size_t left = len;
+	int r = 0, count = 0;
+
+	switch (type) {
+	case BENCH_PRKDF:
+		func = sc_pkcs15_decode_prkdf_entry;
+		break;
+	case BENCH_PUKDF:
+		func = sc_pkcs15_decode_pukdf_entry;
+		break;
+	case BENCH_SKDF:
+		func = sc_pkcs15_decode_skdf_entry;
+		break;
+	case BENCH_CDF:
+		func = sc_pkcs15_decode_cdf_entry;
+		break;
+	case BENCH_DODF:
+		func = sc_pkcs15_decode_dodf_entry;
+		break;
+	case BENCH_AODF:
+		func = sc_pkcs15_decode_aodf_entry;
+		break;
+	default:
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	while (left && *p != 0x00) {
+		struct sc_pkcs15_object *obj = calloc(1, sizeof(struct sc_pkcs15_object));
+
+		if (obj == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = func(p15card, obj, &p, &left);
+		/* the decoders may leave partial data in a failed object */
+		sc_pkcs15_free_object(obj);
+		if (r) {
+			if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
+				r = 0;
+			break;
+		}
+		count++;
+	}
+	return r < 0 ? r : count;
+}
+
+static int run_once(const struct bench_blob *blob)
+{
+	int r;
+
+	switch (blob->type) {
+	case BENCH_TOKENINFO: {
+		struct sc_pkcs15_tokeninfo *ti = sc_pkcs15_tokeninfo_new();
+
+		if (ti == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = sc_pkcs15_parse_tokeninfo(ctx, ti, blob->data, blob->len);
+		sc_pkcs15_free_tokeninfo(ti);
+		return r;
+	}
+	case BENCH_CERT: {
+		struct sc_pkcs15_cert_info info;
+		struct sc_pkcs15_cert *cert = NULL;
+
+		memset(&info, 0, sizeof(info));
+		info.value.value = blob->data;
+		info.value.len = blob->len;
+		r = sc_pkcs15_read_certificate(p15card, &info, &cert);
+		if (r == SC_SUCCESS)
+			sc_pkcs15_free_certificate(cert);
+		return r;
+	}
+	case BENCH_SPKI: {
+		struct sc_pkcs15_object obj;
+		struct sc_pkcs15_pubkey_info info;
+		struct sc_pkcs15_pubkey *pubkey = NULL;
+
+		/* a direct SPKI value is decoded by sc_pkcs15_pubkey_from_spki_sequence() */
+		memset(&obj, 0, sizeof(obj));
+		memset(&info, 0, sizeof(info));
+		obj.type = SC_PKCS15_TYPE_PUBKEY_RSA;
+		obj.data = &info;
+		info.direct.spki.value = blob->data;
+		info.direct.spki.len = blob->len;
+		r = sc_pkcs15_read_pubkey(p15card, &obj, &pubkey);
+		if (r == SC_SUCCESS)
+			sc_pkcs15_free_pubkey(pubkey);
+		return r;
+	}
+	default:
+		return decode_df(blob->type, blob->data, blob->len);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	sc_context_param_t ctx_param;
+	struct sc_card card;
+	const char *opt_corpus = BENCH_CORPUS_DIR;
+	int i, c, r, opt_debug = 0;
+	long n, iterations = 10000;
+	struct timeval tv1, tv2;
+
+	while ((c = getopt_long(argc, argv, "n:c:d", options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		case 'c':
+			opt_corpus = optarg;
+			break;
+		case 'd':
+			opt_debug++;
+			break;
+		default:
+			fprintf(stderr, "usage: bench [-n iterations] [-c corpus-dir] [-d] [TYPE:FILE ...]\n"
+				"types: tokeninfo prkdf pukdf skdf cdf dodf aodf cert spki\n");
+			return 1;
+		}
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = "bench";
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	ctx->debug = opt_debug;
+
+	/* The decoders only need the context, the card operations and the
+	 * application path */
+	memset(&card, 0, sizeof(card));
+	card.ctx = ctx;
+	card.ops = &card_ops;
+	p15card = sc_pkcs15_card_new();
+	if (p15card == NULL || (p15card->file_app = sc_file_new()) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	p15card->card = &card;
+	sc_format_path("3F005015", &p15card->file_app->path);
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++)
+			if (load_blob(argv[i]) < 0)
+				return 1;
+	}
+	else {
+		r = load_corpus(opt_corpus);
+		if (r < 0) {
+			fprintf(stderr, "Failed to load corpus: %s\n", sc_strerror(r));
+			return 1;
+		}
+	}
+
+	printf("%-10s %-24s %8s %8s %12s\n", "type", "source", "bytes", "objects", "ns/op");
+	for (i = 0; i < blob_count; i++) {
+		r = run_once(&blobs[i]);
+		if (r < 0) {
+			printf("%-10s %-24s %8lu decoding failed: %s\n", type_name(blobs[i].type),
+					blobs[i].name, (unsigned long)blobs[i].len, sc_strerror(r));
+			continue;
+		}
+
+		if (0 != gettimeofday(&tv1, NULL)) {
+			fprintf(stderr, "gettimeofday() failed: %s\n", strerror(errno));
+			return 1;
+		}
+		for (n = 0; n < iterations; n++)
+			run_once(&blobs[i]);
+		if (0 != gettimeofday(&tv2, NULL)) {
+			fprintf(stderr, "gettimeofday() failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		printf("%-10s %-24s %8lu %8d %12.1f\n", type_name(blobs[i].type), blobs[i].name,
+				(unsigned long)blobs[i].len, r,
+				((tv2.tv_sec - tv1.tv_sec) * 1e9 + (tv2.tv_usec - tv1.tv_usec) * 1e3) / iterations);
+	}
+
+	for (i = 0; i < blob_count; i++) {
+		free(blobs[i].name);
+		free(blobs[i].data);
+	}
+	p15card->card = NULL;
+	sc_pkcs15_card_free(p15card);
+	sc_release_context(ctx);
+	return 0;
+}
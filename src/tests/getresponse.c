@@ -0,0 +1,190 @@
+/*
+ * getresponse.c: APDU count regression test for response chaining
+ *
+ * Sets up a virtual card whose applications answer SELECT with more data
+ * than fits in a short Le, and checks that sc_transmit_apdu() collects the
+ * response with no more GET RESPONSE commands than the card announces
+ * with SW 61xx.
+ */
+
+#include "config.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "libopensc/opensc.h"
+
+static const struct {
+	u8 aid;			/* last byte of the AID */
+	size_t datalen;		/* length of the SELECT response */
+	size_t resplen;		/* size of the response buffer */
+	size_t expected_len;
+	unsigned long expected_apdus;
+} tests[] = {
+	{ 0x01, 100, 1024, 100, 1 },
+	{ 0x02, 256, 1024, 256, 1 },
+	{ 0x03, 512, 1024, 512, 2 },
+	{ 0x04, 600, 1024, 600, 3 },
+	{ 0x05, 600, 300, 300, 2 },
+	{ 0, 0, 0, 0, 0 }
+};
+
+static const u8 aid_prefix[] = { 0xA0, 0x00, 0x00, 0x00, 0x00, 0x47, 0x52 };
+
+static struct sc_reader_operations counting_ops;
+static const struct sc_reader_operations *reader_ops;
+static unsigned long apdu_count;
+
+static int counting_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	apdu_count++;
+	return reader_ops->transmit(reader, apdu);
+}
+
+static u8 data_byte(size_t i)
+{
+	return (u8)(i * 7 + 1);
+}
+
+static int write_files(const char *dir, char *conf, size_t conflen)
+{
+	char image[PATH_MAX];
+	FILE *f;
+	size_t i, j;
+
+	snprintf(image, sizeof(image), "%s/card.conf", dir);
+	f = fopen(image, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "card {\n\tdf 3F00 {\n");
+	for (i = 0; tests[i].datalen; i++) {
+		fprintf(f, "\t\tdf 47%02X {\n\t\t\taid = \"", tests[i].aid);
+		for (j = 0; j < sizeof(aid_prefix); j++)
+			fprintf(f, "%02X:", aid_prefix[j]);
+		fprintf(f, "%02X\";\n\t\t\tselect_response = \"", tests[i].aid);
+		for (j = 0; j < tests[i].datalen; j++)
+			fprintf(f, "%s%02X", j ? ":" : "", data_byte(j));
+		fprintf(f, "\";\n\t\t}\n");
+	}
+	fprintf(f, "\t}\n}\n");
+	if (fclose(f) != 0)
+		return -1;
+
+	snprintf(conf, conflen, "%s/opensc.conf", dir);
+	f = fopen(conf, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "app default {\n"
+			"\treader_driver virtual { images = \"%s\"; }\n"
+			"\tforce_card_driver = default;\n"
+			"}\n", image);
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+}
+
+static int run_test(sc_card_t *card, int n)
+{
+	sc_apdu_t apdu;
+	u8 aid[sizeof(aid_prefix) + 1], buf[1024];
+	size_t i;
+	int r;
+
+	memcpy(aid, aid_prefix, sizeof(aid_prefix));
+	aid[sizeof(aid_prefix)] = tests[n].aid;
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xA4, 0x04, 0x00);
+	apdu.data = aid;
+	apdu.datalen = apdu.lc = sizeof(aid);
+	apdu.le = 256;
+	apdu.resp = buf;
+	apdu.resplen = tests[n].resplen;
+
+	apdu_count = 0;
+	r = sc_transmit_apdu(card, &apdu);
+	if (r != SC_SUCCESS) {
+		printf("test %d: transmit failed: %s\n", n, sc_strerror(r));
+		return 1;
+	}
+	if (apdu.sw1 != 0x90 || apdu.sw2 != 0x00) {
+		printf("test %d: SW %02X%02X\n", n, apdu.sw1, apdu.sw2);
+		return 1;
+	}
+	if (apdu.resplen != tests[n].expected_len) {
+		printf("test %d: %lu bytes received, %lu expected\n", n,
+				(unsigned long)apdu.resplen, (unsigned long)tests[n].expected_len);
+		return 1;
+	}
+	for (i = 0; i < apdu.resplen; i++) {
+		if (buf[i] != data_byte(i)) {
+			printf("test %d: wrong data at offset %lu\n", n, (unsigned long)i);
+			return 1;
+		}
+	}
+	if (apdu_count != tests[n].expected_apdus) {
+		printf("test %d: %lu APDUs transmitted, %lu expected\n", n,
+				apdu_count, tests[n].expected_apdus);
+		return 1;
+	}
+	printf("test %d: %lu bytes in %lu APDUs\n", n, (unsigned long)apdu.resplen, apdu_count);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/getresponse.XXXXXX", conf[PATH_MAX], path[PATH_MAX];
+	sc_context_param_t ctx_param;
+	sc_context_t *ctx = NULL;
+	sc_card_t *card = NULL;
+	sc_reader_t *reader;
+	int i, r, failed = 0;
+
+	if (mkdtemp(dir) == NULL || write_files(dir, conf, sizeof(conf)) != 0) {
+		fprintf(stderr, "Cannot write the virtual card\n");
+		return 1;
+	}
+	setenv("OPENSC_CONF", conf, 1);
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = "getresponse";
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r == SC_SUCCESS && sc_ctx_get_reader_count(ctx) == 0)
+		r = SC_ERROR_NO_READERS_FOUND;
+	if (r == SC_SUCCESS) {
+		reader = sc_ctx_get_reader(ctx, 0);
+		r = sc_connect_card(reader, &card);
+	}
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Cannot connect to the virtual card: %s\n", sc_strerror(r));
+		failed = 1;
+		goto out;
+	}
+
+	/* count the APDUs that reach the reader */
+	reader_ops = reader->ops;
+	counting_ops = *reader_ops;
+	counting_ops.transmit = counting_transmit;
+	reader->ops = &counting_ops;
+
+	for (i = 0; tests[i].datalen; i++)
+		failed |= run_test(card, i);
+
+	reader->ops = reader_ops;
+out:
+	if (card)
+		sc_disconnect_card(card);
+	if (ctx)
+		sc_release_context(ctx);
+
+	snprintf(path, sizeof(path), "%s/card.conf", dir);
+	remove(path);
+	remove(conf);
+	rmdir(dir);
+
+	return failed;
+}
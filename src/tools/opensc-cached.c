@@ -0,0 +1,590 @@
+/*
+ * opensc-cached.c: In-memory cache of PKCS#15 files shared by local processes
+ *
+ * Copyright (C) 2017 OpenSC Project developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The daemon keeps the PKCS#15 files and object snapshots that libopensc
+ * would otherwise store in the file cache (see pkcs15-cache.c). A process
+ * binding a card asks the daemon first, so that only the first process
+ * after an insertion reads and decodes the directory files of the card.
+ * Every entry remembers the reader it was read from and is dropped when the
+ * card is removed from that reader.
+ *
+ * The cache belongs to one user: the socket is created in a directory that
+ * only the user can enter, and connections of other users are refused.
+ */
+
+#include "config.h"
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* struct ucred */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "util.h"
+
+static const char *app_name = "opensc-cached";
+
+static const char *opt_socket = NULL;
+static size_t opt_max_size = 16 * 1024 * 1024;
+static int verbose = 0;
+static volatile sig_atomic_t running = 1;
+
+static const struct option options[] = {
+	{ "socket",		1, NULL,		's' },
+	{ "max-size",		1, NULL,		'm' },
+	{ "verbose",		0, NULL,		'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *option_help[] = {
+	"Listen on socket <arg> [cache_socket of framework pkcs15]",
+	"Keep at most <arg> KiB of data [16384]",
+	"Verbose operation. Use several times to enable debug output.",
+};
+
+#define CACHE_HASH_SIZE	256
+
+struct cache_entry {
+	struct cache_entry *next;	/* hash chain */
+	struct cache_entry *prev_used, *next_used;	/* least recently used first */
+	char *key;
+	char *reader;
+	u8 *data;
+	size_t len;
+};
+
+static struct cache_entry *cache_hash[CACHE_HASH_SIZE];
+static struct cache_entry *lru_head, *lru_tail;
+static size_t cache_size = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define cache_lock()	pthread_mutex_lock(&cache_lock)
+#define cache_unlock()	pthread_mutex_unlock(&cache_lock)
+#else
+#define cache_lock()
+#define cache_unlock()
+#endif
+
+static unsigned int key_hash(const char *key)
+{
+	unsigned int h = 0;
+
+	while (*key)
+		h = h * 31 + (unsigned char)*key++;
+	return h % CACHE_HASH_SIZE;
+}
+
+static void lru_unlink(struct cache_entry *e)
+{
+	if (e->prev_used)
+		e->prev_used->next_used = e->next_used;
+	else
+		lru_head = e->next_used;
+	if (e->next_used)
+		e->next_used->prev_used = e->prev_used;
+	else
+		lru_tail = e->prev_used;
+	e->prev_used = e->next_used = NULL;
+}
+
+static void lru_append(struct cache_entry *e)
+{
+	e->prev_used = lru_tail;
+	e->next_used = NULL;
+	if (lru_tail)
+		lru_tail->next_used = e;
+	else
+		lru_head = e;
+	lru_tail = e;
+}
+
+static struct cache_entry *cache_find(const char *key)
+{
+	struct cache_entry *e;
+
+	for (e = cache_hash[key_hash(key)]; e; e = e->next)
+		if (!strcmp(e->key, key))
+			return e;
+	return NULL;
+}
+
+static void cache_remove(struct cache_entry *e)
+{
+	struct cache_entry **pe;
+
+	for (pe = &cache_hash[key_hash(e->key)]; *pe; pe = &(*pe)->next) {
+		if (*pe == e) {
+			*pe = e->next;
+			break;
+		}
+	}
+	lru_unlink(e);
+	cache_size -= e->len;
+	free(e->key);
+	free(e->reader);
+	free(e->data);
+	free(e);
+}
+
+/* Takes ownership of 'data' */
+static int cache_store(const char *key, const char *reader, u8 *data, size_t len)
+{
+	struct cache_entry *e;
+	unsigned int h = key_hash(key);
+
+	if (len > opt_max_size) {
+		free(data);
+		return SC_ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL || (e->key = strdup(key)) == NULL
+			|| (e->reader = strdup(reader)) == NULL) {
+		if (e) {
+			free(e->key);
+			free(e);
+		}
+		free(data);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	e->data = data;
+	e->len = len;
+
+	cache_lock();
+	if (cache_find(key))
+		cache_remove(cache_find(key));
+	while (lru_head && cache_size + len > opt_max_size)
+		cache_remove(lru_head);
+	e->next = cache_hash[h];
+	cache_hash[h] = e;
+	lru_append(e);
+	cache_size += len;
+	cache_unlock();
+
+	return SC_SUCCESS;
+}
+
+/* Drops all entries read from 'reader', or all entries if 'reader' is NULL */
+static unsigned int cache_drop(const char *reader)
+{
+	struct cache_entry *e, *next;
+	unsigned int count = 0;
+
+	cache_lock();
+	for (e = lru_head; e; e = next) {
+		next = e->next_used;
+		if (reader == NULL || !strcmp(e->reader, reader)) {
+			cache_remove(e);
+			count++;
+		}
+	}
+	cache_unlock();
+
+	return count;
+}
+
+static int sock_send(int fd, const void *ptr, size_t len)
+{
+	const u8 *p = ptr;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int sock_recv(int fd, void *ptr, size_t len)
+{
+	u8 *p = ptr;
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/* The user of the process at the other end of a Unix socket */
+static int peer_uid(int fd, uid_t *uid)
+{
+#if defined(HAVE_GETPEEREID)
+	gid_t gid;
+
+	return getpeereid(fd, uid, &gid);
+#elif defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || len != sizeof(cred))
+		return -1;
+	*uid = cred.uid;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/* Serves the request of one connection */
+static void serve_client(int fd)
+{
+	struct sc_pkcs15_cached_msg msg;
+	struct cache_entry *e;
+	char key[SC_PKCS15_CACHED_MAX_KEY + 1];
+	char reader[SC_PKCS15_CACHED_MAX_READER + 1];
+	struct timeval tv;
+	u8 *data = NULL;
+	size_t len = 0;
+	uid_t uid;
+
+	/* only processes of the user running the daemon share its cache */
+	if (peer_uid(fd, &uid) < 0 || uid != geteuid()) {
+		if (verbose)
+			fprintf(stderr, "refused a connection of another user\n");
+		return;
+	}
+
+	/* a client must not stall the other clients */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (sock_recv(fd, &msg, sizeof(msg))
+			|| msg.key_len == 0 || msg.key_len > SC_PKCS15_CACHED_MAX_KEY
+			|| msg.reader_len > SC_PKCS15_CACHED_MAX_READER
+			|| msg.data_len > SC_PKCS15_CACHED_MAX_DATA
+			|| sock_recv(fd, key, msg.key_len)
+			|| sock_recv(fd, reader, msg.reader_len))
+		return;
+	key[msg.key_len] = '\0';
+	reader[msg.reader_len] = '\0';
+
+	switch (msg.op) {
+	case SC_PKCS15_CACHED_GET:
+		/* the entry is copied, so that a slow client does not hold the
+		 * cache while the data is sent */
+		cache_lock();
+		e = cache_find(key);
+		if (e) {
+			lru_unlink(e);
+			lru_append(e);
+			data = malloc(e->len);
+			if (data) {
+				memcpy(data, e->data, e->len);
+				len = e->len;
+			}
+		}
+		cache_unlock();
+
+		memset(&msg, 0, sizeof(msg));
+		if (data) {
+			msg.op = SC_PKCS15_CACHED_FOUND;
+			msg.data_len = (unsigned int)len;
+			if (!sock_send(fd, &msg, sizeof(msg)))
+				sock_send(fd, data, len);
+			free(data);
+		}
+		else {
+			msg.op = SC_PKCS15_CACHED_MISS;
+			sock_send(fd, &msg, sizeof(msg));
+		}
+		if (verbose > 1)
+			fprintf(stderr, "%s %s\n", len ? "hit " : "miss", key);
+		break;
+	case SC_PKCS15_CACHED_PUT:
+		if (msg.data_len == 0)
+			break;
+		data = malloc(msg.data_len);
+		if (data == NULL)
+			break;
+		if (sock_recv(fd, data, msg.data_len)) {
+			free(data);
+			break;
+		}
+		if (cache_store(key, reader, data, msg.data_len) == SC_SUCCESS && verbose > 1)
+			fprintf(stderr, "store %s (%u bytes, reader '%s')\n", key, msg.data_len, reader);
+		break;
+	}
+}
+
+#ifdef HAVE_PTHREAD
+/* Drops the entries of a reader as soon as its card is removed */
+static void *watch_readers(void *arg)
+{
+	sc_context_t *ctx = arg;
+	struct sc_reader *event_reader;
+	unsigned int event, count;
+	void *reader_states = NULL;
+	int r;
+
+	while (running) {
+		event_reader = NULL;
+		r = sc_wait_for_event(ctx, SC_EVENT_CARD_REMOVED | SC_EVENT_READER_DETACHED,
+				&event_reader, &event, 1000, &reader_states);
+		if (r == SC_ERROR_EVENT_TIMEOUT)
+			continue;
+		if (r == SC_ERROR_NOT_SUPPORTED) {
+			fprintf(stderr, "The reader driver reports no card events, entries are kept until evicted\n");
+			break;
+		}
+		if (r < 0) {
+			/* the readers are unknown: nothing in the cache can be trusted */
+			count = cache_drop(NULL);
+			if (verbose && count)
+				fprintf(stderr, "dropped %u entries: %s\n", count, sc_strerror(r));
+			sleep(1);
+			continue;
+		}
+		if (!(event & (SC_EVENT_CARD_REMOVED | SC_EVENT_READER_DETACHED)))
+			continue;
+		count = cache_drop(event_reader ? event_reader->name : NULL);
+		if (verbose)
+			fprintf(stderr, "card removed from '%s', dropped %u entries\n",
+					event_reader ? event_reader->name : "unknown reader", count);
+	}
+
+	sc_wait_for_event(ctx, 0, NULL, NULL, 0, &reader_states);
+	return NULL;
+}
+#endif
+
+static void stop_daemon(int signo)
+{
+	running = 0;
+}
+
+/* The socket must be in a directory of the user that nobody else can enter,
+ * such as $XDG_RUNTIME_DIR, so that another user can neither connect to it
+ * nor replace it with a socket of their own. */
+static int check_socket_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	const char *p;
+	struct stat st;
+
+	p = strrchr(path, '/');
+	if (p == NULL) {
+		strcpy(dir, ".");
+	}
+	else if (p == path) {
+		strcpy(dir, "/");
+	}
+	else {
+		if ((size_t)(p - path) >= sizeof(dir))
+			return -1;
+		memcpy(dir, path, (size_t)(p - path));
+		dir[p - path] = '\0';
+	}
+
+	if (stat(dir, &st) < 0) {
+		fprintf(stderr, "Cannot use %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		fprintf(stderr, "%s must be a directory of the user with mode 0700\n", dir);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, r;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	if (check_socket_dir(path) < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	/* Replace the socket of a daemon that is gone, but not a running one */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Another daemon is listening on %s\n", path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+
+	mask = umask(077);
+	r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (r < 0 || chmod(path, S_IRUSR | S_IWUSR) < 0
+			|| listen(fd, 16) < 0) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	sc_context_t *ctx = NULL;
+	sc_context_param_t ctx_param;
+	struct sigaction sa;
+	struct pollfd pfd;
+	char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int c, long_optind = 0, fd, client, r;
+#ifdef HAVE_PTHREAD
+	pthread_t watcher;
+	int have_watcher = 0;
+#endif
+
+	while (1) {
+		c = getopt_long(argc, argv, "s:m:v", options, &long_optind);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 's':
+			opt_socket = optarg;
+			break;
+		case 'm':
+			opt_max_size = (size_t)strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			util_print_usage_and_die(app_name, options, option_help, NULL);
+		}
+	}
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver = 0;
+	ctx_param.app_name = app_name;
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	if (verbose > 2)
+		ctx->debug = verbose - 2;
+
+	if (opt_socket == NULL) {
+		r = sc_pkcs15_get_cache_socket(ctx, sock_path, sizeof(sock_path));
+		if (r == SC_ERROR_BUFFER_TOO_SMALL) {
+			fprintf(stderr, "The configured cache_socket is too long\n");
+			sc_release_context(ctx);
+			return 1;
+		}
+		if (r == SC_SUCCESS)
+			opt_socket = sock_path;
+	}
+	if (opt_socket == NULL) {
+		fprintf(stderr, "No socket given, and no cache_socket configured or no XDG_RUNTIME_DIR\n");
+		sc_release_context(ctx);
+		return 1;
+	}
+
+#if !defined(HAVE_GETPEEREID) && !defined(SO_PEERCRED)
+	fprintf(stderr, "The users of connections cannot be told apart on this system\n");
+	sc_release_context(ctx);
+	return 1;
+#endif
+	fd = open_socket(opt_socket);
+	if (fd < 0) {
+		sc_release_context(ctx);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_daemon;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+#ifdef HAVE_PTHREAD
+	/* the context is used by the watcher thread only from now on */
+	if (pthread_create(&watcher, NULL, watch_readers, ctx) == 0)
+		have_watcher = 1;
+	else
+		fprintf(stderr, "Cannot watch the readers, entries are kept until evicted\n");
+#else
+	fprintf(stderr, "Cannot watch the readers, entries are kept until evicted\n");
+#endif
+	if (verbose)
+		fprintf(stderr, "Listening on %s\n", opt_socket);
+
+	while (running) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		client = accept(fd, NULL, NULL);
+		if (client < 0)
+			continue;
+		serve_client(client);
+		close(client);
+	}
+
+	close(fd);
+	unlink(opt_socket);
+#ifdef HAVE_PTHREAD
+	if (have_watcher)
+		pthread_join(watcher, NULL);
+#endif
+	cache_drop(NULL);
+	sc_release_context(ctx);
+	return 0;
+}
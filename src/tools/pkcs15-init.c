@@ -38,6 +38,10 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 #include <openssl/opensslv.h>
 #include "libopensc/sc-ossl-compat.h"
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
@@ -81,6 +85,8 @@ typedef int	(*pkcs15_encoder)(sc_context_t *,
 
 /* Local functions */
 static int	open_reader_and_card(char *);
+static int	personalise_card(const struct sc_profile *);
+static int	personalise_all_readers(void);
 static int	do_assert_pristine(sc_card_t *);
 static int	do_erase(sc_card_t *, struct sc_profile *);
 static int	do_erase_application(sc_card_t *, struct sc_profile *);
@@ -93,7 +99,7 @@ static int	do_generate_skey(struct sc_profile *, const char *);
 static int	do_store_private_key(struct sc_profile *);
 static int	do_store_public_key(struct sc_profile *, EVP_PKEY *);
 static int	do_store_secret_key(struct sc_profile *);
-static int	do_store_certificate(struct sc_profile *);
+static int	do_store_certificate(struct sc_profile *, const char *);
 static int	do_update_certificate(struct sc_profile *);
 static int	do_convert_cert(sc_pkcs15_der_t *, X509 *);
 static int	is_cacert_already_present(struct sc_pkcs15init_certargs *);
@@ -149,6 +155,8 @@ enum {
 	OPT_UPDATE_EXISTING,
 	OPT_MD_CONTAINER_GUID,
 	OPT_VERSION,
+	OPT_BATCH,
+	OPT_ALL_READERS,
 
 	OPT_PIN1      = 0x10000,	/* don't touch these values */
 	OPT_PUK1      = 0x10001,
@@ -205,6 +213,8 @@ const struct option	options[] = {
 	{ "update-last-update", no_argument,       NULL,        OPT_UPDATE_LAST_UPDATE},
 	{ "ignore-ca-certificates",no_argument,    NULL,	OPT_IGNORE_CA_CERTIFICATES},
 	{ "update-existing",	no_argument,       NULL,	OPT_UPDATE_EXISTING},
+	{ "batch",		no_argument,       NULL,	OPT_BATCH},
+	{ "all-readers",	no_argument,       NULL,	OPT_ALL_READERS},
 
 	{ "extractable",	no_argument, NULL,		OPT_EXTRACTABLE },
 	{ "insecure",		no_argument, NULL,		OPT_INSECURE },
@@ -271,6 +281,8 @@ static const char *		option_help[] = {
 	"Update 'lastUpdate' attribut of tokenInfo",
 	"When storing PKCS#12 ignore CA certificates",
 	"Store or update existing certificate",
+	"Write the PKCS#15 directory files once, after all keys and certificates are stored",
+	"Personalise the cards in all readers in parallel",
 
 	"Private key stored as an extractable key",
 	"Insecure mode: do not require a PIN for private key",
@@ -336,6 +348,7 @@ static const char *action_names[] = {
 
 #define MAX_CERTS		4
 #define MAX_SECRETS		16
+#define MAX_BATCH		16
 struct secret {
 	int			type;
 	int			reference;
@@ -352,9 +365,16 @@ struct secret {
 #define SC_PKCS15INIT_TYPE_DATA		16
 #define SC_PKCS15INIT_TYPE_SKEY		32
 
+/* With --all-readers every worker thread has its own card */
+#ifdef HAVE_PTHREAD
+#define WORKER_LOCAL	__thread
+#else
+#define WORKER_LOCAL
+#endif
+
 static sc_context_t *	ctx = NULL;
-static sc_card_t *		card = NULL;
-static struct sc_pkcs15_card *	p15card = NULL;
+static WORKER_LOCAL sc_card_t *	card = NULL;
+static WORKER_LOCAL struct sc_pkcs15_card *	p15card = NULL;
 static char *			opt_reader = NULL;
 static unsigned int		opt_actions;
 static int			opt_extractable = 0,
@@ -364,7 +384,9 @@ static int			opt_extractable = 0,
 				opt_no_sopin = 0,
 				opt_use_defkeys = 0,
 				opt_wait = 0,
-				opt_verify_pin = 0;
+				opt_verify_pin = 0,
+				opt_batch = 0,
+				opt_all_readers = 0;
 static const char *		opt_profile = "pkcs15";
 static char *			opt_card_profile = NULL;
 static char *			opt_infile = NULL;
@@ -377,10 +399,16 @@ static char *			opt_pubkey_label = NULL;
 static char *			opt_secrkey_algo = NULL;
 static char *			opt_cert_label = NULL;
 static const char *		opt_pins[4];
+/* The PINs of the card being personalised: the command line PINs,
+ * completed by the PINs that were prompted for */
+static WORKER_LOCAL const char *	card_pins[4];
 static char *			pins[4];
 static char *			opt_serial = NULL;
 static const char *		opt_passphrase = NULL;
-static char *			opt_newkey = NULL;
+static char *			opt_newkeys[MAX_BATCH];
+static unsigned int		opt_newkey_count = 0;
+static char *			opt_certfiles[MAX_BATCH];
+static unsigned int		opt_certfile_count = 0;
 static char *			opt_outkey = NULL;
 static char *			opt_application_id = NULL;
 static char *			opt_application_name = NULL;
@@ -390,7 +418,7 @@ static char *			opt_md_container_guid = NULL;
 static unsigned int		opt_x509_usage = 0;
 static unsigned int		opt_delete_flags = 0;
 static unsigned int		opt_type = 0;
-static int			ignore_cmdline_pins = 0;
+static WORKER_LOCAL int		ignore_cmdline_pins = 0;
 static struct secret		opt_secrets[MAX_SECRETS];
 static unsigned int		opt_secret_count;
 static int			opt_ignore_ca_certs = 0;
@@ -449,7 +477,6 @@ static int	get_new_pin(sc_ui_hints_t *, const char *, const char *,
 int
 main(int argc, char **argv)
 {
-	struct sc_profile	*profile = NULL;
 	unsigned int		n;
 	int			r = 0;
 
@@ -487,21 +514,51 @@ main(int argc, char **argv)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 	}
 
+	if (opt_all_readers && opt_reader) {
+		fprintf(stderr, "The --all-readers and --reader options are mutually exclusive.\n");
+		util_print_usage_and_die(app_name, options, option_help, NULL);
+	}
+
+	sc_pkcs15init_set_callbacks(&callbacks);
+
+	if (opt_all_readers)
+		return personalise_all_readers();
+
 	/* Connect to the card */
 	if (!open_reader_and_card(opt_reader))
 		return 1;
 
-	sc_pkcs15init_set_callbacks(&callbacks);
+	r = personalise_card(NULL);
+
+	sc_disconnect_card(card);
+	card = NULL;
+
+	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
+		free(pins[n]);
+	}
+
+	sc_release_context(ctx);
+	return r < 0? 1 : 0;
+}
+
+/*
+ * Run the requested actions on the card. The profile is copied from
+ * template when it was loaded for another card of the same kind.
+ */
+static int
+personalise_card(const struct sc_profile *template)
+{
+	struct sc_profile	*profile = NULL;
+	unsigned int		n, i;
+	int			r;
+
+	memcpy(card_pins, opt_pins, sizeof(card_pins));
 
 	/* Bind the card-specific operations and load the profile */
-	r = sc_pkcs15init_bind(card, opt_profile, opt_card_profile, NULL, &profile);
+	r = sc_pkcs15init_bind_copy(card, opt_profile, opt_card_profile, template, &profile);
 	if (r < 0) {
 		printf("Couldn't bind to the card: %s\n", sc_strerror(r));
-		return 1;
-	}
-
-	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
-		pins[n] = NULL;
+		goto out;
 	}
 
 	for (n = 0; n < ACTION_MAX; n++) {
@@ -521,7 +578,8 @@ main(int argc, char **argv)
 				aid.len = sizeof(aid.value);
 				if (sc_hex_to_bin(opt_bind_to_aid, aid.value, &aid.len))   {
 					fprintf(stderr, "Invalid AID value: '%s'\n", opt_bind_to_aid);
-					return 1;
+					r = SC_ERROR_INVALID_ARGUMENTS;
+					break;
 				}
 
 				r = sc_pkcs15init_finalize_profile(card, profile, &aid);
@@ -548,6 +606,14 @@ main(int argc, char **argv)
 
 			sc_pkcs15init_set_p15card(profile, p15card);
 
+			if (opt_batch)   {
+				r = sc_pkcs15init_begin_batch(profile);
+				if (r < 0)   {
+					fprintf(stderr, "Failed to start batch: %s\n", sc_strerror(r));
+					break;
+				}
+			}
+
 			if (opt_verify_pin)   {
 				r = verify_pin(p15card, opt_authid);
 				if (r)   {
@@ -589,7 +655,8 @@ main(int argc, char **argv)
 			r = do_store_secret_key(profile);
 			break;
 		case ACTION_STORE_CERT:
-			r = do_store_certificate(profile);
+			for (i = 0; i < opt_certfile_count && r >= 0; i++)
+				r = do_store_certificate(profile, opt_certfiles[i]);
 			break;
 		case ACTION_UPDATE_CERT:
 			r = do_update_certificate(profile);
@@ -604,9 +671,11 @@ main(int argc, char **argv)
 			r = do_change_attributes(profile, opt_type);
 			break;
 		case ACTION_GENERATE_KEY:
-			r = do_generate_key(profile, opt_newkey);
-			if (r == SC_ERROR_INVALID_ARGUMENTS)
-				r = do_generate_skey(profile, opt_newkey);
+			for (i = 0; i < opt_newkey_count && r >= 0; i++)   {
+				r = do_generate_key(profile, opt_newkeys[i]);
+				if (r == SC_ERROR_INVALID_ARGUMENTS)
+					r = do_generate_skey(profile, opt_newkeys[i]);
+			}
 			break;
 		case ACTION_FINALIZE_CARD:
 			r = do_finalize_card(card, profile);
@@ -621,7 +690,8 @@ main(int argc, char **argv)
 			r = do_erase_application(card, profile);
 			break;
 		default:
-			util_fatal("Action not yet implemented\n");
+			util_error("Action not yet implemented\n");
+			r = SC_ERROR_NOT_IMPLEMENTED;
 		}
 
 		if (r < 0) {
@@ -631,8 +701,15 @@ main(int argc, char **argv)
 		}
 	}
 
-	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
-		free(pins[n]);
+	/* write what has been stored so far, even if an action failed */
+	if (p15card && profile->batch.state != SC_PKCS15INIT_BATCH_NONE)   {
+		int rv = sc_pkcs15init_end_batch(p15card, profile);
+		if (rv < 0)   {
+			fprintf(stderr, "Failed to update PKCS#15 directory files: %s\n",
+				sc_strerror(rv));
+			if (r >= 0)
+				r = rv;
+		}
 	}
 
 out:
@@ -641,12 +718,9 @@ out:
 	}
 	if (p15card) {
 		sc_pkcs15_unbind(p15card);
+		p15card = NULL;
 	}
-	if (card) {
-		sc_disconnect_card(card);
-	}
-	sc_release_context(ctx);
-	return r < 0? 1 : 0;
+	return r;
 }
 
 static int
@@ -676,6 +750,244 @@ open_reader_and_card(char *reader)
 	return 1;
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * Locking for the context shared by the worker threads
+ */
+static int
+worker_create_mutex(void **m)
+{
+	pthread_mutex_t	*mutex;
+
+	mutex = calloc(1, sizeof(*mutex));
+	if (mutex == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (pthread_mutex_init(mutex, NULL)) {
+		free(mutex);
+		return SC_ERROR_INTERNAL;
+	}
+	*m = mutex;
+	return SC_SUCCESS;
+}
+
+static int
+worker_lock_mutex(void *m)
+{
+	return pthread_mutex_lock((pthread_mutex_t *) m) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int
+worker_unlock_mutex(void *m)
+{
+	return pthread_mutex_unlock((pthread_mutex_t *) m) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int
+worker_destroy_mutex(void *m)
+{
+	pthread_mutex_destroy((pthread_mutex_t *) m);
+	free(m);
+	return SC_SUCCESS;
+}
+
+static sc_thread_context_t worker_thread_ctx = {
+	0, worker_create_mutex, worker_lock_mutex,
+	worker_unlock_mutex, worker_destroy_mutex, NULL
+};
+
+struct card_worker {
+	sc_reader_t *	reader;
+	sc_card_t *	card;
+	struct sc_profile *template;
+	pthread_t	thread;
+	int		started;
+	int		result;
+	struct timeval	start, end;
+};
+
+static void *
+card_worker_main(void *arg)
+{
+	struct card_worker *worker = (struct card_worker *) arg;
+
+	card = worker->card;
+	gettimeofday(&worker->start, NULL);
+	worker->result = personalise_card(worker->template);
+	gettimeofday(&worker->end, NULL);
+	return NULL;
+}
+
+/*
+ * Wait until a card is present in one of the readers
+ */
+static int
+wait_for_card(void)
+{
+	sc_reader_t	*found = NULL;
+	unsigned int	n, event;
+	int		r;
+
+	for (n = 0; n < sc_ctx_get_reader_count(ctx); n++)
+		if (sc_detect_card_presence(sc_ctx_get_reader(ctx, n)) & SC_READER_CARD_PRESENT)
+			return SC_SUCCESS;
+
+	if (sc_ctx_get_reader_count(ctx) == 0) {
+		fprintf(stderr, "Waiting for a reader to be attached...\n");
+		r = sc_wait_for_event(ctx, SC_EVENT_READER_ATTACHED, &found, &event, -1, NULL);
+		if (r < 0) {
+			fprintf(stderr, "Error while waiting for a reader: %s\n", sc_strerror(r));
+			return r;
+		}
+		r = sc_ctx_detect_readers(ctx);
+		if (r < 0) {
+			fprintf(stderr, "Error while refreshing readers: %s\n", sc_strerror(r));
+			return r;
+		}
+	}
+	fprintf(stderr, "Waiting for a card to be inserted...\n");
+	r = sc_wait_for_event(ctx, SC_EVENT_CARD_INSERTED, &found, &event, -1, NULL);
+	if (r < 0)
+		fprintf(stderr, "Error while waiting for a card: %s\n", sc_strerror(r));
+	return r;
+}
+
+/*
+ * Connect to the cards in all readers, run the requested actions on
+ * each of them in its own thread and report the result per card.
+ * The profile is loaded once for each card driver, and every worker
+ * gets its own copy of it.
+ */
+static int
+personalise_all_readers(void)
+{
+	sc_context_param_t	ctx_param;
+	struct card_worker	*workers;
+	unsigned int		n, m, count, nworkers = 0, done = 0, failed = 0;
+	int			r;
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver        = 0;
+	ctx_param.app_name   = app_name;
+	ctx_param.thread_ctx = &worker_thread_ctx;
+
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r) {
+		util_error("Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+
+	if (verbose > 1) {
+		ctx->debug = verbose;
+		sc_ctx_log_to_file(ctx, "stderr");
+	}
+
+	if (opt_wait && wait_for_card() < 0) {
+		sc_release_context(ctx);
+		return 1;
+	}
+
+	count = sc_ctx_get_reader_count(ctx);
+	workers = calloc(count ? count : 1, sizeof(*workers));
+	if (workers == NULL) {
+		util_error("Not enough memory");
+		sc_release_context(ctx);
+		return 1;
+	}
+
+	/* Card drivers are matched one card at a time */
+	for (n = 0; n < count; n++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, n);
+
+		if (!(sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			continue;
+
+		r = sc_connect_card(reader, &workers[nworkers].card);
+		if (r < 0) {
+			fprintf(stderr, "%s: failed to connect to card: %s\n",
+				reader->name, sc_strerror(r));
+			failed++;
+			continue;
+		}
+		workers[nworkers].reader = reader;
+		nworkers++;
+	}
+
+	if (nworkers == 0 && failed == 0)
+		fprintf(stderr, "No card found in any reader.\n");
+
+	/* Load the profile once for the first card of each driver. The
+	 * workers of the cards without a template load their own. */
+	for (n = 0; n < nworkers; n++) {
+		struct card_worker *worker = &workers[n];
+
+		for (m = 0; m < n; m++)
+			if (workers[m].card->driver == worker->card->driver)
+				break;
+		if (m < n) {
+			worker->template = workers[m].template;
+			continue;
+		}
+		r = sc_pkcs15init_bind(worker->card, opt_profile, opt_card_profile,
+				NULL, &worker->template);
+		if (r < 0)
+			worker->template = NULL;
+	}
+
+	for (n = 0; n < nworkers; n++) {
+		struct card_worker *worker = &workers[n];
+
+		if (pthread_create(&worker->thread, NULL, card_worker_main, worker)) {
+			worker->result = SC_ERROR_INTERNAL;
+			continue;
+		}
+		worker->started = 1;
+	}
+
+	for (n = 0; n < nworkers; n++)
+		if (workers[n].started)
+			pthread_join(workers[n].thread, NULL);
+
+	printf("\n%-40s %10s  %s\n", "Reader", "Time (ms)", "Result");
+	for (n = 0; n < nworkers; n++) {
+		struct card_worker *worker = &workers[n];
+		long msec = 0;
+
+		if (worker->started)
+			msec = (worker->end.tv_sec - worker->start.tv_sec) * 1000
+				+ (worker->end.tv_usec - worker->start.tv_usec) / 1000;
+		printf("%-40.40s %10ld  %s\n", worker->reader->name, msec,
+			sc_strerror(worker->result));
+		if (worker->result < 0)
+			failed++;
+		else
+			done++;
+	}
+	printf("%u card(s) personalised, %u failed\n", done, failed);
+
+	/* the templates refer to the cards they were loaded for */
+	for (n = 0; n < nworkers; n++) {
+		for (m = 0; m < n; m++)
+			if (workers[m].template == workers[n].template)
+				break;
+		if (m == n && workers[n].template)
+			sc_pkcs15init_unbind(workers[n].template);
+	}
+	for (n = 0; n < nworkers; n++)
+		sc_disconnect_card(workers[n].card);
+
+	free(workers);
+	sc_release_context(ctx);
+	return failed ? 1 : 0;
+}
+#else
+static int
+personalise_all_readers(void)
+{
+	util_error("--all-readers is not supported on this platform\n");
+	return 1;
+}
+#endif
+
 /*
  * Make sure there's no pkcs15 structure on the card
  */
@@ -864,10 +1176,10 @@ do_init_app(struct sc_profile *profile)
 
 	/* If it's the onepin option, we need the user PIN iso the SO PIN */
 	if (opt_profile && strstr(opt_profile, "+onepin")) {
-		if (opt_pins[0])
-			opt_pins[2] = opt_pins[0];
-		if (opt_pins[1])
-			opt_pins[3] = opt_pins[1];
+		if (card_pins[0])
+			card_pins[2] = card_pins[0];
+		if (card_pins[1])
+			card_pins[3] = card_pins[1];
 	}
 
 	memset(&args, 0, sizeof(args));
@@ -885,14 +1197,14 @@ do_init_app(struct sc_profile *profile)
 		so_puk_disabled = 1;
 
 
-	if (!opt_pins[2] && !opt_use_pinpad && !opt_no_sopin) {
+	if (!card_pins[2] && !opt_use_pinpad && !opt_no_sopin) {
 		r = get_new_pin(&hints, role, "pin", &pins[2]);
 		if (r < 0)
 			goto failed;
-		opt_pins[2] = pins[2];
+		card_pins[2] = pins[2];
 	}
 
-	if (!so_puk_disabled && opt_pins[2] && !opt_pins[3] && !opt_use_pinpad) {
+	if (!so_puk_disabled && card_pins[2] && !card_pins[3] && !opt_use_pinpad) {
 		sc_pkcs15init_get_pin_info(profile, SC_PKCS15INIT_SO_PUK, &info);
 
 		if (!(info.attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN))
@@ -902,15 +1214,15 @@ do_init_app(struct sc_profile *profile)
 		r = get_new_pin(&hints, role, "puk", &pins[3]);
 		if (r < 0)
 			goto failed;
-		opt_pins[3] = pins[3];
+		card_pins[3] = pins[3];
 	}
 
-	args.so_pin = (const u8 *) opt_pins[2];
+	args.so_pin = (const u8 *) card_pins[2];
 	if (args.so_pin)
 		args.so_pin_len = strlen((const char *) args.so_pin);
 
 	if (!so_puk_disabled)   {
-		args.so_puk = (const u8 *) opt_pins[3];
+		args.so_puk = (const u8 *) card_pins[3];
 		if (args.so_puk)
 			args.so_puk_len = strlen((const char *) args.so_puk);
 	}
@@ -958,38 +1270,38 @@ do_store_pin(struct sc_profile *profile)
 	}
 
 	sc_pkcs15init_get_pin_info(profile, SC_PKCS15INIT_USER_PIN, &info);
-	if (opt_pins[0] == NULL) {
+	if (card_pins[0] == NULL) {
 		if ((r = get_new_pin(&hints, "user", "pin", &pins[0])) < 0)
 			goto failed;
-		opt_pins[0] = pins[0];
+		card_pins[0] = pins[0];
 	}
 
-	if (*opt_pins[0] == '\0') {
+	if (*card_pins[0] == '\0') {
 		util_error("You must specify a PIN\n");
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 
 	memset(&args, 0, sizeof(args));
 	sc_pkcs15_format_id(pin_id, &args.auth_id);
-	args.pin = (u8 *) opt_pins[0];
-	args.pin_len = strlen(opt_pins[0]);
+	args.pin = (u8 *) card_pins[0];
+	args.pin_len = strlen(card_pins[0]);
 	args.label = opt_label;
 
 	if (!(info.attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCK_DISABLED)
-			&& opt_pins[1] == NULL) {
+			&& card_pins[1] == NULL) {
 		sc_pkcs15init_get_pin_info(profile, SC_PKCS15INIT_USER_PUK, &info);
 
 		hints.flags |= SC_UI_PIN_OPTIONAL;
 		if ((r = get_new_pin(&hints, "user", "puk", &pins[1])) < 0)
 			goto failed;
-		opt_pins[1] = pins[1];
+		card_pins[1] = pins[1];
 	}
 
-	if (opt_puk_authid && opt_pins[1])
+	if (opt_puk_authid && card_pins[1])
 		sc_pkcs15_format_id(opt_puk_authid, &args.puk_id);
 	args.puk_label = opt_puk_label;
-	args.puk = (u8 *) opt_pins[1];
-	args.puk_len = opt_pins[1]? strlen(opt_pins[1]) : 0;
+	args.puk = (u8 *) card_pins[1];
+	args.puk_len = card_pins[1]? strlen(card_pins[1]) : 0;
 
 	r = sc_lock(p15card->card);
 	if (r < 0)
@@ -1253,7 +1565,7 @@ do_store_secret_key(struct sc_profile *profile)
  * Download certificate to card
  */
 static int
-do_store_certificate(struct sc_profile *profile)
+do_store_certificate(struct sc_profile *profile, const char *filename)
 {
 	struct sc_pkcs15init_certargs args;
 	X509	*cert = NULL;
@@ -1270,7 +1582,7 @@ do_store_certificate(struct sc_profile *profile)
 	args.label = (opt_cert_label != 0 ? opt_cert_label : opt_label);
 	args.authority = opt_authority;
 
-	r = do_read_certificate(opt_infile, opt_format, &cert);
+	r = do_read_certificate(filename, opt_format, &cert);
 	if (r >= 0)
 		r = do_convert_cert(&args.der_encoded, cert);
 	if (r >= 0) {
@@ -1636,7 +1948,9 @@ do_delete_objects(struct sc_profile *profile, unsigned int myopt_delete_flags)
 			r = sc_pkcs15_find_data_object_by_name(p15card, opt_application_name, opt_label, &obj);
 		}
 		else {
-			util_fatal("Specify the --application-id or --application-name and --label for the data object to be deleted\n");
+			util_error("Specify the --application-id or --application-name and --label for the data object to be deleted\n");
+			sc_unlock(p15card->card);
+			return SC_ERROR_INVALID_ARGUMENTS;
 		}
 
 		if (r >= 0) {
@@ -1648,8 +1962,11 @@ do_delete_objects(struct sc_profile *profile, unsigned int myopt_delete_flags)
 
 	if (myopt_delete_flags & (SC_PKCS15INIT_TYPE_PRKEY | SC_PKCS15INIT_TYPE_PUBKEY | SC_PKCS15INIT_TYPE_CHAIN | SC_PKCS15INIT_TYPE_SKEY)) {
 		sc_pkcs15_id_t id;
-		if (opt_objectid == NULL)
-				util_fatal("Specify the --id for key(s) or cert(s) to be deleted\n");
+		if (opt_objectid == NULL) {
+			util_error("Specify the --id for key(s) or cert(s) to be deleted\n");
+			sc_unlock(p15card->card);
+			return SC_ERROR_INVALID_ARGUMENTS;
+		}
 		sc_pkcs15_format_id(opt_objectid, &id);
 
 		r = do_delete_crypto_objects(p15card, profile, &id, myopt_delete_flags);
@@ -1983,19 +2300,19 @@ get_pin_callback(struct sc_profile *profile,
 			switch (id) {
 			case SC_PKCS15INIT_USER_PIN:
 				name = "User PIN";
-				secret = (char *) opt_pins[OPT_PIN1 & 3];
+				secret = (char *) card_pins[OPT_PIN1 & 3];
 				break;
 			case SC_PKCS15INIT_USER_PUK:
 				name = "User PIN unlock key";
-				secret = (char *) opt_pins[OPT_PUK1 & 3];
+				secret = (char *) card_pins[OPT_PUK1 & 3];
 				break;
 			case SC_PKCS15INIT_SO_PIN:
 				name = "Security officer PIN";
-				secret = (char *) opt_pins[OPT_PIN2 & 3];
+				secret = (char *) card_pins[OPT_PIN2 & 3];
 				break;
 			case SC_PKCS15INIT_SO_PUK:
 				name = "Security officer PIN unlock key";
-				secret = (char *) opt_pins[OPT_PUK2 & 3];
+				secret = (char *) card_pins[OPT_PUK2 & 3];
 				break;
 			}
 		}
@@ -2003,22 +2320,22 @@ get_pin_callback(struct sc_profile *profile,
 			if (!(info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN)
 					&& !(info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN))    {
 				name = "User PIN";
-				secret = (char *) opt_pins[OPT_PIN1 & 3];
+				secret = (char *) card_pins[OPT_PIN1 & 3];
 			}
 			else if (!(info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN)
 					&& (info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN))    {
 				name = "User PUK";
-				secret = (char *) opt_pins[OPT_PUK1 & 3];
+				secret = (char *) card_pins[OPT_PUK1 & 3];
 			}
 			else if ((info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN)
 					&& !(info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN))    {
 				name = "Security officer PIN";
-				secret = (char *) opt_pins[OPT_PIN2 & 3];
+				secret = (char *) card_pins[OPT_PIN2 & 3];
 			}
 			else if ((info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN)
 					&& (info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_UNBLOCKING_PIN))    {
 				name = "Security officer PIN unlock key";
-				secret = (char *) opt_pins[OPT_PUK2 & 3];
+				secret = (char *) card_pins[OPT_PUK2 & 3];
 			}
 		}
 		if (secret)
@@ -2118,6 +2435,10 @@ get_key_callback(struct sc_profile *profile,
 	}
 
 	printf("Transport key (%s #%d) required.\n", kind, reference);
+	if (opt_all_readers) {
+		fprintf(stderr, "Use --use-default-transport-keys with --all-readers\n");
+		return SC_ERROR_NOT_SUPPORTED;
+	}
 	if (opt_use_pinpad) {
 		printf("\n"
 		"Refusing to prompt for transport key because --use-pinpad\n"
@@ -2219,8 +2540,11 @@ do_read_pem_private_key(const char *filename, const char *passphrase,
 	BIO	*bio;
 
 	bio = BIO_new(BIO_s_file());
-	if (BIO_read_filename(bio, filename) <= 0)
-		util_fatal("Unable to open %s: %m", filename);
+	if (BIO_read_filename(bio, filename) <= 0) {
+		util_error("Unable to open %s: %m", filename);
+		BIO_free(bio);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
 	*key = PEM_read_bio_PrivateKey(bio, NULL, pass_cb, (char *) passphrase);
 	BIO_free(bio);
 	if (*key == NULL) {
@@ -2244,8 +2568,11 @@ do_read_pkcs12_private_key(const char *filename, const char *passphrase,
 	*key = NULL;
 
 	bio = BIO_new(BIO_s_file());
-	if (BIO_read_filename(bio, filename) <= 0)
-		util_fatal("Unable to open %s: %m", filename);
+	if (BIO_read_filename(bio, filename) <= 0) {
+		util_error("Unable to open %s: %m", filename);
+		BIO_free(bio);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
 	p12 = d2i_PKCS12_bio(bio, NULL);
 	BIO_free(bio);
 
@@ -2324,7 +2651,7 @@ do_read_private_key(const char *filename, const char *format,
 		free(passphrase);
 
 	if (r < 0)
-		util_fatal("Unable to read private key from %s\n", filename);
+		util_error("Unable to read private key from %s\n", filename);
 
 	return r;
 }
@@ -2339,8 +2666,11 @@ do_read_pem_public_key(const char *filename)
 	EVP_PKEY	*pk;
 
 	bio = BIO_new(BIO_s_file());
-	if (BIO_read_filename(bio, filename) <= 0)
-		util_fatal("Unable to open %s: %m", filename);
+	if (BIO_read_filename(bio, filename) <= 0) {
+		util_error("Unable to open %s: %m", filename);
+		BIO_free(bio);
+		return NULL;
+	}
 	pk = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL);
 	BIO_free(bio);
 	if (pk == NULL)
@@ -2355,8 +2685,11 @@ do_read_der_public_key(const char *filename)
 	EVP_PKEY *pk;
 
 	bio = BIO_new(BIO_s_file());
-	if (BIO_read_filename(bio, filename) <= 0)
-		util_fatal("Unable to open %s: %m", filename);
+	if (BIO_read_filename(bio, filename) <= 0) {
+		util_error("Unable to open %s: %m", filename);
+		BIO_free(bio);
+		return NULL;
+	}
 	pk = d2i_PUBKEY_bio(bio, NULL);
 	BIO_free(bio);
 	if (pk == NULL)
@@ -2372,13 +2705,16 @@ do_read_public_key(const char *name, const char *format, EVP_PKEY **out)
 	} else if (!strcasecmp(format, "der")) {
 		*out = do_read_der_public_key(name);
 	} else {
-		util_fatal("Error when reading public key. "
+		util_error("Error when reading public key. "
 		      "File format \"%s\" not supported.\n",
 		      format);
+		return SC_ERROR_NOT_SUPPORTED;
 	}
 
-	if (!*out)
-		util_fatal("Unable to read public key from %s\n", name);
+	if (!*out) {
+		util_error("Unable to read public key from %s\n", name);
+		return SC_ERROR_CANNOT_LOAD_KEY;
+	}
 	return 0;
 }
 
@@ -2392,8 +2728,11 @@ do_read_pem_certificate(const char *filename)
 	X509	*xp;
 
 	bio = BIO_new(BIO_s_file());
-	if (BIO_read_filename(bio, filename) <= 0)
-		util_fatal("Unable to open %s: %m", filename);
+	if (BIO_read_filename(bio, filename) <= 0) {
+		util_error("Unable to open %s: %m", filename);
+		BIO_free(bio);
+		return NULL;
+	}
 	xp = PEM_read_bio_X509(bio, NULL, NULL, NULL);
 	BIO_free(bio);
 	if (xp == NULL)
@@ -2408,8 +2747,11 @@ do_read_der_certificate(const char *filename)
 	X509	*xp;
 
 	bio = BIO_new(BIO_s_file());
-	if (BIO_read_filename(bio, filename) <= 0)
-		util_fatal("Unable to open %s: %m", filename);
+	if (BIO_read_filename(bio, filename) <= 0) {
+		util_error("Unable to open %s: %m", filename);
+		BIO_free(bio);
+		return NULL;
+	}
 	xp = d2i_X509_bio(bio, NULL);
 	BIO_free(bio);
 	if (xp == NULL)
@@ -2425,40 +2767,50 @@ do_read_certificate(const char *name, const char *format, X509 **out)
 	} else if (!strcasecmp(format, "der")) {
 		*out = do_read_der_certificate(name);
 	} else {
-		util_fatal("Error when reading certificate. "
+		util_error("Error when reading certificate. "
 		      "File format \"%s\" not supported.\n",
 		      format);
+		return SC_ERROR_NOT_SUPPORTED;
 	}
 
-	if (!*out)
-		util_fatal("Unable to read certificate from %s\n", name);
+	if (!*out) {
+		util_error("Unable to read certificate from %s\n", name);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
 	return 0;
 }
 
-static size_t determine_filesize(const char *filename)
+static int determine_filesize(const char *filename, size_t *size)
 {
 	FILE *fp;
 	long ll;
 
-	if ((fp = fopen(filename,"rb")) == NULL)
-		util_fatal("Unable to open %s: %m", filename);
+	if ((fp = fopen(filename,"rb")) == NULL) {
+		util_error("Unable to open %s: %m", filename);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
 
 	fseek(fp,0L,SEEK_END);
 	ll = ftell(fp);
-	if (ll == -1l)
-		util_fatal("fseek/ftell error");
-
 	fclose(fp);
-	return (size_t)ll;
+	if (ll == -1l) {
+		util_error("fseek/ftell error");
+		return SC_ERROR_INTERNAL;
+	}
+
+	*size = (size_t)ll;
+	return 0;
 }
 
 static int
 do_read_data_object(const char *name, u8 **out, size_t *outlen, size_t expected)
 {
 	FILE *inf;
-	size_t filesize = expected ? expected : determine_filesize(name);
+	size_t filesize = expected;
 	int c;
 
+	if (!filesize && (c = determine_filesize(name, &filesize)) < 0)
+		return c;
 	*out = malloc(filesize);
 	if (*out == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
@@ -2679,7 +3031,9 @@ handle_option(const struct option *opt)
 		break;
 	case 'G':
 		this_action = ACTION_GENERATE_KEY;
-		opt_newkey = optarg;
+		if (opt_newkey_count >= MAX_BATCH)
+			util_fatal("Too many keys to generate (max %d)", MAX_BATCH);
+		opt_newkeys[opt_newkey_count++] = optarg;
 		break;
 	case 'S':
 		this_action = ACTION_STORE_PRIVKEY;
@@ -2690,7 +3044,9 @@ handle_option(const struct option *opt)
 		break;
 	case 'X':
 		this_action = ACTION_STORE_CERT;
-		opt_infile = optarg;
+		if (opt_certfile_count >= MAX_BATCH)
+			util_fatal("Too many certificates to store (max %d)", MAX_BATCH);
+		opt_certfiles[opt_certfile_count++] = optarg;
 		break;
 	case 'U':
 		this_action = ACTION_UPDATE_CERT;
@@ -2842,11 +3198,20 @@ handle_option(const struct option *opt)
 	case OPT_VERSION:
 		this_action = ACTION_PRINT_VERSION;
 		break;
+	case OPT_BATCH:
+		opt_batch = 1;
+		break;
+	case OPT_ALL_READERS:
+		opt_all_readers = 1;
+		break;
 	default:
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 	}
 
-	if ((opt_actions & (1 << this_action)) && opt->has_arg != no_argument) {
+	/* several keys and certificates can be stored in one run */
+	if ((opt_actions & (1 << this_action)) && opt->has_arg != no_argument
+			&& this_action != ACTION_GENERATE_KEY
+			&& this_action != ACTION_STORE_CERT) {
 		fprintf(stderr, "Error: you cannot specify option");
 		if (opt->name)
 			fprintf(stderr, " --%s", opt->name);
@@ -3001,6 +3366,14 @@ int get_pin(sc_ui_hints_t *hints, char **out)
 	if (pin_info && (pin_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN))
 		return SC_ERROR_NOT_SUPPORTED;
 
+	/* the workers cannot share the terminal */
+	if (opt_all_readers) {
+		fprintf(stderr, "%s required: PINs have to be given on the "
+			"command line with --all-readers\n",
+			hints->obj_label ? hints->obj_label : "PIN");
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
 	if (!(label = hints->obj_label)) {
 		if (pin_info == NULL)
 			label = "PIN";
@@ -3135,8 +3508,8 @@ static int verify_pin(struct sc_pkcs15_card *p15card, char *auth_id_str)
 		return -1;
 	}
 
-	if (opt_pins[0] != NULL)   {
-		pin = (char *) opt_pins[0];
+	if (card_pins[0] != NULL)   {
+		pin = (char *) card_pins[0];
 	}
 	else   {
 		sc_ui_hints_t   hints;
@@ -3164,7 +3537,7 @@ static int verify_pin(struct sc_pkcs15_card *p15card, char *auth_id_str)
 	if (r < 0)
 		fprintf(stderr, "Operation failed: %s\n", sc_strerror(r));
 
-	if (NULL == opt_pins[0])
+	if (NULL == card_pins[0])
 		free(pin);
 
 	return r;